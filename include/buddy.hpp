@@ -2,7 +2,6 @@
 #include <cassert>
 #include <cstdint>
 #include <cstddef>
-#include <list>
 #include <vector>
 
 template <size_t elem_size = 4096> class BuddyAllocator {
@@ -11,7 +10,7 @@ public:
 
     /**
      * @brief 构造函数
-     * @param total_elems 总页数
+     * @param total_elems 总页数，不必是2^max_order的整数倍，末尾不足最大块的部分切分为较小的块
      * @param max_order 最大阶数
      * @param elem_size 每页的大小
      */
@@ -34,12 +33,76 @@ public:
         free_idx(page_base / elem_size, order);
     }
 
+    /**
+     * @brief 分配恰好n页的连续内存，不向上取整到2的幂
+     * @param n 页数，不超过2^max_order
+     * @return 成功时返回页基址（按不小于n的最小2的幂对齐），失败时返回0
+     * @note 先分配能容纳n页的最小块，再把多出的尾部按对齐切分后放回较低阶的空闲链表
+     */
+    uint64_t allocate_pages(elem_idx_t n);
+
+    /**
+     * @brief 释放由allocate_pages分配的n页
+     * @param page_base 起始页地址
+     * @param n 页数，须与分配时相同
+     * @note 也可以释放任意一段已分配的连续页，如2^order块中的一部分
+     */
+    void free_pages(uint64_t page_base, elem_idx_t n) {
+        assert(page_base % elem_size == 0);
+        free_range(page_base / elem_size, n);
+    }
+
+    /**
+     * @brief 分配指定位置的块，用于内存整理时预留目标区域中的空闲页
+     * @param page_base 块的起始页地址，须按2^order页对齐
+     * @param order 块的阶（页数为2^order）
+     * @return 成功返回0；该块并非完全空闲时返回-1，不做任何修改
+     */
+    int allocate_at(uint64_t page_base, uint8_t order);
+
     /**
      * @brief 获取已分配出的内存大小
      * @return 已分配出的物理内存大小，单位为字节
      */
     size_t get_usage() const { return m_elem_usage * elem_size; }
 
+    /**
+     * @brief 获取各阶空闲块的数量
+     * @return 下标为阶，长度为max_order + 1
+     */
+    std::vector<size_t> get_free_counts() const { return m_free_counts; }
+
+    /**
+     * @brief 获取最大空闲块的阶
+     * @return 最大空闲块的阶，没有空闲页时返回-1
+     */
+    int largest_free_order() const;
+
+    /**
+     * @brief 计算碎片化指数：空闲页中处在小于2^order页的块里、无法用于该分配的比例
+     * @param order 关心的分配的阶
+     * @return 取值[0, 1]，0表示空闲页都在足够大的块中，接近1表示空闲页虽多但都很零散；
+     *         没有空闲页时返回0
+     */
+    double fragmentation_index(uint8_t order) const;
+
+    // 一个空闲块：起始页地址与阶
+    struct FreeBlock {
+        uint64_t page_base;
+        uint8_t order;
+    };
+
+    /**
+     * @brief 按地址递增的顺序列出所有空闲块，用于保存快照
+     */
+    std::vector<FreeBlock> get_free_blocks() const;
+
+    /**
+     * @brief 丢弃当前状态，使且仅使blocks中的块空闲，用于从快照恢复
+     * @param blocks 由get_free_blocks得到的空闲块，块之间不得重叠
+     */
+    void set_free_blocks(const std::vector<FreeBlock> &blocks);
+
 private:
     const elem_idx_t total_pages;
     const uint8_t max_order;
@@ -59,8 +122,30 @@ private:
      */
     void free_idx(elem_idx_t block, uint8_t order);
 
-    // free_lists[i] 存放大小为2^i页的空闲块起始页号
-    std::vector<std::list<elem_idx_t>> free_lists;
+    /**
+     * @brief 内部函数：释放从block开始的n页，按对齐切分为尽可能大的块逐个释放
+     * @param block 起始页号
+     * @param n 页数
+     */
+    void free_range(elem_idx_t block, elem_idx_t n);
+
+    // 空闲链表为以页号为索引的侵入式双向链表，查找/摘除buddy均为O(1)，且不做堆分配
+    static constexpr elem_idx_t NIL = ~elem_idx_t(0);
+    static constexpr uint8_t NOT_FREE = 0xff;
+    // free_heads[i] 为大小为2^i页的空闲块链表头（块起始页号），空链表为NIL
+    std::vector<elem_idx_t> free_heads;
+    // m_next/m_prev[idx] 为以idx开头的空闲块在链表中的前后块，仅对空闲块有效
+    std::vector<elem_idx_t> m_next;
+    std::vector<elem_idx_t> m_prev;
+    // m_free_order[idx] 为以idx开头的空闲块的阶，非空闲块起始页为NOT_FREE
+    std::vector<uint8_t> m_free_order;
+    // m_free_counts[i] 为大小为2^i页的空闲块数量
+    std::vector<size_t> m_free_counts;
+
+    // 将以block开头的2^order页空闲块插入链表头
+    void list_push(elem_idx_t block, uint8_t order);
+    // 将以block开头的2^order页空闲块从链表中摘除
+    void list_remove(elem_idx_t block, uint8_t order);
 
     /**
      * @brief 根据 buddy 系统规则，计算 buddy 块的索引
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <fmt/format.h>
+#include <string>
+
+/**
+ * @brief 对数分桶的直方图，统计延迟等非负整数的分布
+ * @note 每个2的幂区间再等分为16个子桶，分位数的相对误差不超过1/16；
+ *       只保存各桶的计数，可以流式累加任意多的样本
+ */
+class LogHistogram {
+public:
+    void add(uint64_t value) {
+        m_buckets[bucket(value)]++;
+        m_count++;
+        m_sum += value;
+        m_max = std::max(m_max, value);
+    }
+    void merge(const LogHistogram &other) {
+        for (size_t i = 0; i < NUM_BUCKETS; i++) {
+            m_buckets[i] += other.m_buckets[i];
+        }
+        m_count += other.m_count;
+        m_sum += other.m_sum;
+        m_max = std::max(m_max, other.m_max);
+    }
+    void reset() { *this = LogHistogram(); }
+
+    uint64_t count() const { return m_count; }
+    uint64_t sum() const { return m_sum; }
+    uint64_t max() const { return m_max; }
+    double mean() const { return m_count ? static_cast<double>(m_sum) / m_count : 0; }
+
+    /**
+     * @brief 估计第p百分位数
+     * @param p 百分位，取值[0, 100]
+     * @return 不小于该百分位样本的桶上界（不超过最大样本），没有样本时返回0
+     */
+    uint64_t percentile(double p) const {
+        if (m_count == 0) return 0;
+        const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(p / 100 * m_count + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < NUM_BUCKETS; i++) {
+            seen += m_buckets[i];
+            if (seen >= rank) return std::min(bucket_max(i), m_max);
+        }
+        return m_max;
+    }
+
+    /**
+     * @brief 以JSON对象的形式输出样本数、均值、常用分位数与最大值
+     */
+    std::string to_json() const {
+        return fmt::format(
+            "{{\"count\": {}, \"mean\": {:.1f}, \"p50\": {}, \"p90\": {}, \"p99\": {}, "
+            "\"p999\": {}, \"max\": {}}}",
+            count(), mean(), percentile(50), percentile(90), percentile(99), percentile(99.9), max()
+        );
+    }
+
+private:
+    static constexpr int SUB_BITS = 4;
+    static constexpr size_t NUM_BUCKETS = (64 - SUB_BITS + 1) << SUB_BITS;
+
+    // 小于2^SUB_BITS的值各占一桶，其余按最高位所在的幂次与其后SUB_BITS位分桶
+    static size_t bucket(uint64_t value) {
+        if (value < (1u << SUB_BITS)) return value;
+        const int exp = std::bit_width(value) - 1;
+        return static_cast<size_t>(exp - SUB_BITS + 1) << SUB_BITS |
+               ((value >> (exp - SUB_BITS)) & ((1u << SUB_BITS) - 1));
+    }
+    static uint64_t bucket_max(size_t index) {
+        if (index < (1u << SUB_BITS)) return index;
+        const int exp = static_cast<int>(index >> SUB_BITS) + SUB_BITS - 1;
+        const uint64_t low = (1ull << exp) | (index & ((1u << SUB_BITS) - 1)) << (exp - SUB_BITS);
+        return low + ((1ull << (exp - SUB_BITS)) - 1);
+    }
+
+    std::array<uint64_t, NUM_BUCKETS> m_buckets{};
+    uint64_t m_count = 0;
+    uint64_t m_sum = 0;
+    uint64_t m_max = 0;
+};
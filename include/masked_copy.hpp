@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief 带字节掩码的内存写入，供PhysicalMemoryBasicSim的掩码写使用
+ * @note 首次调用时根据CPU支持的指令集选择实现（AVX-512BW > AVX2 > SSE2 > 标量），
+ *       每64字节只需一次掩码存储或少量blend指令
+ */
+
+enum class MaskedCopyISA { SCALAR, SSE2, AVX2, AVX512 };
+
+/**
+ * @brief 将src中mask[i]为真的字节写入dst[i]，其余字节保持不变
+ * @param dst 目的地址
+ * @param src 源数据
+ * @param mask 逐字节掩码，每字节对应一个bool
+ * @param size 字节数
+ */
+void masked_copy(uint8_t *dst, const uint8_t *src, const bool mask[], size_t size);
+
+/**
+ * @brief masked_copy的位掩码版本
+ * @param mask 紧凑位掩码，第i字节由(mask[i / 8] >> (i % 8)) & 1决定，共(size + 7) / 8字节
+ */
+void masked_copy_bits(uint8_t *dst, const uint8_t *src, const uint8_t mask[], size_t size);
+
+/**
+ * @brief 获取当前使用的实现
+ */
+MaskedCopyISA masked_copy_isa();
+
+/**
+ * @brief 强制使用指定的实现，主要用于测试与性能对比
+ * @return CPU不支持该指令集时返回false，此时保持原有选择不变
+ */
+bool masked_copy_select(MaskedCopyISA isa);
@@ -0,0 +1,159 @@
+#pragma once
+#include "buddy.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief 带每线程缓存（magazine）的物理页分配器
+ * @note 低阶（小于CACHED_ORDERS）的分配与释放优先在当前线程的magazine中完成，
+ *       magazine空或满时才批量与中心buddy allocator交换，从而避免多线程争用同一把锁。
+ *       magazine中缓存的页不计入使用量，get_usage()始终是精确值。
+ */
+template <size_t elem_size = 4096> class PageCache {
+public:
+    using elem_idx_t = typename BuddyAllocator<elem_size>::elem_idx_t;
+    static constexpr uint8_t CACHED_ORDERS = 4; // 缓存阶0~3的块
+    static constexpr size_t MAGAZINE_SIZE = 64; // 每阶最多缓存的块数
+    static constexpr size_t BATCH = 32;         // 每次与buddy交换的块数
+
+    /**
+     * @brief 构造函数
+     * @param total_elems 总页数
+     * @param max_order 最大阶数
+     */
+    PageCache(elem_idx_t total_elems, uint8_t max_order);
+    ~PageCache();
+    PageCache(const PageCache &) = delete;
+    PageCache &operator=(const PageCache &) = delete;
+
+    /**
+     * @brief 分配一个2^order页大小的块
+     * @param order 指定块的阶（页数为2^order）
+     * @return 成功时返回页基址（非0），失败时返回0
+     */
+    uint64_t allocate(uint8_t order);
+
+    /**
+     * @brief 释放一个已分配的内存块
+     * @param page_base 内存块的起始页地址
+     * @param order 块的阶（页数为2^order）
+     */
+    void free(uint64_t page_base, uint8_t order);
+
+    /**
+     * @brief 批量分配count个单页
+     * @param page_bases 输出分配到的页基址
+     * @param count 需要的页数
+     * @return 实际分配到的页数，不足count时调用者负责释放已分配的页
+     */
+    size_t allocate_batch(uint64_t page_bases[], size_t count);
+
+    /**
+     * @brief 批量释放count个单页
+     * @param page_bases 要释放的页基址
+     * @param count 页数
+     */
+    void free_batch(const uint64_t page_bases[], size_t count);
+
+    /**
+     * @brief 分配恰好n页的连续内存，不经过magazine，见BuddyAllocator::allocate_pages
+     */
+    uint64_t allocate_pages(elem_idx_t n);
+
+    /**
+     * @brief 释放由allocate_pages分配的n页，见BuddyAllocator::free_pages
+     */
+    void free_pages(uint64_t page_base, elem_idx_t n);
+
+    /**
+     * @brief 直接从buddy allocator分配指定位置的块，见BuddyAllocator::allocate_at
+     * @note magazine中缓存的页不算空闲
+     */
+    int allocate_at(uint64_t page_base, uint8_t order);
+
+    /**
+     * @brief 不经过magazine，直接将块归还buddy allocator，使其能立即与相邻的空闲块合并
+     */
+    void free_uncached(uint64_t page_base, uint8_t order);
+
+    /**
+     * @brief 从任一线程的magazine中取出以page_base开头的缓存块，用于内存整理时预留其中的空闲页
+     * @return 取出的块的阶，没有magazine缓存该块时返回-1
+     * @note 取出的块视为已分配，之后用free_uncached归还
+     */
+    int take_cached(uint64_t page_base);
+
+    /**
+     * @brief 获取已分配出的内存大小（不含magazine中缓存的页）
+     * @return 已分配出的物理内存大小，单位为字节
+     */
+    size_t get_usage() const;
+
+    /**
+     * @brief buddy allocator中各阶空闲块的数量，见BuddyAllocator::get_free_counts
+     * @note 以下碎片统计均不把magazine中缓存的页计为空闲，需要精确值时先调用drain()
+     */
+    std::vector<size_t> get_free_counts() const;
+    int largest_free_order() const;
+    double fragmentation_index(uint8_t order) const;
+
+    /**
+     * @brief 将所有线程magazine中缓存的页归还给buddy allocator
+     */
+    void drain();
+
+    using FreeBlock = typename BuddyAllocator<elem_size>::FreeBlock;
+
+    /**
+     * @brief 按地址递增的顺序列出所有空闲块（先清空各magazine），用于保存快照与内存整理
+     * @note 其他线程同时分配或释放时，结果只反映调用时刻的状态；保存快照时不得有其他线程操作
+     */
+    std::vector<FreeBlock> get_free_blocks();
+
+    /**
+     * @brief 丢弃当前状态（包括各magazine中缓存的页），使且仅使blocks中的块空闲
+     * @note 调用期间不得有其他线程分配或释放
+     */
+    void set_free_blocks(const std::vector<FreeBlock> &blocks);
+
+private:
+    struct Magazine {
+        std::mutex lock; // 只会与drain()争用
+        bool in_use = true; // 受m_lock保护，所属线程退出后置false，由之后的新线程复用
+        size_t count[CACHED_ORDERS] = {};
+        uint64_t pages[CACHED_ORDERS][MAGAZINE_SIZE];
+    };
+    // 线程本地表项通过它判断实例是否仍存活，实例析构时cache置空
+    struct Anchor {
+        std::mutex lock;
+        PageCache *cache;
+    };
+    // 线程本地的magazine表，线程退出时把其中的magazine交还给仍存活的实例
+    struct LocalMagazines {
+        struct Entry {
+            std::shared_ptr<Anchor> anchor;
+            Magazine *mag;
+        };
+        std::vector<Entry> entries;
+        ~LocalMagazines();
+    };
+
+    BuddyAllocator<elem_size> m_buddy;
+    mutable std::mutex m_lock; // 保护m_buddy与m_magazines
+    std::vector<std::unique_ptr<Magazine>> m_magazines;
+    std::atomic<size_t> m_cached_elems{0}; // magazine中缓存的总页数
+    const std::shared_ptr<Anchor> m_anchor;
+
+    // 获取当前线程在本实例中的magazine，首次调用时创建
+    Magazine &local_magazine();
+    // 从buddy批量取块补充magazine，调用者持有mag.lock
+    void refill(Magazine &mag, uint8_t order);
+    // 将magazine中的n个块归还buddy，调用者持有mag.lock
+    void spill(Magazine &mag, uint8_t order, size_t n);
+    // 所属线程退出时清空magazine并标记为可复用
+    void release_magazine(Magazine &mag);
+};
@@ -1,12 +1,23 @@
 #pragma once
 
+#include "masked_copy.hpp"
+#include "stats.hpp"
+#include <atomic>
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <fcntl.h>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <new>
 #include <spdlog/spdlog.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
 
 class PhysicalMemoryInterface {
 public:
@@ -19,72 +30,354 @@ public:
 
     virtual int write(paddr_t addr, const void *src, size_t size) = 0;
     virtual int write(paddr_t addr, const void *src, const bool mask[], size_t size) = 0;
+    // 与带bool掩码的write相同，但掩码紧凑存放，第i字节由(mask[i / 8] >> (i % 8)) & 1决定
+    // 默认实现将掩码展开后调用bool掩码版本
+    virtual int write_bitmask(paddr_t addr, const void *src, const uint8_t mask[], size_t size) {
+        constexpr size_t CHUNK = 512;
+        bool expanded[CHUNK];
+        for (size_t done = 0; done < size; done += CHUNK) {
+            const size_t n = (size - done < CHUNK) ? size - done : CHUNK;
+            for (size_t i = 0; i < n; i++) {
+                expanded[i] = (mask[(done + i) / 8] >> ((done + i) % 8)) & 1;
+            }
+            if (write(addr + done, static_cast<const uint8_t *>(src) + done, expanded, n)) {
+                return -1;
+            }
+        }
+        return 0;
+    }
     virtual int fill(paddr_t addr, uint8_t value, size_t size) = 0;
     virtual int read(paddr_t addr, void *dst, size_t size) = 0;
     virtual int alloc(paddr_t addr, size_t pgcnt = 1) = 0;
     virtual int free(paddr_t addr, size_t pgcnt = 1) = 0;
+    /**
+     * @brief 比较并交换addr处的一个size字节（4或8）的整数，用于更新PTE中的A/D位
+     * @param expected 期望的当前值，不相等时被改写为实际的当前值
+     * @return 交换成功返回0，当前值与期望值不同时返回1，出错返回-1
+     * @note 默认实现由read和write组成，并不是原子的；可能被并发访问的后端应覆盖为原子实现
+     */
+    virtual int compare_exchange(paddr_t addr, uint64_t &expected, uint64_t desired, size_t size) {
+        assert(size == 4 || size == 8);
+        uint64_t cur = 0;
+        if (read(addr, &cur, size)) return -1;
+        if (cur != expected) {
+            expected = cur;
+            return 1;
+        }
+        return write(addr, &desired, size);
+    }
+    /**
+     * @brief 将物理地址addr起的size字节顺序写入文件描述符fd（可以是管道等流）
+     * @return 成功返回0，失败返回-1
+     */
+    virtual int save_range(paddr_t addr, size_t size, int fd) {
+        constexpr size_t CHUNK = 1 << 20;
+        std::unique_ptr<uint8_t[]> buf(new uint8_t[size < CHUNK ? size : CHUNK]);
+        for (size_t done = 0; done < size;) {
+            const size_t n = (size - done < CHUNK) ? size - done : CHUNK;
+            if (read(addr + done, buf.get(), n) || write_fd(fd, buf.get(), n)) return -1;
+            done += n;
+        }
+        return 0;
+    }
+    /**
+     * @brief 从文件fd的offset处读入size字节，放到物理地址addr起的内存中
+     * @return 成功返回0，失败返回-1
+     * @note 使用pread，不改变fd的文件位置，fd须为普通文件；后端可以覆盖为直接映射文件
+     */
+    virtual int load_range(paddr_t addr, int fd, uint64_t offset, size_t size) {
+        constexpr size_t CHUNK = 1 << 20;
+        std::unique_ptr<uint8_t[]> buf(new uint8_t[size < CHUNK ? size : CHUNK]);
+        for (size_t done = 0; done < size;) {
+            const size_t want = (size - done < CHUNK) ? size - done : CHUNK;
+            const ssize_t n = pread(fd, buf.get(), want, static_cast<off_t>(offset + done));
+            if (n <= 0 || write(addr + done, buf.get(), n)) return -1;
+            done += n;
+        }
+        return 0;
+    }
+    // 将size字节完整写入fd，被信号打断或部分写入时继续
+    static int write_fd(int fd, const void *buf, size_t size) {
+        const uint8_t *p = static_cast<const uint8_t *>(buf);
+        while (size > 0) {
+            const ssize_t n = ::write(fd, p, size);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return -1;
+            p += n;
+            size -= n;
+        }
+        return 0;
+    }
+    // 物理内存以文件形式存放时返回其描述符，物理地址即文件偏移，可被mmap到主机；否则返回-1
+    virtual int host_fd() const { return -1; }
+
+    // 分散/聚集访问的一段：物理地址addr处的size字节与主机缓冲区buf对应
+    struct IOVec {
+        paddr_t addr;
+        void *buf;
+        size_t size;
+    };
+    // fillv的一段物理地址区间
+    struct PhysRange {
+        paddr_t addr;
+        size_t size;
+    };
+
+    /**
+     * @brief 分散/聚集读写，一次调用处理count段
+     * @return 全部成功返回0，失败返回-1
+     * @note 默认实现逐段调用read/write/fill，出错时之前的段可能已完成；
+     *       后端可以覆盖为一次性检查所有段的实现，以减少每段的调用开销
+     */
+    virtual int readv(const IOVec segs[], size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            if (read(segs[i].addr, segs[i].buf, segs[i].size)) return -1;
+        }
+        return 0;
+    }
+    virtual int writev(const IOVec segs[], size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            if (write(segs[i].addr, segs[i].buf, segs[i].size)) return -1;
+        }
+        return 0;
+    }
+    virtual int fillv(const PhysRange segs[], size_t count, uint8_t value) {
+        for (size_t i = 0; i < count; i++) {
+            if (fill(segs[i].addr, value, segs[i].size)) return -1;
+        }
+        return 0;
+    }
 };
 
+/**
+ * @brief 以主机内存模拟的物理内存
+ * @note 读写接口声明为final，以具体类型调用时（如SV_basic<Trait, PhysicalMemoryBasicSim>）
+ *       编译器可以去虚化并内联为对主机内存的直接访问
+ */
 class PhysicalMemoryBasicSim : public PhysicalMemoryInterface {
 public:
     PhysicalMemoryBasicSim(
         uint64_t size = (1ull << 30), std::shared_ptr<spdlog::logger> logger = nullptr
     )
-        : PhysicalMemoryInterface(size), m_logger(logger ? logger : spdlog::default_logger()) {
-        m_mem = new (std::align_val_t(PAGESIZE)) uint8_t[m_size];
-    }
-    ~PhysicalMemoryBasicSim() { operator delete[](m_mem, std::align_val_t(PAGESIZE)); }
+        : PhysicalMemoryBasicSim(size, logger, map_anonymous(size)) {}
+    ~PhysicalMemoryBasicSim() { munmap(m_mem, m_size); }
 
-    int write(paddr_t addr, const void *src, size_t size) {
+    int write(paddr_t addr, const void *src, size_t size) final {
         if (addr_check(addr, size)) {
             return -1;
         }
         memcpy(m_mem + addr, src, size);
+        count_write(size);
         return 0;
     }
-    int write(paddr_t addr, const void *src, const bool mask[], size_t size) {
+    int write(paddr_t addr, const void *src, const bool mask[], size_t size) final {
         if (addr_check(addr, size) != 0) {
             return -1;
         }
-        for (size_t i = 0; i < size; i++) {
-            if (mask[i]) {
-                m_mem[addr + i] = ((uint8_t *)src)[i];
-            }
+        masked_copy(m_mem + addr, static_cast<const uint8_t *>(src), mask, size);
+        count_write(size);
+        return 0;
+    }
+    int write_bitmask(paddr_t addr, const void *src, const uint8_t mask[], size_t size) final {
+        if (addr_check(addr, size) != 0) {
+            return -1;
         }
+        masked_copy_bits(m_mem + addr, static_cast<const uint8_t *>(src), mask, size);
+        count_write(size);
         return 0;
     }
-    int fill(paddr_t addr, uint8_t value, size_t size) {
+    int fill(paddr_t addr, uint8_t value, size_t size) final {
         if (addr_check(addr, size) != 0) {
             return -1;
         }
         memset(m_mem + addr, value, size);
+        count_write(size);
         return 0;
     }
-    int read(paddr_t addr, void *dst, size_t size) {
+    int read(paddr_t addr, void *dst, size_t size) final {
         if (addr_check(addr, size) != 0) {
             return -1;
         }
         memcpy(dst, m_mem + addr, size);
+        count_read(size);
+        return 0;
+    }
+    int compare_exchange(paddr_t addr, uint64_t &expected, uint64_t desired, size_t size) final {
+        if (addr_check(addr, size) != 0 || addr % size != 0) {
+            return -1;
+        }
+        Stats::add(StatCounter::PMEM_CAS);
+        if (size == 8) {
+            std::atomic_ref<uint64_t> word(*reinterpret_cast<uint64_t *>(m_mem + addr));
+            return word.compare_exchange_strong(expected, desired) ? 0 : 1;
+        }
+        assert(size == 4);
+        std::atomic_ref<uint32_t> word(*reinterpret_cast<uint32_t *>(m_mem + addr));
+        uint32_t cur = static_cast<uint32_t>(expected);
+        if (word.compare_exchange_strong(cur, static_cast<uint32_t>(desired))) return 0;
+        expected = cur;
+        return 1;
+    }
+    // 先一次性检查所有段，全部合法时才进行访问，出错时不做任何修改
+    int readv(const IOVec segs[], size_t count) final {
+        if (segs_check(segs, count)) {
+            return -1;
+        }
+        for (size_t i = 0; i < count; i++) {
+            memcpy(segs[i].buf, m_mem + segs[i].addr, segs[i].size);
+            count_read(segs[i].size);
+        }
         return 0;
     }
-    int alloc(paddr_t addr, size_t pgcnt = 1) {
+    int writev(const IOVec segs[], size_t count) final {
+        if (segs_check(segs, count)) {
+            return -1;
+        }
+        for (size_t i = 0; i < count; i++) {
+            memcpy(m_mem + segs[i].addr, segs[i].buf, segs[i].size);
+            count_write(segs[i].size);
+        }
+        return 0;
+    }
+    int fillv(const PhysRange segs[], size_t count, uint8_t value) final {
+        if (segs_check(segs, count)) {
+            return -1;
+        }
+        for (size_t i = 0; i < count; i++) {
+            memset(m_mem + segs[i].addr, value, segs[i].size);
+            count_write(segs[i].size);
+        }
+        return 0;
+    }
+    int save_range(paddr_t addr, size_t size, int fd) final {
+        if (addr_check(addr, size) != 0) {
+            return -1;
+        }
+        return write_fd(fd, m_mem + addr, size);
+    }
+    // 页对齐时以私有方式直接映射文件：数据在首次访问时才从文件读入，写入时复制，不影响文件
+    int load_range(paddr_t addr, int fd, uint64_t offset, size_t size) override {
+        if (addr_check(addr, size) != 0) {
+            return -1;
+        }
+        if (m_can_release && addr % PAGESIZE == 0 && offset % PAGESIZE == 0 &&
+            size % PAGESIZE == 0) {
+            void *mem = mmap(
+                m_mem + addr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE,
+                fd, static_cast<off_t>(offset)
+            );
+            if (mem != MAP_FAILED) {
+                std::lock_guard<std::mutex> lock(m_file_lock);
+                m_file_ranges[addr] = addr + size;
+                m_has_file_ranges.store(true, std::memory_order_relaxed);
+                return 0;
+            }
+        }
+        return PhysicalMemoryInterface::load_range(addr, fd, offset, size);
+    }
+    int alloc(paddr_t addr, size_t pgcnt = 1) override {
         if (addr_check(addr, pgcnt * PAGESIZE) != 0) {
             return -1;
         }
         return 0;
     }
-    int free(paddr_t addr, size_t pgcnt = 1) {
+    int free(paddr_t addr, size_t pgcnt = 1) override {
         if (addr_check(addr, pgcnt * PAGESIZE) != 0) {
             return -1;
         }
+        // 归还主机内存，之后再读出为0
+        if (m_can_release && addr % PAGESIZE == 0) {
+            if (m_has_file_ranges.load(std::memory_order_relaxed)) {
+                release_file_backed(addr, addr + pgcnt * PAGESIZE);
+            }
+            madvise(m_mem + addr, pgcnt * PAGESIZE, MADV_DONTNEED);
+        }
         return 0;
     }
 
-private:
+    /**
+     * @brief 统计[addr, addr + size)中实际占用主机内存的字节数，用于检查释放的页是否归还了主机内存
+     * @return 按主机页统计的驻留字节数，addr未按主机页对齐或查询失败时返回0
+     */
+    size_t host_resident(paddr_t addr, size_t size) {
+        const long host_pagesize = sysconf(_SC_PAGESIZE);
+        if (addr + size > m_size || host_pagesize <= 0 || addr % host_pagesize != 0) {
+            return 0;
+        }
+        std::vector<unsigned char> pages((size + host_pagesize - 1) / host_pagesize);
+        if (mincore(m_mem + addr, size, pages.data()) != 0) {
+            return 0;
+        }
+        return std::count_if(pages.begin(), pages.end(), [](unsigned char v) { return v & 1; }) *
+               static_cast<size_t>(host_pagesize);
+    }
+
+protected:
+    // 接管已映射好的size字节主机内存mem，析构时解除映射
+    PhysicalMemoryBasicSim(uint64_t size, std::shared_ptr<spdlog::logger> logger, uint8_t *mem)
+        : PhysicalMemoryInterface(size), m_mem(mem),
+          m_logger(logger ? logger : spdlog::default_logger()) {
+        long host_pagesize = sysconf(_SC_PAGESIZE);
+        m_can_release = host_pagesize > 0 && PAGESIZE % host_pagesize == 0;
+    }
+    // 只保留地址空间而不预留内存，未访问的页不占用主机内存，且读出为0
+    static uint8_t *map_anonymous(uint64_t size) {
+        void *mem = mmap(
+            nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1,
+            0
+        );
+        if (mem == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        return static_cast<uint8_t *>(mem);
+    }
+
     uint8_t *m_mem;
+    bool m_can_release; // 主机页大小整除PAGESIZE时才能按页归还内存
+    // load_range直接映射了文件的物理地址区间[start, end)，以start为键
+    std::map<paddr_t, paddr_t> m_file_ranges;
+    std::mutex m_file_lock; // 保护m_file_ranges，释放页可能来自多个线程
+    std::atomic<bool> m_has_file_ranges{false};
+    // 文件映射的页经madvise后会恢复为文件内容，且清零会产生私有副本反而占用内存，
+    // 因此把[start, end)中与之重叠的部分重新映射为匿名内存，并从m_file_ranges中去掉
+    void release_file_backed(paddr_t start, paddr_t end) {
+        std::lock_guard<std::mutex> lock(m_file_lock);
+        auto it = m_file_ranges.upper_bound(start);
+        if (it != m_file_ranges.begin()) --it;
+        while (it != m_file_ranges.end() && it->first < end) {
+            const paddr_t first = it->first, last = it->second;
+            const paddr_t lo = std::max(start, first), hi = std::min(end, last);
+            if (lo >= hi) {
+                ++it;
+                continue;
+            }
+            void *mem = mmap(
+                m_mem + lo, hi - lo, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0
+            );
+            if (mem == MAP_FAILED) { // 仍保持文件映射，只能清零
+                memset(m_mem + lo, 0, hi - lo);
+                ++it;
+                continue;
+            }
+            // 拆分出的剩余部分都不在后续要检查的范围内
+            it = m_file_ranges.erase(it);
+            if (first < lo) m_file_ranges[first] = lo;
+            if (hi < last) m_file_ranges[hi] = last;
+        }
+        m_has_file_ranges.store(!m_file_ranges.empty(), std::memory_order_relaxed);
+    }
     std::shared_ptr<spdlog::logger> m_logger;
+    static void count_read(size_t size) {
+        Stats::add(StatCounter::PMEM_READ);
+        Stats::add(StatCounter::PMEM_READ_BYTES, size);
+    }
+    static void count_write(size_t size) {
+        Stats::add(StatCounter::PMEM_WRITE);
+        Stats::add(StatCounter::PMEM_WRITE_BYTES, size);
+    }
     int addr_check(paddr_t addr, size_t size = 0) {
-        if (addr < m_addr_floor || addr + size > m_size) {
+        if (addr < m_addr_floor || addr + size > m_size) [[unlikely]] {
             if (size == 0)
                 SPDLOG_LOGGER_ERROR(m_logger, "PMEM addr out of range: 0x{:x}", addr);
             else
@@ -93,4 +386,91 @@ private:
         }
         return 0;
     }
+    // 检查所有段，循环中不分支，只在发现越界时逐段定位并报告
+    template <typename Seg> int segs_check(const Seg segs[], size_t count) {
+        bool bad = false;
+        for (size_t i = 0; i < count; i++) {
+            bad |= (segs[i].addr < m_addr_floor) | (segs[i].addr + segs[i].size > m_size);
+        }
+        if (bad) [[unlikely]] {
+            for (size_t i = 0; i < count; i++) {
+                if (addr_check(segs[i].addr, segs[i].size)) break;
+            }
+            return -1;
+        }
+        return 0;
+    }
+};
+
+#ifdef __linux__
+/**
+ * @brief 以memfd存放的模拟物理内存
+ * @note 读写方式与PhysicalMemoryBasicSim相同，但内存可以通过host_fd()再次映射到主机，
+ *       SV_basic::map_host借此把一段虚拟地址区间映射为主机上连续的内存，访问时无需复制
+ */
+class PhysicalMemoryMemfd : public PhysicalMemoryBasicSim {
+public:
+    PhysicalMemoryMemfd(
+        uint64_t size = (1ull << 30), std::shared_ptr<spdlog::logger> logger = nullptr
+    )
+        : PhysicalMemoryMemfd(size, logger, create_memfd(size)) {}
+    ~PhysicalMemoryMemfd() { close(m_fd); }
+
+    int host_fd() const final { return m_fd; }
+    int free(paddr_t addr, size_t pgcnt = 1) final {
+        if (addr_check(addr, pgcnt * PAGESIZE) != 0) {
+            return -1;
+        }
+        // 共享映射上madvise不会归还内存，需在文件中打洞，之后再读出为0
+        // load_range不会在此映射私有文件，因此无需release_file_backed
+        if (m_can_release && addr % PAGESIZE == 0) {
+            fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, addr, pgcnt * PAGESIZE);
+        }
+        return 0;
+    }
+
+    // 在内核中把快照文件复制到memfd，不能像基类那样映射私有文件，否则主机视图会看不到数据
+    int load_range(paddr_t addr, int fd, uint64_t offset, size_t size) final {
+        if (addr_check(addr, size) != 0) {
+            return -1;
+        }
+        loff_t off_in = static_cast<loff_t>(offset), off_out = static_cast<loff_t>(addr);
+        size_t done = 0;
+        while (done < size) {
+            const ssize_t n = copy_file_range(fd, &off_in, m_fd, &off_out, size - done, 0);
+            if (n <= 0) break;
+            done += n;
+        }
+        if (done == size) {
+            return 0;
+        }
+        return PhysicalMemoryInterface::load_range(addr + done, fd, offset + done, size - done);
+    }
+
+private:
+    int m_fd;
+
+    PhysicalMemoryMemfd(uint64_t size, std::shared_ptr<spdlog::logger> logger, int fd)
+        : PhysicalMemoryBasicSim(size, logger, map_memfd(fd, size)), m_fd(fd) {}
+    // 创建大小为size的memfd，文件是稀疏的，未写入的页不占用内存
+    static int create_memfd(uint64_t size) {
+        int fd = memfd_create("membox-pmem", MFD_CLOEXEC);
+        if (fd < 0) {
+            throw std::bad_alloc();
+        }
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            close(fd);
+            throw std::bad_alloc();
+        }
+        return fd;
+    }
+    static uint8_t *map_memfd(int fd, uint64_t size) {
+        void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+        if (mem == MAP_FAILED) {
+            close(fd);
+            throw std::bad_alloc();
+        }
+        return static_cast<uint8_t *>(mem);
+    }
 };
+#endif
@@ -0,0 +1,160 @@
+#pragma once
+
+#include "histogram.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+/**
+ * 热路径统计：页表遍历、PTE读写、TLB命中率、buddy拆分与合并、mmap查找次数等计数器，
+ * 以及主要操作的延迟直方图，用于确定TLB大小与定位异常的访问模式
+ *
+ * 只有定义了MEMBOX_STATS（CMake选项ENABLE_STATS）时才编译进来，否则记录接口均为空函数，
+ * 计时不读时钟，snapshot()得到全0的结果。计数器与直方图按线程累计，记录时不加锁也不争用
+ * 缓存行，只在snapshot()/reset()时汇总；线程退出时其计数并入全局。
+ */
+
+enum class StatCounter : uint8_t {
+    TLB_HIT,          // 软件TLB命中（TLB未启用时不计）
+    TLB_MISS,         // 软件TLB未命中
+    PAGE_WALK,        // SV_basic从根页表开始的页表遍历
+    PTE_READ,         // 翻译时读取的PTE数
+    PTE_WRITE,        // 翻译时写回A/D位与映射/解除映射时写入的PTE数
+    PAGE_FAULT,       // 调用缺页处理函数的次数
+    MMAP_PROBE,       // mmap查找空闲虚拟地址时跳过的VMA数
+    PAGE_ALLOC,       // 页表管理器分配的物理块数（含批量分配的单页）
+    BUDDY_ALLOC,      // buddy allocator分配的块数
+    BUDDY_FREE,       // buddy allocator释放的块数
+    BUDDY_SPLIT,      // 分配时拆分块的次数
+    BUDDY_MERGE,      // 释放时与buddy合并的次数
+    PMEM_READ,        // PhysicalMemoryBasicSim的读操作数（readv按段计）
+    PMEM_READ_BYTES,  // 读出的字节数
+    PMEM_WRITE,       // PhysicalMemoryBasicSim的写操作数（writev按段计）
+    PMEM_WRITE_BYTES, // 写入的字节数
+    PMEM_CAS,         // compare_exchange次数
+    NUM
+};
+
+enum class StatTimer : uint8_t {
+    PAGE_WALK,  // 一次页表遍历（含A/D位更新），只对每64次中的一次计时
+    MMAP,       // SV_supervisor::mmap
+    MUNMAP,     // SV_supervisor::munmap
+    PAGE_ALLOC, // SV_supervisor::palloc/palloc_batch，只对每16次中的一次计时
+    NUM
+};
+
+/**
+ * @brief 某一时刻的统计结果
+ */
+struct StatsSnapshot {
+    static constexpr size_t NUM_COUNTERS = static_cast<size_t>(StatCounter::NUM);
+    static constexpr size_t NUM_TIMERS = static_cast<size_t>(StatTimer::NUM);
+
+    uint64_t counters[NUM_COUNTERS] = {};
+    LogHistogram timers[NUM_TIMERS]; // 单位为纳秒
+
+    uint64_t operator[](StatCounter c) const { return counters[static_cast<size_t>(c)]; }
+    const LogHistogram &operator[](StatTimer t) const { return timers[static_cast<size_t>(t)]; }
+    // TLB命中率，没有查找时返回0
+    double tlb_hit_rate() const;
+
+    static const char *name(StatCounter c);
+    static const char *name(StatTimer t);
+    /**
+     * @brief 每个计数器与直方图一行的文本
+     */
+    std::string to_text() const;
+    /**
+     * @brief 以JSON对象的形式输出，直方图给出样本数、均值与分位数
+     */
+    std::string to_json() const;
+};
+
+/**
+ * @brief 统计的记录与汇总接口，全部为静态函数，统计范围为整个进程
+ */
+class Stats {
+public:
+#ifdef MEMBOX_STATS
+    static constexpr bool ENABLED = true;
+    static void add(StatCounter c, uint64_t n = 1) {
+        // 只有本线程写入，无需原子的读-改-写
+        std::atomic<uint64_t> &v = local().counters[static_cast<size_t>(c)];
+        v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    static void record(StatTimer t, uint64_t ns) {
+        ThreadStats &ts = local();
+        std::lock_guard<std::mutex> lock(ts.lock);
+        ts.timers[static_cast<size_t>(t)].add(ns);
+    }
+#else
+    static constexpr bool ENABLED = false;
+    static void add(StatCounter, uint64_t = 1) {}
+    static void record(StatTimer, uint64_t) {}
+#endif
+
+    /**
+     * @brief 汇总所有线程（含已退出的线程）自上次reset()以来的统计
+     */
+    static StatsSnapshot snapshot();
+
+    /**
+     * @brief 清零统计
+     * @note 计数器以当前值为新的起点，不会丢失其他线程并发的计数；
+     *       并发记录的延迟样本可能落在清零之前或之后
+     */
+    static void reset();
+
+    /**
+     * @brief 在作用域内计时，析构时记录到对应的直方图
+     * @note sample_shift非0时本线程每2^sample_shift次只计时一次，用于几十纳秒的热路径，
+     *       避免读时钟的开销远超被测操作本身；此时直方图的样本数少于实际次数
+     */
+    class Timer {
+    public:
+#ifdef MEMBOX_STATS
+        explicit Timer(StatTimer t, unsigned sample_shift = 0) : m_timer(t) {
+            uint32_t &tick = local().ticks[static_cast<size_t>(t)];
+            m_on = (tick++ & ((1u << sample_shift) - 1)) == 0;
+            if (m_on) m_start = std::chrono::steady_clock::now();
+        }
+        ~Timer() {
+            if (!m_on) return;
+            const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - m_start
+            );
+            record(m_timer, ns.count());
+        }
+
+    private:
+        StatTimer m_timer;
+        bool m_on;
+        std::chrono::steady_clock::time_point m_start;
+#else
+        explicit Timer(StatTimer, unsigned = 0) {}
+#endif
+    };
+
+#ifdef MEMBOX_STATS
+    // 每个线程一份，由全局的线程表登记
+    struct ThreadStats {
+        std::atomic<uint64_t> counters[StatsSnapshot::NUM_COUNTERS] = {};
+        std::mutex lock; // 保护timers，只会与snapshot()/reset()争用
+        LogHistogram timers[StatsSnapshot::NUM_TIMERS];
+        uint32_t ticks[StatsSnapshot::NUM_TIMERS] = {}; // Timer抽样用，只由本线程访问
+    };
+
+private:
+    static constinit inline thread_local ThreadStats *t_local = nullptr;
+
+    static ThreadStats &local() {
+        if (t_local == nullptr) [[unlikely]] t_local = attach();
+        return *t_local;
+    }
+    // 为当前线程创建并登记ThreadStats，线程退出时自动注销
+    static ThreadStats *attach();
+#endif
+};
@@ -19,8 +19,8 @@ struct SV32_Trait {
         struct PA {
             static constexpr std::pair<uint8_t, uint8_t> PAGEOFFSET = {11, 00};
             static constexpr std::pair<uint8_t, uint8_t> PPNFULL = {33, 12};
-            static constexpr std::pair<uint8_t, uint8_t> PPN0 = {20, 12};
-            static constexpr std::pair<uint8_t, uint8_t> PPN1 = {29, 21};
+            static constexpr std::pair<uint8_t, uint8_t> PPN0 = {21, 12};
+            static constexpr std::pair<uint8_t, uint8_t> PPN1 = {33, 22};
             static constexpr std::pair<uint8_t, uint8_t> PPN[LEVELS] = {PPN0, PPN1};
         };
         struct PTE {
@@ -59,3 +59,22 @@ public:
     )
         : SV_supervisor<SV32_Trait>(pmem, logger) {}
 };
+
+// 以下版本直接使用PhysicalMemoryBasicSim，页表访问不经过虚函数调用
+class SV32_basic_sim : public SV_basic<SV32_Trait, PhysicalMemoryBasicSim> {
+public:
+    SV32_basic_sim(
+        std::shared_ptr<PhysicalMemoryBasicSim> pmem,
+        std::shared_ptr<spdlog::logger> logger = nullptr
+    )
+        : SV_basic<SV32_Trait, PhysicalMemoryBasicSim>(pmem, logger) {}
+};
+
+class SV32_supervisor_sim : public SV_supervisor<SV32_Trait, PhysicalMemoryBasicSim> {
+public:
+    SV32_supervisor_sim(
+        std::shared_ptr<PhysicalMemoryBasicSim> pmem,
+        std::shared_ptr<spdlog::logger> logger = nullptr
+    )
+        : SV_supervisor<SV32_Trait, PhysicalMemoryBasicSim>(pmem, logger) {}
+};
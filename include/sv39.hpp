@@ -65,3 +65,22 @@ public:
     )
         : SV_supervisor<SV39_Trait>(pmem, logger) {}
 };
+
+// 以下版本直接使用PhysicalMemoryBasicSim，页表访问不经过虚函数调用
+class SV39_basic_sim : public SV_basic<SV39_Trait, PhysicalMemoryBasicSim> {
+public:
+    SV39_basic_sim(
+        std::shared_ptr<PhysicalMemoryBasicSim> pmem,
+        std::shared_ptr<spdlog::logger> logger = nullptr
+    )
+        : SV_basic<SV39_Trait, PhysicalMemoryBasicSim>(pmem, logger) {}
+};
+
+class SV39_supervisor_sim : public SV_supervisor<SV39_Trait, PhysicalMemoryBasicSim> {
+public:
+    SV39_supervisor_sim(
+        std::shared_ptr<PhysicalMemoryBasicSim> pmem,
+        std::shared_ptr<spdlog::logger> logger = nullptr
+    )
+        : SV_supervisor<SV39_Trait, PhysicalMemoryBasicSim>(pmem, logger) {}
+};
@@ -1,10 +1,20 @@
 #pragma once
 #include "physical_mem.hpp"
+#include "sv_tlb.hpp"
 #include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <vector>
 
-template <typename Trait> class SV_basic {
+/**
+ * @brief SVxx页表的基本功能（地址翻译、虚拟地址空间读写）
+ * @tparam Trait SV32_Trait或SV39_Trait
+ * @tparam PMEM 物理内存类型。默认通过PhysicalMemoryInterface的虚函数访问；
+ *         指定为具体类型（如PhysicalMemoryBasicSim）时，页表访问可在编译期内联
+ */
+template <typename Trait, typename PMEM = PhysicalMemoryInterface> class SV_basic {
 public:
+    using pmem_t = PMEM;
     using paddr_t = typename PhysicalMemoryInterface::paddr_t;
     using vaddr_t = typename Trait::vaddr_t;
     using pte_t = typename Trait::pte_t;
@@ -14,18 +24,63 @@ public:
     static constexpr size_t PAGESIZE = 4096;
 
     SV_basic(
-        std::shared_ptr<PhysicalMemoryInterface> pmem,
+        std::shared_ptr<PMEM> pmem,
         std::shared_ptr<spdlog::logger> logger = nullptr
     );
 
+    // 访问类型，缺页处理函数据此决定如何补上映射
+    enum class Access { READ, WRITE };
+
+    /**
+     * @brief 缺页处理函数，在访问未映射的虚拟页时被调用
+     * @return 已为vaddr所在页建立映射时返回0，此时访问会重试；否则返回-1，访问失败
+     */
+    using fault_handler_t = std::function<int(pagetable_t, vaddr_t, Access)>;
+
+    /**
+     * @brief 设置缺页处理函数，为空时访问未映射的页直接失败
+     * @note SV_supervisor会把自身的缺页处理设置给自己；其他SV_basic对象访问按需分配的区间时，
+     *       需要设置为SV_supervisor::fault_handler()
+     */
+    void set_fault_handler(fault_handler_t handler) { fault_handler = std::move(handler); }
+
     /**
      * @brief 根据SV页表机制，将虚拟地址转换为物理地址
      * @param pagetable_root 根页表的物理地址
      * @param vaddr 要转换的虚拟地址
      * @return 转换后的物理地址(非0)，若转换失败则返回0
+     * @note 按读访问处理，会设置叶子PTE的A位
      */
     paddr_t translate(pagetable_t pagetable_root, vaddr_t vaddr) const;
 
+    /**
+     * @brief 以access方式访问vaddr前进行翻译，遇到未映射的页时调用缺页处理函数后重试
+     * @return 转换后的物理地址(非0)，若转换失败则返回0
+     * @note 与硬件相同，访问时设置叶子PTE的A位，写访问同时设置D位（以比较并交换更新PTE）；
+     *       TLB只为D位已置位的页缓存写权限，因此清除D位后执行sfence_vma即可重新记录写入
+     */
+    paddr_t translate(pagetable_t pagetable_root, vaddr_t vaddr, Access access) const;
+
+    // 一段虚拟地址与物理地址都连续的区间
+    struct TranslatedRun {
+        vaddr_t vaddr;
+        paddr_t paddr;
+        size_t len;
+    };
+
+    /**
+     * @brief 翻译虚拟地址区间[vaddr, vaddr + size)，物理上相邻的页合并为一段
+     * @param pagetable_root 根页表的物理地址
+     * @param vaddr 起始虚拟地址，无需页对齐
+     * @param size 区间的字节数
+     * @param runs 输出按虚拟地址递增排列的(vaddr, paddr, len)区间，调用时先被清空
+     * @return 全部翻译成功返回0，否则返回-1，此时runs只包含出错位置之前的部分
+     * @note 每个末级页表只下降一次，其中后续的PTE一次读出；大页按整段计入
+     */
+    int translate_range(
+        pagetable_t pagetable_root, vaddr_t vaddr, size_t size, std::vector<TranslatedRun> &runs
+    ) const;
+
     /**
      * @brief 将数据从主机端复制到虚拟地址空间（写操作）
      * @param pagetable_root 页表根物理地址
@@ -33,7 +88,8 @@ public:
      * @param src 主机端源数据
      * @param size 要复制的字节数
      * @return 成功则返回目标虚拟地址dst，失败返回0（这与C memcpy不同）
-     * @note 这并非硬件MMU功能，仅为方便测试
+     * @note 这并非硬件MMU功能，仅为方便测试；遇到未映射的页时会调用缺页处理函数
+     * @note 按写访问设置所经过的页的A/D位
      */
     vaddr_t memcpy(pagetable_t pagetable_root, vaddr_t dst, const void *src, size_t size) const;
 
@@ -44,13 +100,97 @@ public:
      * @param src 源数据的虚拟地址
      * @param size 要复制的字节数
      * @return 成功则返回主机端目标缓冲区的指针dst，失败返回nullptr（这与C memcpy不同）
-     * @note 这并非硬件MMU功能，仅为方便测试
+     * @note 这并非硬件MMU功能，仅为方便测试；遇到未映射的页时会调用缺页处理函数
+     * @note 按读访问设置所经过的页的A位
      */
     void *memcpy(pagetable_t pagetable_root, void *dst, vaddr_t src, size_t size) const;
 
+    /**
+     * @brief 把已映射的虚拟地址区间映射为主机上一段连续的内存，可以原地读写而无需复制
+     * @param pagetable_root 根页表物理地址
+     * @param vaddr 区间起始虚拟地址，无需页对齐
+     * @param size 区间的字节数
+     * @param access READ时视图只读，WRITE时视图可写
+     * @return 与vaddr对应的主机地址，失败时返回nullptr（PMEM不支持host_fd()、
+     *         区间内有无法映射的页，或要求可写而区间内有只读页）
+     * @note 按access翻译：只读视图只设置A位，不会破坏写时复制的共享，也不把页标记为脏；
+     *       可写视图会先经缺页处理函数复制写时复制的页，区间内的页在建立视图时被标记为脏，
+     *       之后经视图的写入不再更新D位
+     * @note 主机视图与模拟物理内存共享同一份存储，始终保持一致；
+     *       但它固定了建立时的映射关系，之后munmap或重新映射该区间不会反映到视图中
+     */
+    void *map_host(
+        pagetable_t pagetable_root, vaddr_t vaddr, size_t size, Access access = Access::READ
+    ) const;
+
+    /**
+     * @brief 解除map_host建立的主机视图
+     * @param view map_host的返回值
+     * @param size 与调用map_host时相同
+     * @return 成功返回0，失败返回-1
+     */
+    int unmap_host(void *view, size_t size) const;
+
+    /**
+     * @brief 配置软件TLB，默认关闭
+     * @param entries TLB表项总数，为0时关闭TLB
+     * @param ways 组相联路数
+     * @note TLB不会自动感知其他对象对页表的修改，需由使用者调用sfence_vma刷新
+     */
+    void set_tlb(size_t entries, size_t ways = 4) { tlb.configure(entries, ways); }
+
+    /**
+     * @brief 刷新TLB，行为参照sfence.vma指令
+     * @param pagetable_root 只刷新该地址空间的表项，缺省时刷新全部
+     * @param vaddr 只刷新该虚拟地址起始的表项
+     * @param size 刷新范围的字节数，默认为一页
+     */
+    void sfence_vma() { tlb.flush(); }
+    void sfence_vma(pagetable_t pagetable_root) { tlb.flush(pagetable_root); }
+    void sfence_vma(pagetable_t pagetable_root, vaddr_t vaddr, size_t size = PAGESIZE) {
+        size_t npages = (vaddr % PAGESIZE + size + PAGESIZE - 1) / PAGESIZE;
+        tlb.flush(pagetable_root, vaddr / PAGESIZE, npages);
+    }
+
 protected:
-    std::shared_ptr<PhysicalMemoryInterface> pmem;
+    std::shared_ptr<PMEM> pmem;
     std::shared_ptr<spdlog::logger> logger = nullptr;
+    mutable SV_TLB tlb;
+    fault_handler_t fault_handler;
+
+    // 不经过TLB查找vaddr的叶子PTE，返回物理地址，未映射或出错时返回0
+    // 成功时level为叶子PTE所在级数，pte_addr为其物理地址，pte为其内容
+    paddr_t walk(
+        pagetable_t pagetable_root, vaddr_t vaddr, int &level, paddr_t &pte_addr, pte_t &pte
+    ) const;
+    // 同walk，并按access设置叶子PTE的A/D位，PTE被并发修改时重新查找
+    paddr_t walk_access(
+        pagetable_t pagetable_root, vaddr_t vaddr, Access access, int &level, paddr_t &pte_addr,
+        pte_t &pte
+    ) const;
+    // 按access设置pte_addr处叶子PTE的A位（可写页的写访问同时设置D位），pte随之更新
+    // PTE已不等于pte（被并发修改）或出错时返回-1
+    int update_ad(paddr_t pte_addr, pte_t &pte, Access access) const;
+    // 写访问可以经TLB完成的叶子：可写且D位已置位
+    static bool tlb_writable(pte_t pte) {
+        return bits_extract(pte, BITRANGE::PTE::W) && bits_extract(pte, BITRANGE::PTE::D);
+    }
+    // 经过TLB翻译，不调用缺页处理；写访问遇到不可写的页时返回0
+    paddr_t translate_nofault(pagetable_t pagetable_root, vaddr_t vaddr, Access access) const;
+    // 依次对物理上连续的每一段调用emit(vaddr, paddr, len)，emit返回非0时中止
+    // 返回成功处理的字节数，小于size说明在vaddr加上返回值处翻译失败或被emit中止
+    // 写访问在不可写的页处停止
+    template <typename F>
+    size_t for_each_run(
+        pagetable_t pagetable_root, vaddr_t vaddr, size_t size, Access access, F &&emit
+    ) const;
+    // 同for_each_run，但翻译停下时调用缺页处理函数，成功后从停下的位置继续
+    template <typename F>
+    size_t access_runs(
+        pagetable_t pagetable_root, vaddr_t vaddr, size_t size, Access access, F &&emit
+    ) const;
+    // memcpy每次交给PMEM readv/writev的最大段数
+    static constexpr size_t IOV_BATCH = 32;
 
     // 位操作工具函数
     // 从data中提取给定位域range范围的值
@@ -1,61 +1,153 @@
 #pragma once
 
-#include "buddy.hpp"
+#include "page_cache.hpp"
 #include "physical_mem.hpp"
 #include "sv_basic.hpp"
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <vector>
 
 /**
  * @brief SVxx supervisor模式下的页表管理器（软件）
  * @note 利用buddy allocator管理物理内存，实现页表管理与类linux的mmap和munmap函数
+ * @note 线程安全：每个根页表（地址空间）各有一把锁，不同地址空间上的mmap/munmap可以并发执行；
+ *       物理页分配器带有每线程缓存。继承自SV_basic的TLB不受锁保护，多线程共享同一对象时不要开启
  */
 
-template <typename Trait>
-class SV_supervisor : public SV_basic<Trait> {
+template <typename Trait, typename PMEM = PhysicalMemoryInterface>
+class SV_supervisor : public SV_basic<Trait, PMEM> {
 public:
-    using typename SV_basic<Trait>::paddr_t;
-    using typename SV_basic<Trait>::vaddr_t;
-    using typename SV_basic<Trait>::pte_t;
-    using typename SV_basic<Trait>::pagetable_t;
-    using typename SV_basic<Trait>::BITRANGE;
-    static constexpr int LEVELS = SV_basic<Trait>::LEVELS;
-    static constexpr size_t PAGESIZE = SV_basic<Trait>::PAGESIZE;
-
-    using SV_basic<Trait>::logger;
-    using SV_basic<Trait>::pmem;
-    using SV_basic<Trait>::translate;
-    using SV_basic<Trait>::bits_set;
-    using SV_basic<Trait>::bits_extract;
-
-    SV_supervisor(
-        std::shared_ptr<PhysicalMemoryInterface> pmem, std::shared_ptr<spdlog::logger> logger = nullptr
-    );
+    using typename SV_basic<Trait, PMEM>::paddr_t;
+    using typename SV_basic<Trait, PMEM>::vaddr_t;
+    using typename SV_basic<Trait, PMEM>::pte_t;
+    using typename SV_basic<Trait, PMEM>::pagetable_t;
+    using typename SV_basic<Trait, PMEM>::BITRANGE;
+    using typename SV_basic<Trait, PMEM>::Access;
+    using typename SV_basic<Trait, PMEM>::fault_handler_t;
+    static constexpr int LEVELS = SV_basic<Trait, PMEM>::LEVELS;
+    static constexpr size_t PAGESIZE = SV_basic<Trait, PMEM>::PAGESIZE;
+    // 共享内存段的标识，0表示无效
+    using shm_t = uint64_t;
+
+    using SV_basic<Trait, PMEM>::logger;
+    using SV_basic<Trait, PMEM>::pmem;
+    using SV_basic<Trait, PMEM>::translate;
+    using SV_basic<Trait, PMEM>::bits_set;
+    using SV_basic<Trait, PMEM>::bits_extract;
+
+    SV_supervisor(std::shared_ptr<PMEM> pmem, std::shared_ptr<spdlog::logger> logger = nullptr);
 
     /**
      * @brief 分配一个连续的虚拟地址空间，返回其起始地址
      * @param pagetable_root 页表根的物理地址，由create_pagetable()返回
      * @param vaddr 要分配的虚拟地址空间的起始地址，只是推荐值，实际分配的地址可能会不同
      * @param size 要分配的虚拟地址空间的大小，单位为字节。若size不是页大小的整数倍，则向上取整
+     * @param lazy 为真时只保留虚拟地址区间，物理页在首次访问时经缺页处理分配
      * @return 最终成功分配的虚拟地址，失败时返回0。成功分配的虚拟地址必定是页对齐的
      * @note 行为参照linux内核提供的mmap函数
      */
-    vaddr_t mmap(pagetable_t pagetable_root, vaddr_t vaddr, size_t size);
+    vaddr_t mmap(pagetable_t pagetable_root, vaddr_t vaddr, size_t size, bool lazy = false);
 
     /**
      * @brief 释放由mmap分配的虚拟地址空间
      * @param pagetable_root 页表根的物理地址，由create_pagetable()返回
-     * @param vaddr 要释放的虚拟地址空间的起始地址，应为mmap函数的返回值
-     * @param size 要释放的虚拟地址空间的大小，单位为字节，应与调用mmap时匹配
-     * @return 成功时返回0，失败时返回-1
+     * @param vaddr 要释放的虚拟地址空间的起始地址，需页对齐
+     * @param size 要释放的虚拟地址空间的大小，单位为字节，若不是页大小的整数倍，则向上取整
+     * @return 成功时返回0，失败时返回-1（范围内存在未映射的页时失败，且不做任何修改）
+     * @note 允许释放某次mmap的一部分，或一次释放多次mmap的相邻区域
      */
     int munmap(pagetable_t pagetable_root, vaddr_t vaddr, size_t size);
 
+    /**
+     * @brief 缺页处理：vaddr位于按需分配的区间内且尚未分配时，为其所在页分配物理页；
+     *        写入写时复制的页时，为其建立私有副本
+     * @param pagetable_root 页表根的物理地址
+     * @param vaddr 访问的虚拟地址
+     * @param access 访问类型
+     * @return 已可按access访问时返回0，不属于任何可分配的区间或分配失败时返回-1
+     */
+    int handle_fault(pagetable_t pagetable_root, vaddr_t vaddr, Access access);
+
+    /**
+     * @brief 返回调用handle_fault的缺页处理函数，供其他SV_basic对象设置
+     * @note 本对象构造时已为自身设置，返回的函数不得在本对象销毁后调用
+     */
+    fault_handler_t fault_handler() {
+        return [this](pagetable_t root, vaddr_t vaddr, Access access) {
+            return handle_fault(root, vaddr, access);
+        };
+    }
+
     /**
      * @brief 创建根页表
      * @return 创建成功将返回根页表的物理地址，失败返回0
      */
     pagetable_t create_pagetable();
 
+    /**
+     * @brief 以写时复制方式复制一个地址空间（类似fork）
+     * @param pagetable_root 被复制的根页表
+     * @return 新根页表的物理地址，失败返回0
+     * @note 只复制页表结构，叶子物理页由双方共享且都变为只读，任一方写入时才复制该页；
+     *       原地址空间的写权限被收回，其他SV_basic对象需对原地址空间执行sfence_vma
+     */
+    pagetable_t clone_pagetable(pagetable_t pagetable_root);
+
+    // 一段虚拟地址区间[vaddr, vaddr + size)
+    struct VRange {
+        vaddr_t vaddr;
+        size_t size;
+    };
+
+    /**
+     * @brief 收集地址空间中被写过的页（叶子PTE的D位已置位），并清除这些D位
+     * @param pagetable_root 页表根的物理地址
+     * @param ranges 输出按地址递增排列、相邻的页合并后的区间，调用时先被清空
+     * @return 成功返回0，失败返回-1
+     * @note 每个D位以比较并交换清除，与并发设置A/D位的访问不会互相覆盖；
+     *       其他SV_basic对象的TLB可能仍缓存着写权限，需在调用后立即对该地址空间执行sfence_vma，
+     *       否则此后经TLB的写入不会被下一次收集记录
+     */
+    int collect_dirty(pagetable_t pagetable_root, std::vector<VRange> &ranges);
+
+    /**
+     * @brief 创建共享内存段，立即分配其全部物理页
+     * @param size 段的大小，单位为字节，若不是页大小的整数倍，则向上取整
+     * @return 段的标识，失败时返回0
+     * @note 段的物理页在get_pmem_usage中只计一次，无论被映射到多少个地址空间
+     */
+    shm_t shm_create(size_t size);
+
+    /**
+     * @brief 将共享内存段整体映射到地址空间中
+     * @param pagetable_root 页表根的物理地址
+     * @param shm shm_create返回的段标识
+     * @param vaddr 推荐的起始虚拟地址，含义同mmap
+     * @param readonly 为真时映射为只读，写入会失败
+     * @return 实际映射的虚拟地址，失败时返回0
+     * @note 映射计入get_vmem_usage；clone_pagetable复制的地址空间与原地址空间继续共享该段
+     */
+    vaddr_t shm_map(pagetable_t pagetable_root, shm_t shm, vaddr_t vaddr, bool readonly = false);
+
+    /**
+     * @brief 解除shm_map建立的映射，等价于对整个段的范围调用munmap
+     * @param pagetable_root 页表根的物理地址
+     * @param shm 段标识
+     * @param vaddr shm_map的返回值
+     * @return 成功返回0；段不存在或vaddr处映射的不是该段时返回-1
+     */
+    int shm_unmap(pagetable_t pagetable_root, shm_t shm, vaddr_t vaddr);
+
+    /**
+     * @brief 销毁共享内存段的标识，之后不能再映射该段
+     * @return 成功返回0，段不存在时返回-1
+     * @note 物理页在最后一个映射解除（munmap、shm_unmap或destroy_pagetable）后才被释放
+     */
+    int shm_destroy(shm_t shm);
+
     /**
      * @brief 销毁指定的根页表和所有下级页表，同时释放页表中所有映射的虚拟内存页。
      * @param pagetable_root 页表根的物理地址，由create_pagetable()返回。
@@ -63,9 +155,94 @@ public:
      */
     int destroy_pagetable(pagetable_t pagetable_root);
 
+    /**
+     * @brief 启用反向映射：为每个物理页记录映射它的(根页表, 虚拟地址)，用于迁移物理页
+     * @return 成功返回0，失败返回-1
+     * @note 按现有页表建立初始内容，之后随页的分配与释放维护，每个物理页占用8字节；
+     *       启用后不能关闭。须在没有其他线程操作本对象时调用
+     */
+    int enable_reverse_map();
+
+    /**
+     * @brief 查询映射物理页的地址空间与虚拟地址
+     * @param paddr 数据页的物理地址，大页需给出其首页的地址
+     * @param pagetable_root 输出映射该页的根页表
+     * @param vaddr 输出该页（大页则为整个大页）的起始虚拟地址
+     * @return 叶子PTE所在的级数（大于0为大页）；未启用反向映射或该页未被映射时返回-1
+     * @note 被多个地址空间共享的页只记录其中一个映射，该映射解除或建立私有副本后，
+     *       查询与迁移时改记为仍映射该页的一方；共享内存段的页不记录
+     */
+    int reverse_map(paddr_t paddr, pagetable_t &pagetable_root, vaddr_t &vaddr);
+
+    /**
+     * @brief 迁移物理页：将数据页或页表页的内容复制到新分配的物理页，改写指向它的PTE，并释放原页
+     * @param paddr 要迁移的物理页，大页需给出其首页的地址，整个大页一起迁移
+     * @return 新的物理地址，失败时返回0且不做任何修改
+     * @note 需先调用enable_reverse_map。根页表、共享内存段的页以及仍被共享的写时复制页不能迁移
+     * @note 数据页先收回写权限再复制，迁移期间经其他SV_basic对象发起的写入进入缺页处理，
+     *       迁移完成后写入新页；收回写权限之前已完成翻译的写入（包括经TLB缓存的翻译）仍可能
+     *       落在原页。使用TLB的SV_basic对象需在迁移后对相应地址空间执行sfence_vma
+     */
+    paddr_t migrate_page(paddr_t paddr);
+
+    /**
+     * @brief 内存整理：迁移可移动的页，拼出至少一个2^order页的连续空闲物理块
+     * @param order 需要的块的阶
+     * @return 已有或成功拼出这样的块时返回0，否则返回-1
+     * @note 需先调用enable_reverse_map。优先清空空闲页最多的对齐区域，只移动普通数据页与
+     *       非根页表页，含大页、共享内存段的页或仍被共享的写时复制页的区域不会被选中；
+     *       迁移的限制与migrate_page相同
+     */
+    int compact(uint8_t order);
+
+    /**
+     * @brief 设置分配大页失败时是否先整理内存再重试，默认关闭，此时直接退回使用小页
+     * @note 需先调用enable_reverse_map。整理可能迁移任意地址空间的数据页，
+     *       开启后使用其他SV_basic对象的TLB时，需在mmap之后执行sfence_vma
+     * @note 任一线程的mmap都可能触发整理而迁移任意地址空间的页，因此开启后经其他SV_basic对象
+     *       写入数据页不能与任何mmap并发，原因见migrate_page
+     */
+    void set_auto_compact(bool enable) { m_auto_compact = enable; }
+
+    /**
+     * @brief 获取各阶空闲物理块的数量
+     * @return 下标为阶，长度为buddy allocator的最大阶加1
+     * @note 碎片统计均不把各线程页缓存中的页计为空闲
+     */
+    std::vector<size_t> get_free_counts() const { return buddy.get_free_counts(); }
+    /**
+     * @brief 获取最大空闲物理块的阶，没有空闲页时返回-1
+     */
+    int largest_free_order() const { return buddy.largest_free_order(); }
+    /**
+     * @brief 物理内存对2^order页分配的碎片化指数，见BuddyAllocator::fragmentation_index
+     */
+    double fragmentation_index(uint8_t order) const { return buddy.fragmentation_index(order); }
+
+    /**
+     * @brief 保存快照：把物理页分配状态、所有地址空间与共享内存段、使用量统计，
+     *        以及所有在用的物理页（含页表页）顺序写入fd，空闲的物理页不会写出
+     * @param fd 输出的文件描述符，只做顺序写入，可以是管道
+     * @return 成功返回0，失败返回-1
+     * @note 保存期间阻塞其他线程对本对象的所有操作，正在进行的操作先完成，
+     *       因此快照中不会有已分配却不属于任何地址空间或共享内存段的物理页；
+     *       物理页数据相对快照起点按页对齐，快照从文件中页对齐的位置开始时，load可以直接映射它们
+     */
+    int save(int fd);
+
+    /**
+     * @brief 从save写出的快照恢复全部状态，不重新执行任何mmap
+     * @param fd 快照文件的描述符，从其当前位置开始读取，须为普通文件；成功后位于快照末尾
+     * @return 成功返回0，失败返回-1（若在读入物理页时失败，对象状态不确定，应丢弃）
+     * @note 只能在尚未创建任何根页表的对象上调用，PMEM的大小须与保存时相同且尚未写入数据；
+     *       PhysicalMemoryBasicSim以私有方式直接映射快照中的物理页，数据在首次访问时才读入
+     * @note 快照不含TLB内容，使用同一PMEM的其他SV_basic对象需执行sfence_vma
+     */
+    int load(int fd);
+
     /**
      * @brief 获取当前虚拟内存使用量
-     * @return 当前虚拟内存使用量，单位为字节
+     * @return 当前虚拟内存使用量（含按需分配而尚未访问的部分），单位为字节
      */
     size_t get_vmem_usage() const { return m_vpage_usage * PAGESIZE; }
     /**
@@ -75,20 +252,233 @@ public:
     size_t get_pmem_usage() const { return buddy.get_usage(); }
 
 private:
-    // buddy allocator for physical memory management
-    BuddyAllocator<PAGESIZE> buddy;
+    // buddy allocator (with per-thread page magazines) for physical memory management
+    PageCache<PAGESIZE> buddy;
 
     // Virtual memory usage statistics (sum of all virtual address spaces)
-    uint64_t m_vpage_usage = 0;
+    std::atomic<uint64_t> m_vpage_usage{0};
 
-    // For debug assert
-    std::vector<pagetable_t> m_ptroots; // all root-pagetables created
+    // 可用虚拟地址空间上界（不含）。虚拟地址窄于vaddr_t时（SV39）高位须为最高位的符号扩展，
+    // 只使用低半部分地址；SV32的虚拟地址占满32位，全部可用
+    static constexpr unsigned VA_BITS = BITRANGE::VA::VPN[LEVELS - 1].first + 1;
+    static constexpr uint64_t VA_TOP =
+        1ull << (VA_BITS < sizeof(typename Trait::vaddr_t) * 8 ? VA_BITS - 1 : VA_BITS);
+
+    // 已映射的一段虚拟地址区间[start, end)，start作为map的键
+    struct VMA {
+        uint64_t end;
+        bool lazy = false; // 按需分配，区间内可能有尚未分配物理页的空洞
+    };
+    // 每个根页表对应一个地址空间，记录其中按起始地址排序的VMA
+    struct AddressSpace {
+        std::map<vaddr_t, VMA> vmas;
+        std::mutex lock; // 保护vmas及该地址空间的所有页表页
+    };
+    std::map<pagetable_t, AddressSpace> m_ptroots; // all root-pagetables created
+    // 保护m_ptroots本身：增删地址空间时独占，访问某个地址空间时共享
+    mutable std::shared_mutex m_ptroots_lock;
+    // 在m_ptroots_lock/m_shm_lock之外分配或释放物理页的操作（创建、复制、销毁地址空间与
+    // 创建共享内存段）全程共享持有，save/load独占持有，最先获取
+    std::shared_mutex m_op_lock;
     void assert_ptroot(pagetable_t ptroot);
 
-    // 新分配一个虚拟页，将其加入页表中，需要时会分配页表页
-    int alloc_one_page(pagetable_t pagetable_root, vaddr_t vaddr);
-    // 释放一个虚拟页，目前不会释放页表页
-    int free_one_page(pagetable_t pagetable_root, vaddr_t vaddr);
+    // 在地址空间中从hint开始查找长度为len的空闲区间，找不到时从最低地址重新查找，失败返回0
+    static uint64_t vma_find_free(const AddressSpace &as, uint64_t hint, uint64_t len);
+    // 检查[start, end)是否被VMA完整覆盖
+    static bool vma_covered(const AddressSpace &as, uint64_t start, uint64_t end);
+    // 记录新映射的区间[start, vma.end)，该区间必须空闲，只与属性相同的相邻VMA合并
+    static void vma_insert(AddressSpace &as, uint64_t start, VMA vma);
+    // 移除区间[start, end)，必要时切分已有VMA
+    static void vma_remove(AddressSpace &as, uint64_t start, uint64_t end);
+
+    // 每个页表页中的PTE数量
+    static constexpr size_t PTES_PER_TABLE = PAGESIZE / sizeof(pte_t);
+
+    // 从buddy allocator分配2^order个物理页，并通知PMEM，失败时返回0
+    paddr_t palloc(uint8_t order);
+    // 批量分配count个物理页，全部成功返回0，否则不分配任何页并返回-1
+    int palloc_batch(paddr_t paddrs[], size_t count);
+    // 释放2^order个物理页，并通知PMEM归还其后备存储
+    // cached为假时不经过页缓存直接归还buddy allocator，以便立即合并
+    void pfree(paddr_t paddr, uint8_t order, bool cached = true);
+    // 批量释放count个物理页，物理上连续的页合并为一次PMEM通知
+    void pfree_batch(const paddr_t paddrs[], size_t count);
+
+    // 第level级叶子PTE（大页）所覆盖的页数的阶，level为0时即普通页
+    static constexpr uint8_t level_order(int level) {
+        uint8_t order = 0;
+        for (int i = 0; i < level; i++) {
+            order += BITRANGE::VA::VPN[i].first - BITRANGE::VA::VPN[i].second + 1;
+        }
+        return order;
+    }
+    // 根据物理页数确定buddy allocator的最大阶
+    static uint8_t buddy_max_order(uint64_t total_pages);
+
+    // 从根页表下降到vaddr所在的第target_level级页表，create为真时按需创建中间页表
+    // 失败或不存在时返回0
+    paddr_t walk_to_table(pagetable_t pagetable_root, vaddr_t vaddr, int target_level, bool create);
+    // 查找覆盖vaddr的叶子PTE，返回其所在级数（大于0为大页），未映射时返回-1
+    // tables非空时，tables[i]记录沿途经过的第i级页表的物理地址
+    int find_leaf(
+        pagetable_t pagetable_root, vaddr_t vaddr, paddr_t &pte_addr, pte_t &pte,
+        paddr_t *tables = nullptr
+    );
+    // 将vaddr所在的第level级大页PTE拆分为一张下一级页表，映射关系不变
+    int split_superpage(
+        pagetable_t pagetable_root, vaddr_t vaddr, paddr_t pte_addr, pte_t pte, int level
+    );
+    // 确保vaddr处不在某个大页的中间，必要时拆分大页
+    int split_at(pagetable_t pagetable_root, uint64_t vaddr);
+    // 在vaddr处映射一个第level级大页，成功返回0，无法使用大页时返回1，出错返回-1
+    int map_superpage(pagetable_t pagetable_root, vaddr_t vaddr, int level);
+    // 新分配num_page个连续虚拟页并加入页表，对齐与大小允许时使用大页
+    // 每个末级页表只下降一次，其中的PTE一次写入，失败时回滚已分配的页
+    int map_range(pagetable_t pagetable_root, vaddr_t vaddr, size_t num_page);
+    // 释放num_page个连续虚拟页，部分覆盖的大页会先被拆分，变空的中间页表页随之回收
+    // allow_holes为真时跳过未映射的页（按需分配的区间），否则遇到未映射的页即出错
+    int unmap_range(
+        pagetable_t pagetable_root, vaddr_t vaddr, size_t num_page, bool allow_holes = false
+    );
+    // 从第level级页表开始向上，将不再含有效PTE的非根页表从父页表中摘除并加入empty_tables
+    void release_empty_tables(
+        const paddr_t tables[], int level, vaddr_t vaddr, std::vector<paddr_t> &empty_tables
+    );
+
+    // 按物理页号记录每个物理页除一个所有者之外被共享的次数（写时复制），大页只记在首页上
+    std::unique_ptr<std::atomic<uint32_t>[]> m_page_refs;
+    std::atomic<uint32_t> &page_refs(paddr_t paddr) { return m_page_refs[paddr / PAGESIZE]; }
+    // 放弃对以paddr开始的2^order个页的一份引用，放弃的是最后一份时释放物理页
+    void put_page(paddr_t paddr, uint8_t order);
+    // 批量放弃count个普通页的引用，释放其中不再被共享的页，paddrs会被改写
+    void put_pages(paddr_t paddrs[], size_t count);
+    // 为pte_addr处第level级的写时复制叶子建立私有副本，若已无其他共享者则只恢复写权限
+    int break_cow(
+        pagetable_t pagetable_root, vaddr_t vaddr, paddr_t pte_addr, pte_t pte, int level
+    );
+    // 将第level级页表src及其下级页表复制到dst（属于根页表dst_root，覆盖从base开始的虚拟地址），
+    // 叶子物理页由双方共享并设为写时复制
+    int clone_one_level(paddr_t src, paddr_t dst, int level, pagetable_t dst_root, vaddr_t base);
+    // 将从src开始的num_page个物理页的内容复制到dst
+    int copy_pages(paddr_t dst, paddr_t src, size_t num_page);
+    // 以比较并交换改写pte_addr处的PTE，新值由make_new(当前值)给出；其他访问者并发设置A/D位
+    // 导致比较失败时，以读到的最新值重新计算，新值与当前值相同时不写入。
+    // 成功返回0，expected输出被替换的值；读写PMEM出错时返回-1
+    template <typename F> int cas_pte(paddr_t pte_addr, pte_t &expected, F &&make_new);
+
+    // 共享内存段，段本身持有其物理页的一份引用，每个映射再各持有一份
+    struct ShmSegment {
+        std::vector<paddr_t> pages;
+    };
+    std::map<shm_t, ShmSegment> m_shms;
+    shm_t m_next_shm = 1;
+    // 保护m_shms，映射段的过程中一直持有，因此先于地址空间的锁获取
+    std::mutex m_shm_lock;
+    // 将已分配的物理页pages[0, num_page)依次映射到vaddr起的小页上，并各增加一份引用
+    int map_shared_pages(
+        pagetable_t pagetable_root, vaddr_t vaddr, const paddr_t pages[], size_t num_page,
+        bool readonly
+    );
+
+    // 收集以第level级页表ptaddr（覆盖从base开始的虚拟地址）中的脏页，并清除其D位
+    int collect_dirty_one_level(
+        paddr_t ptaddr, int level, vaddr_t base, std::vector<VRange> &ranges
+    );
+
+    // 按物理页号记录每个页表页中有效PTE的数量，计数归零的页表页可以回收
+    // 各地址空间的页表页互不相同，因此只需在对应地址空间的锁内访问
+    std::vector<uint16_t> m_pt_valid;
+    uint16_t &pt_valid(paddr_t ptaddr) { return m_pt_valid[ptaddr / PAGESIZE]; }
+
+    // 反向映射的表项类型：页表页、数据页（叶子）、共享内存段的页
+    enum : uint64_t { RMAP_NONE = 0, RMAP_TABLE = 1, RMAP_LEAF = 2, RMAP_SHM = 3 };
+    // 表项按位打包为 根页表页号 | 虚拟页号 | 级数(2位) | 类型(2位)
+    static constexpr int RMAP_VPN_BITS =
+        BITRANGE::VA::VPN[LEVELS - 1].first + 1 - BITRANGE::VA::VPN[0].second;
+    static_assert(LEVELS <= 4, "level must fit in 2 bits of a reverse map entry");
+    struct RmapEntry {
+        uint64_t kind;
+        pagetable_t root;
+        vaddr_t vaddr; // 数据页为叶子覆盖的起始地址，页表页为整张页表覆盖的起始地址
+        int level;     // 数据页为叶子PTE的级数，页表页为页表自身的级数
+    };
+    static uint64_t rmap_pack(uint64_t kind, pagetable_t root, vaddr_t vaddr, int level) {
+        const uint64_t span = PAGESIZE << level_order(kind == RMAP_LEAF ? level : level + 1);
+        return (root / PAGESIZE) << (RMAP_VPN_BITS + 4) | (vaddr - vaddr % span) / PAGESIZE << 4 |
+               static_cast<uint64_t>(level) << 2 | kind;
+    }
+    static RmapEntry rmap_unpack(uint64_t e) {
+        const uint64_t vpn = (e >> 4) & ((1ull << RMAP_VPN_BITS) - 1);
+        return {e & 3, static_cast<pagetable_t>((e >> (RMAP_VPN_BITS + 4)) * PAGESIZE),
+                static_cast<vaddr_t>(vpn * PAGESIZE), static_cast<int>((e >> 2) & 3)};
+    }
+    // 按物理页号记录映射该页的位置，大页只记在首页上，共享的页只记录其中一个映射；未启用时为空
+    std::unique_ptr<std::atomic<uint64_t>[]> m_rmap;
+    void rmap_set(paddr_t paddr, uint64_t kind, pagetable_t root, vaddr_t vaddr, int level) {
+        if (m_rmap) {
+            m_rmap[paddr / PAGESIZE].store(
+                rmap_pack(kind, root, vaddr, level), std::memory_order_relaxed
+            );
+        }
+    }
+    // 按现有的地址空间与共享内存段重建反向映射，调用者须持有m_shm_lock与m_ptroots_lock
+    int rmap_rebuild();
+    // 为第level级页表ptaddr（属于root，覆盖从base开始的虚拟地址）中尚无记录的页建立反向映射
+    int rmap_build_one_level(pagetable_t root, paddr_t ptaddr, int level, vaddr_t base);
+    // 迁移反向映射为e的数据页或页表页，调用者须持有e.root所在地址空间的锁
+    // keep_old为真时不释放原页，由调用者负责释放；数据页还需给出映射它的叶子PTE及其地址
+    paddr_t migrate_leaf(
+        paddr_t paddr, const RmapEntry &e, paddr_t pte_addr, pte_t pte, bool keep_old = false
+    );
+    paddr_t migrate_table(paddr_t paddr, const RmapEntry &e, bool keep_old = false);
+    // 反向映射packed记录的共享者已不再映射paddr时，在其他地址空间的同一虚拟地址处查找仍映射它的
+    // 一方并改记为它，找到返回真；调用者须持有m_ptroots_lock（共享），locked_root的含义同migrate_one
+    bool rmap_reown(paddr_t paddr, uint64_t packed, pagetable_t locked_root);
+    // 按反向映射迁移一页，调用者须持有m_ptroots_lock（共享）；
+    // locked_root非0时调用者还持有该地址空间的锁，此时只尝试获取其他地址空间的锁，以免互相等待
+    paddr_t migrate_one(paddr_t paddr, pagetable_t locked_root, bool keep_old);
+
+    std::atomic<bool> m_auto_compact{false};
+    // 内存整理，调用者须持有m_ptroots_lock（共享），locked_root的含义同migrate_one
+    int compact_locked(uint8_t order, pagetable_t locked_root);
+    // 清空从base开始的2^order页，blocks[0, count)为其中的空闲块（不含magazine中缓存的块，
+    // 它们在扫描时从magazine中取出），全部迁出时返回0
+    int compact_region(
+        paddr_t base, uint8_t order, const typename PageCache<PAGESIZE>::FreeBlock blocks[],
+        size_t count, pagetable_t locked_root
+    );
+
+    // 构造指向下一级页表的PTE
+    static pte_t table_pte(paddr_t ptaddr) {
+        using PTE = typename BITRANGE::PTE;
+        using PA = typename BITRANGE::PA;
+        pte_t pte = bits_set(bits_extract(ptaddr, PA::PPNFULL), PTE::PPNFULL, 0);
+        // pte.X/W/R = 0, pointer to next level pagetable
+        return bits_set(1, PTE::V, pte);
+    }
+    // 构造指向物理页paddr的叶子PTE
+    static pte_t leaf_pte(paddr_t paddr) {
+        using PTE = typename BITRANGE::PTE;
+        pte_t pte = table_pte(paddr);
+        // todo: currently, accessibility is not checked strictly
+        pte = bits_set(1, PTE::R, pte);
+        pte = bits_set(1, PTE::X, pte);
+        return bits_set(1, PTE::W, pte);
+    }
+    // 软件保留位RSW的用法：低位标记写时复制的叶子，高位标记共享内存段的叶子
+    static constexpr uint64_t RSW_COW = 1, RSW_SHARED = 2;
+    // 写时复制的叶子PTE：去掉写权限，并在RSW中标记
+    static pte_t cow_pte(pte_t pte) {
+        return bits_set(RSW_COW, BITRANGE::PTE::RSW, bits_set(0, BITRANGE::PTE::W, pte));
+    }
+    static bool is_cow(pte_t pte) { return bits_extract(pte, BITRANGE::PTE::RSW) & RSW_COW; }
+    static bool is_shared(pte_t pte) {
+        return bits_extract(pte, BITRANGE::PTE::RSW) & RSW_SHARED;
+    }
+    // 取出PTE中的物理地址
+    static paddr_t pte_paddr(pte_t pte) {
+        return bits_set(bits_extract(pte, BITRANGE::PTE::PPNFULL), BITRANGE::PA::PPNFULL);
+    }
     // 销毁一个页表，递归销毁所有下级页表
     int destroy_pagetable_one_level(pagetable_t ptaddr, int level);
 };
\ No newline at end of file
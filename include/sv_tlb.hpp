@@ -0,0 +1,125 @@
+#pragma once
+#include "stats.hpp"
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief SV软件TLB，组相联，以(根页表物理地址, VPN)为键
+ * @note 根页表物理地址相当于ASID，不同地址空间的表项互不干扰。
+ *       TLB不会自动感知页表变化，修改页表后需调用flush系列函数（同sfence.vma）
+ */
+class SV_TLB {
+public:
+    using addr_t = uint64_t;
+
+    /**
+     * @brief 重新设置TLB容量，并清空所有表项
+     * @param entries 表项总数，为0时关闭TLB；向下取整为ways的整数倍，且组数向下取整为2的幂
+     * @param ways 组相联路数
+     */
+    void configure(size_t entries, size_t ways) {
+        assert(ways > 0 && ways <= 256);
+        size_t sets = entries / ways;
+        while (sets & (sets - 1)) {
+            sets &= sets - 1;
+        }
+        m_ways = ways;
+        m_set_mask = sets ? sets - 1 : 0;
+        m_entries.assign(sets * ways, Entry{});
+        m_victim.assign(sets, 0);
+    }
+
+    bool enabled() const { return !m_entries.empty(); }
+    size_t size() const { return m_entries.size(); }
+
+    /**
+     * @brief 查找TLB
+     * @param root 根页表物理地址
+     * @param vpn 虚拟页号
+     * @param ppn 命中时写入物理页号
+     * @param write 为真时只有可写的表项才算命中
+     * @return 是否命中
+     */
+    bool lookup(addr_t root, addr_t vpn, addr_t &ppn, bool write = false) const {
+        if (m_entries.empty()) return false;
+        const Entry *set = &m_entries[set_index(root, vpn) * m_ways];
+        for (size_t i = 0; i < m_ways; i++) {
+            if (set[i].root == root && set[i].vpn == vpn && (!write || set[i].writable)) {
+                ppn = set[i].ppn;
+                Stats::add(StatCounter::TLB_HIT);
+                return true;
+            }
+        }
+        Stats::add(StatCounter::TLB_MISS);
+        return false;
+    }
+
+    // 插入表项，组满时按轮转替换；已存在的同一页表项会被覆盖
+    void insert(addr_t root, addr_t vpn, addr_t ppn, bool writable = true) {
+        if (m_entries.empty()) return;
+        assert(root != 0);
+        size_t idx = set_index(root, vpn);
+        Entry *set = &m_entries[idx * m_ways];
+        size_t way = m_victim[idx];
+        for (size_t i = 0; i < m_ways; i++) {
+            if (set[i].root == root && set[i].vpn == vpn) {
+                way = i;
+                break;
+            }
+            if (set[i].root == 0) {
+                way = i;
+            }
+        }
+        set[way] = {root, vpn, ppn, writable};
+        m_victim[idx] = (way + 1) % m_ways;
+    }
+
+    // 清空所有表项
+    void flush() {
+        for (auto &e : m_entries) {
+            e.root = 0;
+        }
+    }
+
+    // 清空某一地址空间的所有表项
+    void flush(addr_t root) {
+        for (auto &e : m_entries) {
+            if (e.root == root) e.root = 0;
+        }
+    }
+
+    // 清空某一地址空间中[vpn, vpn + npages)范围内的表项
+    void flush(addr_t root, addr_t vpn, size_t npages = 1) {
+        if (m_entries.empty()) return;
+        if (npages >= m_entries.size()) { // 范围大于TLB容量时，直接扫描全部表项更快
+            for (auto &e : m_entries) {
+                if (e.root == root && e.vpn - vpn < npages) e.root = 0;
+            }
+            return;
+        }
+        for (size_t n = 0; n < npages; n++) {
+            Entry *set = &m_entries[set_index(root, vpn + n) * m_ways];
+            for (size_t i = 0; i < m_ways; i++) {
+                if (set[i].root == root && set[i].vpn == vpn + n) set[i].root = 0;
+            }
+        }
+    }
+
+private:
+    struct Entry {
+        addr_t root = 0; // 0表示无效表项（根页表不会位于0号物理页）
+        addr_t vpn = 0;
+        addr_t ppn = 0;
+        bool writable = true; // 为假时只能用于读（如写时复制的共享页）
+    };
+    std::vector<Entry> m_entries;
+    std::vector<uint8_t> m_victim; // 每组下一个被替换的路
+    size_t m_ways = 1;
+    size_t m_set_mask = 0;
+
+    size_t set_index(addr_t root, addr_t vpn) const {
+        return (vpn ^ (root >> 12) * 0x9e3779b1u) & m_set_mask;
+    }
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "histogram.hpp"
+#include "sv_basic.hpp"
+#include "sv_supervisor.hpp"
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * 操作轨迹：记录对SV_supervisor/SV_basic的一串操作，之后在新的对象上按原顺序重放，
+ * 用于在真实的访问模式下做可重复的性能回归测试
+ *
+ * 二进制格式：TraceHeader之后是连续的记录，每条记录以1字节的操作码开始，低4位为TraceOp，
+ * 第4位表示记录时操作失败，第5位表示按需分配的mmap；其后的字段均为LEB128变长整数：
+ *   CREATE/DESTROY  根页表页号
+ *   MMAP            根页表页号、推荐地址、大小、实际地址（相对推荐地址）
+ *   MUNMAP/READ/WRITE  根页表页号、虚拟地址、大小
+ *   结束标记（操作码0x0f）  此前的记录总数，由flush()与析构写入
+ * 虚拟地址以相对上一条记录中虚拟地址的差值（zigzag编码）保存，顺序访问只占一两个字节；
+ * memcpy只记录大小，不记录数据。轨迹须以记录数相符的结束标记结尾，否则视为被截断
+ */
+
+enum class TraceOp : uint8_t { CREATE, DESTROY, MMAP, MUNMAP, READ, WRITE, NUM };
+
+/**
+ * @brief 重放的统计结果
+ */
+struct TraceStats {
+    uint64_t ops = 0;
+    uint64_t mismatches = 0; // 结果与记录时不同的操作数（返回地址不同或成败不同）
+    double seconds = 0;      // 执行操作的总耗时，不含读取与解码轨迹
+    LogHistogram latency;    // 所有操作的延迟，单位为纳秒
+    LogHistogram op_latency[static_cast<size_t>(TraceOp::NUM)];
+
+    double ops_per_sec() const { return seconds > 0 ? ops / seconds : 0; }
+    static const char *op_name(TraceOp op);
+    /**
+     * @brief 以JSON对象的形式输出，含每秒操作数与各类操作的延迟分位数
+     */
+    std::string to_json() const;
+};
+
+/**
+ * @brief 记录轨迹的包装：转发对页表管理器与MMU的操作，并把每个操作写入轨迹
+ * @note 多线程可以并发调用，各操作按完成的顺序记录；析构时写出缓冲区中剩余的记录
+ */
+template <typename Trait, typename PMEM = PhysicalMemoryInterface> class SV_trace_recorder {
+public:
+    using pagetable_t = typename SV_basic<Trait, PMEM>::pagetable_t;
+    using vaddr_t = typename SV_basic<Trait, PMEM>::vaddr_t;
+
+    /**
+     * @param fd 轨迹的输出文件描述符，只做顺序写入，构造时写入文件头
+     */
+    SV_trace_recorder(
+        SV_supervisor<Trait, PMEM> &sv, SV_basic<Trait, PMEM> &mmu, int fd,
+        std::shared_ptr<spdlog::logger> logger = nullptr
+    );
+    ~SV_trace_recorder() { flush(); }
+
+    pagetable_t create_pagetable();
+    int destroy_pagetable(pagetable_t pagetable_root);
+    vaddr_t mmap(pagetable_t pagetable_root, vaddr_t vaddr, size_t size, bool lazy = false);
+    int munmap(pagetable_t pagetable_root, vaddr_t vaddr, size_t size);
+    vaddr_t memcpy(pagetable_t pagetable_root, vaddr_t dst, const void *src, size_t size);
+    void *memcpy(pagetable_t pagetable_root, void *dst, vaddr_t src, size_t size);
+
+    /**
+     * @brief 写出缓冲区中的记录，并追加结束标记，使已写出的部分成为完整的轨迹
+     * @return 成功返回0，此前任何一次写入失败时返回-1
+     */
+    int flush();
+
+private:
+    SV_supervisor<Trait, PMEM> &sv;
+    SV_basic<Trait, PMEM> &mmu;
+    std::shared_ptr<spdlog::logger> logger;
+    int m_fd;
+    bool m_ok = true;
+    std::mutex m_lock; // 保护缓冲区、m_prev_vaddr与记录计数
+    std::vector<uint8_t> m_buf;
+    uint64_t m_prev_vaddr = 0;
+    uint64_t m_records = 0;    // 已记录的操作数
+    uint64_t m_sealed = ~0ull; // 最近一个结束标记中的记录数
+
+    // 写出缓冲区中的内容，调用者持有m_lock
+    int write_out();
+
+    // 追加一条记录，按op只写出格式中规定的字段
+    void record(
+        TraceOp op, bool failed, pagetable_t root, vaddr_t vaddr = 0, size_t size = 0,
+        vaddr_t result = 0, bool lazy = false
+    );
+};
+
+/**
+ * @brief 重放轨迹：从fd流式读取记录，在给定的页表管理器与MMU上尽快依次执行
+ * @note 根页表按记录时的值映射到重放时创建的根页表；
+ *       mmap在新建的对象上通常得到与记录时相同的地址，不同时计入mismatches，之后照常执行
+ */
+template <typename Trait, typename PMEM = PhysicalMemoryInterface> class SV_trace_replayer {
+public:
+    using pagetable_t = typename SV_basic<Trait, PMEM>::pagetable_t;
+
+    SV_trace_replayer(
+        SV_supervisor<Trait, PMEM> &sv, SV_basic<Trait, PMEM> &mmu,
+        std::shared_ptr<spdlog::logger> logger = nullptr
+    )
+        : sv(sv), mmu(mmu), logger(logger ? logger : spdlog::default_logger()) {}
+
+    /**
+     * @brief 重放fd中的整个轨迹，结束时销毁重放中创建而未销毁的根页表
+     * @param fd 轨迹的文件描述符，从其当前位置开始顺序读取，可以是管道
+     * @param stats 输出统计结果，调用时先被清空
+     * @return 成功返回0；轨迹格式错误、与本对象的分页模式不符或被截断时返回-1
+     */
+    int replay(int fd, TraceStats &stats);
+
+private:
+    SV_supervisor<Trait, PMEM> &sv;
+    SV_basic<Trait, PMEM> &mmu;
+    std::shared_ptr<spdlog::logger> logger;
+};
@@ -0,0 +1,383 @@
+#include "buddy.hpp"
+#include "physical_mem.hpp"
+#include "stats.hpp"
+#include "sv_trace.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <random>
+#include <string>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include <spdlog/spdlog.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// 微基准测试，结果以JSON格式输出到标准输出（或命令行参数指定的文件），日志输出到标准错误
+// 每个项目在新建的PMEM/页表管理器上连续执行两遍相同的工作：
+//   cold 第一遍，TLB与每线程页缓存为空，主机尚未为PMEM分配物理页
+//   warm 紧接着的第二遍
+// membox-bench --replay SV39|SV32 <trace> [out.json] 则在新建的对象上重放SV_trace_recorder
+// 记录的轨迹，输出每秒操作数与各类操作的延迟分位数
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double elapsed_ns(Clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+// 一条测量结果
+struct Result {
+    std::string name;
+    std::string mode; // SV32或SV39，与分页模式无关的项目为空
+    std::string state;
+    std::vector<std::pair<std::string, uint64_t>> params;
+    uint64_t ops;
+    double ns;          // 总耗时
+    uint64_t bytes = 0; // 带宽类项目传输的总字节数，其余为0
+};
+
+const char *state_name(int pass) { return pass == 0 ? "cold" : "warm"; }
+
+// 防止被测的调用被优化掉
+volatile uint64_t g_sink;
+
+// 以小页映射num_page个页：每次mmap不足一个大页，因此不会使用大页
+template <typename SV_supervisor>
+typename SV_supervisor::vaddr_t map_small_pages(
+    SV_supervisor &sv, typename SV_supervisor::pagetable_t root, size_t num_page
+) {
+    constexpr size_t PAGESIZE = SV_supervisor::PAGESIZE;
+    constexpr size_t CHUNK = PAGESIZE / sizeof(typename SV_supervisor::pte_t) / 2;
+    typename SV_supervisor::vaddr_t base = 0, next = 0x10000000;
+    for (size_t done = 0; done < num_page; done += CHUNK) {
+        const size_t pages = std::min(CHUNK, num_page - done);
+        const auto vaddr = sv.mmap(root, next, pages * PAGESIZE);
+        if (vaddr != next) return 0;
+        if (done == 0) base = vaddr;
+        next = vaddr + pages * PAGESIZE;
+    }
+    return base;
+}
+
+// 地址翻译延迟：在working set个小页中随机翻译，分别关闭与开启TLB
+template <typename SV_basic, typename SV_supervisor>
+void bench_translate(
+    const char *mode, std::shared_ptr<spdlog::logger> logger, std::vector<Result> &results
+) {
+    constexpr size_t PAGESIZE = SV_basic::PAGESIZE;
+    constexpr size_t OPS = 1 << 20;
+    for (size_t tlb : {0, 1024}) {
+        for (size_t pages : {64, 16384}) {
+            auto pmem = std::make_shared<PhysicalMemoryBasicSim>(1ull << 32, logger);
+            auto sv = std::make_shared<SV_supervisor>(pmem, logger);
+            auto mmu = std::make_shared<SV_basic>(pmem, logger);
+            mmu->set_tlb(tlb, 4);
+            auto root = sv->create_pagetable();
+            const auto base = map_small_pages(*sv, root, pages);
+            if (base == 0) {
+                SPDLOG_LOGGER_ERROR(logger, "bench: failed to map {} pages", pages);
+                continue;
+            }
+            std::mt19937_64 rng(pages);
+            std::vector<typename SV_basic::vaddr_t> vaddrs(OPS);
+            for (auto &vaddr : vaddrs) {
+                vaddr = base + rng() % (pages * PAGESIZE);
+            }
+            for (int pass = 0; pass < 2; pass++) {
+                uint64_t sum = 0;
+                const auto start = Clock::now();
+                for (auto vaddr : vaddrs) {
+                    sum += mmu->translate(root, vaddr);
+                }
+                const double ns = elapsed_ns(start);
+                g_sink = sum;
+                results.push_back(
+                    {"translate", mode, state_name(pass), {{"pages", pages}, {"tlb", tlb}}, OPS, ns}
+                );
+            }
+            sv->destroy_pagetable(root);
+        }
+    }
+}
+
+// mmap/munmap吞吐量：连续映射ops段size字节的区间，再逐段释放
+template <typename SV_basic, typename SV_supervisor>
+void bench_mmap(
+    const char *mode, std::shared_ptr<spdlog::logger> logger, std::vector<Result> &results
+) {
+    constexpr size_t PAGESIZE = SV_basic::PAGESIZE;
+    const size_t hugeSize = PAGESIZE * (PAGESIZE / sizeof(typename SV_basic::pte_t));
+    for (size_t size : {PAGESIZE, 16 * PAGESIZE, 256 * PAGESIZE, hugeSize, 16 * hugeSize}) {
+        const size_t ops = std::clamp<size_t>((256ull << 20) / size, 16, 4096);
+        auto pmem = std::make_shared<PhysicalMemoryBasicSim>(1ull << 32, logger);
+        auto sv = std::make_shared<SV_supervisor>(pmem, logger);
+        auto root = sv->create_pagetable();
+        std::vector<typename SV_basic::vaddr_t> vaddrs(ops);
+        for (int pass = 0; pass < 2; pass++) {
+            auto start = Clock::now();
+            for (auto &vaddr : vaddrs) {
+                vaddr = sv->mmap(root, 0, size);
+            }
+            const double mmap_ns = elapsed_ns(start);
+            start = Clock::now();
+            for (auto vaddr : vaddrs) {
+                sv->munmap(root, vaddr, size);
+            }
+            const double munmap_ns = elapsed_ns(start);
+            if (std::count(vaddrs.begin(), vaddrs.end(), 0) != 0) {
+                SPDLOG_LOGGER_ERROR(logger, "bench: mmap of 0x{:x} bytes failed", size);
+            }
+            results.push_back(
+                {"mmap", mode, state_name(pass), {{"size", size}}, ops, mmap_ns, ops * size}
+            );
+            results.push_back(
+                {"munmap", mode, state_name(pass), {{"size", size}}, ops, munmap_ns, ops * size}
+            );
+        }
+        sv->destroy_pagetable(root);
+    }
+}
+
+// memcpy带宽：按大小与相对页的偏移（0为对齐）在主机与虚拟地址空间之间复制
+template <typename SV_basic, typename SV_supervisor>
+void bench_memcpy(
+    const char *mode, std::shared_ptr<spdlog::logger> logger, std::vector<Result> &results
+) {
+    constexpr size_t PAGESIZE = SV_basic::PAGESIZE;
+    constexpr size_t AREA = 8ull << 20;
+    auto pmem = std::make_shared<PhysicalMemoryBasicSim>(1ull << 32, logger);
+    auto sv = std::make_shared<SV_supervisor>(pmem, logger);
+    auto mmu = std::make_shared<SV_basic>(pmem, logger);
+    mmu->set_tlb(256, 4);
+    auto root = sv->create_pagetable();
+    const auto base = map_small_pages(*sv, root, AREA / PAGESIZE);
+    std::vector<uint8_t> buf(AREA);
+    for (size_t size : {64, 4096, 65536, 1 << 20}) {
+        for (size_t align : {0, 1, 7}) {
+            const size_t ops = std::max<size_t>((64ull << 20) / size, 1);
+            const size_t slots = (AREA - PAGESIZE) / size;
+            for (int dir = 0; dir < 2; dir++) {
+                mmu->sfence_vma();
+                for (int pass = 0; pass < 2; pass++) {
+                    bool ok = true;
+                    const auto start = Clock::now();
+                    for (size_t i = 0; i < ops; i++) {
+                        const auto vaddr = base + (i % slots) * size + align;
+                        if (dir == 0) {
+                            ok &= mmu->memcpy(root, vaddr, buf.data() + align, size) != 0;
+                        } else {
+                            ok &= mmu->memcpy(root, buf.data() + align, vaddr, size) != nullptr;
+                        }
+                    }
+                    const double ns = elapsed_ns(start);
+                    if (!ok) {
+                        SPDLOG_LOGGER_ERROR(logger, "bench: memcpy of {} bytes failed", size);
+                    }
+                    results.push_back(
+                        {dir == 0 ? "memcpy_write" : "memcpy_read", mode, state_name(pass),
+                         {{"size", size}, {"align", align}}, ops, ns, ops * size}
+                    );
+                }
+            }
+        }
+    }
+    sv->destroy_pagetable(root);
+}
+
+// 创建与销毁根页表的开销，销毁时页表中映射着pages个小页
+template <typename SV_basic, typename SV_supervisor>
+void bench_pagetable(
+    const char *mode, std::shared_ptr<spdlog::logger> logger, std::vector<Result> &results
+) {
+    for (size_t pages : {0, 64, 4096, 65536}) {
+        const size_t ops = std::clamp<size_t>((1 << 18) / std::max<size_t>(pages, 1), 4, 1024);
+        auto pmem = std::make_shared<PhysicalMemoryBasicSim>(1ull << 32, logger);
+        auto sv = std::make_shared<SV_supervisor>(pmem, logger);
+        std::vector<typename SV_basic::pagetable_t> roots(ops);
+        for (int pass = 0; pass < 2; pass++) {
+            const auto start = Clock::now();
+            for (auto &root : roots) {
+                root = sv->create_pagetable();
+            }
+            const double create_ns = elapsed_ns(start);
+            for (auto root : roots) {
+                if (pages > 0 && map_small_pages(*sv, root, pages) == 0) {
+                    SPDLOG_LOGGER_ERROR(logger, "bench: failed to map {} pages", pages);
+                }
+            }
+            double destroy_ns = 0;
+            for (auto root : roots) {
+                const auto destroy_start = Clock::now();
+                sv->destroy_pagetable(root);
+                destroy_ns += elapsed_ns(destroy_start);
+            }
+            results.push_back({"create_pagetable", mode, state_name(pass), {}, ops, create_ns});
+            results.push_back(
+                {"destroy_pagetable", mode, state_name(pass), {{"pages", pages}}, ops, destroy_ns}
+            );
+        }
+    }
+}
+
+// buddy allocator每阶的分配与释放开销，frag为预先随机占用的页的百分比（均为单页）
+void bench_buddy(std::vector<Result> &results) {
+    constexpr uint32_t TOTAL = 1 << 18;
+    constexpr uint8_t MAX_ORDER = 10;
+    constexpr size_t OPS = 1024;
+    for (uint64_t frag : {0, 50}) {
+        for (uint8_t order = 0; order <= MAX_ORDER; order++) {
+            BuddyAllocator<> buddy(TOTAL, MAX_ORDER);
+            // 先占满所有单页，再随机释放，使空闲页分散在各处
+            std::vector<uint64_t> pages;
+            for (uint64_t page; frag > 0 && (page = buddy.allocate(0)) != 0;) {
+                pages.push_back(page);
+            }
+            std::mt19937_64 rng(order);
+            std::shuffle(pages.begin(), pages.end(), rng);
+            for (size_t i = pages.size() * frag / 100; i < pages.size(); i++) {
+                buddy.free(pages[i], 0);
+            }
+            std::vector<uint64_t> blocks(OPS);
+            for (int pass = 0; pass < 2; pass++) {
+                auto start = Clock::now();
+                for (auto &block : blocks) {
+                    block = buddy.allocate(order);
+                }
+                const double alloc_ns = elapsed_ns(start);
+                const uint64_t got = OPS - std::count(blocks.begin(), blocks.end(), 0);
+                start = Clock::now();
+                for (auto block : blocks) {
+                    if (block != 0) buddy.free(block, order);
+                }
+                const double free_ns = elapsed_ns(start);
+                const std::vector<std::pair<std::string, uint64_t>> params = {
+                    {"order", order}, {"frag", frag}, {"succeeded", got}
+                };
+                results.push_back({"buddy_allocate", "", state_name(pass), params, OPS, alloc_ns});
+                results.push_back({"buddy_free", "", state_name(pass), params, got, free_ns});
+            }
+        }
+    }
+}
+
+template <typename SV_basic, typename SV_supervisor>
+void bench_mode(
+    const char *mode, std::shared_ptr<spdlog::logger> logger, std::vector<Result> &results
+) {
+    bench_translate<SV_basic, SV_supervisor>(mode, logger, results);
+    bench_mmap<SV_basic, SV_supervisor>(mode, logger, results);
+    bench_memcpy<SV_basic, SV_supervisor>(mode, logger, results);
+    bench_pagetable<SV_basic, SV_supervisor>(mode, logger, results);
+}
+
+void write_json(std::FILE *out, const std::vector<Result> &results) {
+#ifdef NDEBUG
+    constexpr bool ndebug = true;
+#else
+    constexpr bool ndebug = false;
+#endif
+    fmt::print(out, "{{\n  \"build\": {{\"compiler\": \"{}\", \"ndebug\": {}}},\n", __VERSION__,
+               ndebug);
+    fmt::print(out, "  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result &r = results[i];
+        fmt::print(out, "    {{\"name\": \"{}\", ", r.name);
+        if (!r.mode.empty()) fmt::print(out, "\"mode\": \"{}\", ", r.mode);
+        fmt::print(out, "\"state\": \"{}\", \"params\": {{", r.state);
+        for (size_t k = 0; k < r.params.size(); k++) {
+            fmt::print(out, "{}\"{}\": {}", k ? ", " : "", r.params[k].first, r.params[k].second);
+        }
+        const double ns_per_op = r.ops ? r.ns / r.ops : 0;
+        const double ops_per_s = r.ns > 0 ? r.ops * 1e9 / r.ns : 0;
+        fmt::print(out, "}}, \"ops\": {}, \"ns_per_op\": {:.2f}, \"ops_per_s\": {:.0f}", r.ops,
+                   ns_per_op, ops_per_s);
+        if (r.bytes) fmt::print(out, ", \"mb_per_s\": {:.1f}", r.bytes * 1e3 / r.ns);
+        fmt::print(out, "}}{}\n", i + 1 < results.size() ? "," : "");
+    }
+    fmt::print(out, "  ]");
+    // 启用统计时附上整个运行期间的计数与延迟分布
+    if (Stats::ENABLED) fmt::print(out, ",\n  \"stats\": {}", Stats::snapshot().to_json());
+    fmt::print(out, "\n}}\n");
+}
+
+// 转义为JSON字符串的内容（不含两侧引号）
+std::string json_escape(const char *str) {
+    std::string escaped;
+    for (const char *p = str; *p; p++) {
+        const unsigned char c = static_cast<unsigned char>(*p);
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += *p;
+        } else if (c < 0x20) {
+            escaped += fmt::format("\\u{:04x}", c);
+        } else {
+            escaped += *p;
+        }
+    }
+    return escaped;
+}
+
+// 重放一个轨迹文件，成功返回0
+template <typename Trait>
+int replay_trace(
+    const char *mode, const char *path, std::FILE *out, std::shared_ptr<spdlog::logger> logger
+) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        SPDLOG_LOGGER_ERROR(logger, "bench: cannot open {}: {}", path, std::strerror(errno));
+        return -1;
+    }
+    auto pmem = std::make_shared<PhysicalMemoryBasicSim>((1ull << 32), logger);
+    SV_supervisor<Trait, PhysicalMemoryBasicSim> sv(pmem, logger);
+    SV_basic<Trait, PhysicalMemoryBasicSim> mmu(pmem, logger);
+    mmu.set_fault_handler(sv.fault_handler());
+    SV_trace_replayer<Trait, PhysicalMemoryBasicSim> replayer(sv, mmu, logger);
+    TraceStats stats;
+    const int ret = replayer.replay(fd, stats);
+    close(fd);
+    if (ret != 0) return -1;
+    fmt::print(out, "{{\"mode\": \"{}\", \"trace\": \"{}\", \"stats\": {}}}\n", mode,
+               json_escape(path), stats.to_json());
+    return 0;
+}
+
+} // namespace
+
+#include "sv32.hpp"
+#include "sv39.hpp"
+
+int main(int argc, char *argv[]) {
+    auto logger = spdlog::stderr_color_mt("bench");
+    logger->set_level(spdlog::level::warn);
+    const bool replay = argc > 1 && std::strcmp(argv[1], "--replay") == 0;
+    if (replay && (argc < 4 || (std::strcmp(argv[2], "SV39") && std::strcmp(argv[2], "SV32")))) {
+        SPDLOG_LOGGER_ERROR(logger, "usage: {} --replay SV39|SV32 <trace> [out.json]", argv[0]);
+        return -1;
+    }
+    const int outArg = replay ? 4 : 1;
+    std::FILE *out = stdout;
+    if (argc > outArg && (out = std::fopen(argv[outArg], "w")) == nullptr) {
+        SPDLOG_LOGGER_ERROR(logger, "bench: cannot open {}", argv[outArg]);
+        return -1;
+    }
+    if (replay) {
+        const int ret = std::strcmp(argv[2], "SV39") == 0
+                            ? replay_trace<SV39_Trait>(argv[2], argv[3], out, logger)
+                            : replay_trace<SV32_Trait>(argv[2], argv[3], out, logger);
+        if (out != stdout) std::fclose(out);
+        return ret;
+    }
+    std::vector<Result> results;
+    bench_mode<SV39_basic_sim, SV39_supervisor_sim>("SV39", logger, results);
+    bench_mode<SV32_basic_sim, SV32_supervisor_sim>("SV32", logger, results);
+    bench_buddy(results);
+    write_json(out, results);
+    if (out != stdout) std::fclose(out);
+    return 0;
+}
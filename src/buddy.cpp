@@ -1,25 +1,58 @@
 #include "buddy.hpp"
+#include "stats.hpp"
 #include <algorithm>
+#include <bit>
 #include <cassert>
 
 template <size_t elem_size>
 BuddyAllocator<elem_size>::BuddyAllocator(elem_idx_t total_pages, uint8_t max_order)
     : total_pages(total_pages), max_order(max_order) {
     assert(total_pages > 1);
-    assert(total_pages % (1ull << max_order) == 0); // 目前不这样会导致0号页不能提早移除
-    free_lists.resize(max_order + 1);
-    elem_idx_t i = 0;
-    for (int order = max_order; order >= 0; order--) {
-        while (i <= total_pages - (1u << order)) {
-            free_lists[order].push_back(i);
-            i += (1u << order);
+    assert(max_order < NOT_FREE);
+    free_heads.assign(max_order + 1, NIL);
+    m_free_counts.assign(max_order + 1, 0);
+    m_next.assign(total_pages, NIL);
+    m_prev.assign(total_pages, NIL);
+    m_free_order.assign(total_pages, NOT_FREE);
+    // 0号页始终视为已分配且不计入使用量，则之后分配操作返回0表示失败
+    // 其余页按对齐要求切分为尽可能大的块，末尾不足2^max_order的部分切分为较小的块
+    elem_idx_t i = 1;
+    while (i < total_pages) {
+        uint8_t order = 0;
+        while (order < max_order && (i & (1u << order)) == 0 &&
+               i + (2u << order) <= total_pages) {
+            order++;
         }
+        list_push(i, order);
+        i += (1u << order);
+    }
+}
+
+template <size_t elem_size>
+void BuddyAllocator<elem_size>::list_push(elem_idx_t block, uint8_t order) {
+    assert(m_free_order[block] == NOT_FREE);
+    elem_idx_t head = free_heads[order];
+    m_prev[block] = NIL;
+    m_next[block] = head;
+    if (head != NIL) m_prev[head] = block;
+    free_heads[order] = block;
+    m_free_order[block] = order;
+    m_free_counts[order]++;
+}
+
+template <size_t elem_size>
+void BuddyAllocator<elem_size>::list_remove(elem_idx_t block, uint8_t order) {
+    assert(m_free_order[block] == order);
+    elem_idx_t prev = m_prev[block];
+    elem_idx_t next = m_next[block];
+    if (prev != NIL) {
+        m_next[prev] = next;
+    } else {
+        free_heads[order] = next;
     }
-    // 提前将0号页分配出并不释放，则之后分配操作返回0表示失败
-    elem_idx_t alloc0 = allocate(0);
-    assert(alloc0 == 0);
-    static_cast<void>(alloc0); // suppress unused variable warning
-    m_elem_usage -= 1;         // 0号页不计入使用量
+    if (next != NIL) m_prev[next] = prev;
+    m_free_order[block] = NOT_FREE;
+    m_free_counts[order]--;
 }
 
 template <size_t elem_size>
@@ -29,39 +62,145 @@ typename BuddyAllocator<elem_size>::elem_idx_t BuddyAllocator<elem_size>::alloca
     if (order > max_order) return 0;
 
     uint8_t current_order = order;
-    while (current_order <= max_order && free_lists[current_order].empty()) {
+    while (current_order <= max_order && free_heads[current_order] == NIL) {
         current_order++;
     }
     if (current_order > max_order) return 0;
 
-    elem_idx_t block = free_lists[current_order].front();
-    free_lists[current_order].pop_front();
+    elem_idx_t block = free_heads[current_order];
+    list_remove(block, current_order);
     while (current_order > order) {
         current_order--;
         elem_idx_t buddy = block + (1u << current_order);
-        free_lists[current_order].push_back(buddy);
+        list_push(buddy, current_order);
+        Stats::add(StatCounter::BUDDY_SPLIT);
     }
     m_elem_usage += (1u << order);
+    Stats::add(StatCounter::BUDDY_ALLOC);
     return block;
 }
 
 template <size_t elem_size>
 void BuddyAllocator<elem_size>::free_idx(elem_idx_t block, const uint8_t order) {
+    assert(block != 0 && block < total_pages);
     uint8_t cur_order = order;
     while (cur_order < max_order) {
         elem_idx_t buddy = get_buddy_idx(block, cur_order);
-        auto &flist = free_lists[cur_order];
-        auto it = std::find(flist.begin(), flist.end(), buddy);
-        if (it == flist.end()) {
+        if (buddy >= total_pages || m_free_order[buddy] != cur_order) {
             break;
         }
-        flist.erase(it);
+        list_remove(buddy, cur_order);
         if (buddy < block) block = buddy;
         cur_order++;
+        Stats::add(StatCounter::BUDDY_MERGE);
     }
-    free_lists[cur_order].push_back(block);
+    list_push(block, cur_order);
+    Stats::add(StatCounter::BUDDY_FREE);
     assert(m_elem_usage >= (1u << order));
     m_elem_usage -= (1u << order);
 }
 
+template <size_t elem_size>
+void BuddyAllocator<elem_size>::free_range(elem_idx_t block, elem_idx_t n) {
+    while (n > 0) {
+        // 受起始页的对齐与剩余页数限制，取能放下的最大块
+        const int fit = std::bit_width(n) - 1;
+        const uint8_t order = std::min({std::countr_zero(block), fit, static_cast<int>(max_order)});
+        free_idx(block, order);
+        block += elem_idx_t(1) << order;
+        n -= elem_idx_t(1) << order;
+    }
+}
+
+template <size_t elem_size> uint64_t BuddyAllocator<elem_size>::allocate_pages(const elem_idx_t n) {
+    if (n == 0) return 0;
+    const int order = std::bit_width(n - 1);
+    if (order > max_order) return 0;
+    const elem_idx_t block = allocate_idx(order);
+    if (block == 0) return 0;
+    // 尾部的buddy都在已分配的头部中，放回后不会立即合并
+    free_range(block + n, (elem_idx_t(1) << order) - n);
+    return uint64_t(block) * elem_size;
+}
+
+template <size_t elem_size>
+int BuddyAllocator<elem_size>::allocate_at(const uint64_t page_base, const uint8_t order) {
+    assert(page_base % (elem_size << order) == 0);
+    const elem_idx_t target = page_base / elem_size;
+    if (order > max_order || target == 0 || target >= total_pages) return -1;
+    // 查找包含目标块的空闲块，空闲块只在起始页上记录阶
+    uint8_t cur_order = order;
+    elem_idx_t block = target;
+    while (m_free_order[block] != cur_order) {
+        if (++cur_order > max_order) return -1;
+        block = target & ~((elem_idx_t(1) << cur_order) - 1);
+    }
+    list_remove(block, cur_order);
+    // 逐级拆分，不含目标块的一半放回空闲链表
+    while (cur_order > order) {
+        cur_order--;
+        const elem_idx_t half = elem_idx_t(1) << cur_order;
+        if (target & half) {
+            list_push(block, cur_order);
+            block += half;
+        } else {
+            list_push(block + half, cur_order);
+        }
+        Stats::add(StatCounter::BUDDY_SPLIT);
+    }
+    assert(block == target);
+    m_elem_usage += (1u << order);
+    Stats::add(StatCounter::BUDDY_ALLOC);
+    return 0;
+}
+
+template <size_t elem_size> int BuddyAllocator<elem_size>::largest_free_order() const {
+    for (int order = max_order; order >= 0; order--) {
+        if (free_heads[order] != NIL) return order;
+    }
+    return -1;
+}
+
+template <size_t elem_size>
+double BuddyAllocator<elem_size>::fragmentation_index(const uint8_t order) const {
+    uint64_t free_elems = 0, usable = 0;
+    for (uint8_t i = 0; i <= max_order; i++) {
+        free_elems += uint64_t(m_free_counts[i]) << i;
+        if (i >= order) usable += uint64_t(m_free_counts[i]) << i;
+    }
+    return free_elems ? static_cast<double>(free_elems - usable) / free_elems : 0;
+}
+
+template <size_t elem_size>
+std::vector<typename BuddyAllocator<elem_size>::FreeBlock>
+BuddyAllocator<elem_size>::get_free_blocks() const {
+    std::vector<FreeBlock> blocks;
+    for (elem_idx_t i = 1; i < total_pages; i++) {
+        if (m_free_order[i] != NOT_FREE) {
+            blocks.push_back({uint64_t(i) * elem_size, m_free_order[i]});
+            i += (1u << m_free_order[i]) - 1;
+        }
+    }
+    return blocks;
+}
+
+template <size_t elem_size>
+void BuddyAllocator<elem_size>::set_free_blocks(const std::vector<FreeBlock> &blocks) {
+    free_heads.assign(max_order + 1, NIL);
+    m_free_counts.assign(max_order + 1, 0);
+    m_free_order.assign(total_pages, NOT_FREE);
+    size_t free_elems = 0;
+    for (const FreeBlock &blk : blocks) {
+        const elem_idx_t block = blk.page_base / elem_size;
+        assert(blk.page_base % elem_size == 0 && block != 0);
+        assert(blk.order <= max_order && block % (1u << blk.order) == 0);
+        assert(block + (1ull << blk.order) <= total_pages);
+        list_push(block, blk.order);
+        free_elems += 1u << blk.order;
+    }
+    // 0号页始终视为已分配且不计入使用量
+    assert(free_elems < total_pages);
+    m_elem_usage = total_pages - 1 - free_elems;
+}
+
 template class BuddyAllocator<>;
@@ -2,23 +2,111 @@
 #define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_DEBUG
 #endif
 
+#include "buddy.hpp"
 #include "physical_mem.hpp"
+#include "stats.hpp"
+#include "sv_trace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <bit>
 #include <cmath>
+#include <cstdio>
 #include <cstdlib>
 #include <ctime>
 #include <map>
 #include <memory>
 #include <random>
+#include <string>
 #include <spdlog/sinks/stdout_color_sinks.h>
 #include <spdlog/spdlog.h>
+#include <thread>
+#include <unistd.h>
 #include <vector>
 
+// 测试检查，与assert不同，Release构建下同样生效
+#define TEST_CHECK(cond)                                                                           \
+    do {                                                                                           \
+        if (!(cond)) {                                                                             \
+            SPDLOG_LOGGER_ERROR(logger, "Check failed: {}", #cond);                                \
+            return -1;                                                                             \
+        }                                                                                          \
+    } while (0)
+
+// 物理内存接口的分散/聚集读写
+int test_pmem(std::shared_ptr<spdlog::logger> logger) {
+    using IOVec = PhysicalMemoryInterface::IOVec;
+    using PhysRange = PhysicalMemoryInterface::PhysRange;
+    using paddr_t = PhysicalMemoryInterface::paddr_t;
+    std::shared_ptr<PhysicalMemoryInterface> pmem =
+        std::make_shared<PhysicalMemoryBasicSim>((1ull << 24), logger);
+    char a[] = "scatter", b[] = "gather", out[16] = {};
+    IOVec wsegs[] = {{0x3000, a, sizeof(a)}, {0x1ffe, b, sizeof(b)}};
+    TEST_CHECK(pmem->writev(wsegs, 2) == 0);
+    TEST_CHECK(pmem->read(0x3000, out, sizeof(a)) == 0 && std::string(out) == a);
+    TEST_CHECK(pmem->read(0x1ffe, out, sizeof(b)) == 0 && std::string(out) == b);
+    PhysRange franges[] = {{0x3000, 3}, {0x2000, 1}};
+    TEST_CHECK(pmem->fillv(franges, 2, 'x') == 0);
+    char r1[8] = {}, r2[8] = {};
+    IOVec rsegs[] = {{0x3000, r1, sizeof(a)}, {0x1ffe, r2, sizeof(b)}};
+    TEST_CHECK(pmem->readv(rsegs, 2) == 0);
+    TEST_CHECK(std::string(r1) == "xxxtter" && std::string(r2) == "gaxher");
+    // 任一段越界时整体失败，且不做任何修改
+    IOVec bad[] = {{0x3000, b, sizeof(b)}, {(1ull << 24) - 2, a, sizeof(a)}};
+    TEST_CHECK(pmem->writev(bad, 2) != 0);
+    TEST_CHECK(pmem->read(0x3000, out, sizeof(a)) == 0 && std::string(out) == "xxxtter");
+    // 比较并交换：期望值不符时返回1并带回当前值
+    uint64_t expected = 0;
+    TEST_CHECK(pmem->compare_exchange(0x4000, expected, 0x1234, 4) == 0);
+    TEST_CHECK(pmem->compare_exchange(0x4000, expected, 0x5678, 4) == 1 && expected == 0x1234);
+    TEST_CHECK(pmem->compare_exchange(0x4000, expected, 0xc0ffee00c0ffee, 8) == 0);
+    TEST_CHECK(pmem->compare_exchange(0x4002, expected, 0, 4) < 0); // 未对齐
+
+    // 掩码写：各指令集实现与逐字节的参考结果一致，bool掩码与位掩码等价
+    std::mt19937 rng(42);
+    const MaskedCopyISA defaultISA = masked_copy_isa();
+    for (auto isa : {MaskedCopyISA::SCALAR, MaskedCopyISA::SSE2, MaskedCopyISA::AVX2,
+                     MaskedCopyISA::AVX512}) {
+        if (!masked_copy_select(isa)) continue;
+        for (size_t size : {1, 7, 16, 33, 64, 100, 128, 200}) {
+            const paddr_t addr = 0x5000 + rng() % 64;
+            std::vector<uint8_t> src(size), before(size), after(size), expect(size);
+            std::vector<uint8_t> bits((size + 7) / 8);
+            std::unique_ptr<bool[]> mask(new bool[size]);
+            for (size_t i = 0; i < size; i++) {
+                src[i] = rng();
+                mask[i] = rng() % 3 != 0;
+                bits[i / 8] |= mask[i] << (i % 8);
+            }
+            TEST_CHECK(pmem->read(addr, before.data(), size) == 0);
+            for (size_t i = 0; i < size; i++) {
+                expect[i] = mask[i] ? src[i] : before[i];
+            }
+            TEST_CHECK(pmem->write(addr, src.data(), mask.get(), size) == 0);
+            TEST_CHECK(pmem->read(addr, after.data(), size) == 0 && after == expect);
+            TEST_CHECK(pmem->fill(addr, 0, size) == 0);
+            TEST_CHECK(pmem->write_bitmask(addr, src.data(), bits.data(), size) == 0);
+            TEST_CHECK(pmem->read(addr, after.data(), size) == 0);
+            for (size_t i = 0; i < size; i++) {
+                TEST_CHECK(after[i] == (mask[i] ? src[i] : 0));
+            }
+        }
+    }
+    masked_copy_select(defaultISA);
+    return 0;
+}
+
+// 随机测试的种子，默认取当前时间，可通过环境变量MEMBOX_SEED指定以复现某次运行
+unsigned test_seed() {
+    const char *seedEnv = std::getenv("MEMBOX_SEED");
+    return seedEnv ? std::strtoul(seedEnv, nullptr, 0) : std::time(nullptr);
+}
+
 template <typename SV_basic, typename SV_supervisor>
 int test(std::shared_ptr<spdlog::logger> logger) {
-    std::shared_ptr<PhysicalMemoryInterface> pmem =
-        std::make_shared<PhysicalMemoryBasicSim>((1ull << 32), logger);
+    auto pmem = std::make_shared<PhysicalMemoryBasicSim>((1ull << 32), logger);
     auto sv = std::make_shared<SV_supervisor>(pmem, logger);
     auto mmu = std::make_shared<SV_basic>(pmem, logger);
+    mmu->set_tlb(256, 4); // mmu与sv是不同对象，sv修改页表后需要对mmu执行sfence_vma
 
     constexpr size_t PAGESIZE = SV_basic::PAGESIZE;
     using pagetable_t = typename SV_basic::pagetable_t;
@@ -50,16 +138,368 @@ int test(std::shared_ptr<spdlog::logger> logger) {
         data_read_out
     );
     sv->munmap(vmem1, vaddr1, sizeof(data));
+    mmu->sfence_vma(vmem1, vaddr1, sizeof(data));
+    TEST_CHECK(mmu->translate(vmem1, vaddr1) == 0);
     vaddr_t vaddr1_alloc_again = sv->mmap(vmem1, vaddr1, sizeof(data));
     assert(vaddr1_alloc_again == vaddr1);
     sv->munmap(vmem1, vaddr1_alloc_again, sizeof(data));
+
+    // 地址冲突时应紧接已有映射之后分配；允许部分释放
+    vaddr_t vaddr2 = sv->mmap(vmem1, vaddr1, 3 * PAGESIZE);
+    vaddr_t vaddr3 = sv->mmap(vmem1, vaddr1, PAGESIZE);
+    TEST_CHECK(vaddr2 == vaddr1 && vaddr3 == vaddr2 + 3 * PAGESIZE);
+    TEST_CHECK(sv->munmap(vmem1, vaddr2 + PAGESIZE, PAGESIZE) == 0);
+    TEST_CHECK(sv->munmap(vmem1, vaddr2 + PAGESIZE, PAGESIZE) != 0); // 已释放
+    TEST_CHECK(sv->mmap(vmem1, vaddr1, PAGESIZE) == vaddr2 + PAGESIZE);
+    TEST_CHECK(sv->munmap(vmem1, vaddr2, 4 * PAGESIZE) == 0);
+    TEST_CHECK(sv->get_vmem_usage() == 0);
+    TEST_CHECK(sv->get_pmem_usage() == PAGESIZE); // 空的中间页表已回收，只剩根页表
+
+    // 可用地址的上界：SV39只使用规范地址的低半部分[0, 2^38)，SV32可用整个4GiB
+    {
+        const uint64_t vaTop = (SV_basic::LEVELS == 3) ? (1ull << 38) : (1ull << 32);
+        const vaddr_t last = static_cast<vaddr_t>(vaTop - PAGESIZE);
+        TEST_CHECK(sv->mmap(vmem1, last, PAGESIZE) == last);
+        const vaddr_t across = sv->mmap(vmem1, last, 2 * PAGESIZE); // 越过上界时不采用hint
+        TEST_CHECK(across != 0 && across + 2 * PAGESIZE <= vaTop - PAGESIZE);
+        if (SV_basic::LEVELS == 3) {
+            const vaddr_t above = sv->mmap(vmem1, static_cast<vaddr_t>(vaTop), PAGESIZE);
+            TEST_CHECK(above != 0 && above + PAGESIZE <= vaTop - PAGESIZE);
+            TEST_CHECK(sv->munmap(vmem1, above, PAGESIZE) == 0);
+        }
+        TEST_CHECK(sv->munmap(vmem1, across, 2 * PAGESIZE) == 0);
+        TEST_CHECK(sv->munmap(vmem1, last, PAGESIZE) == 0);
+        TEST_CHECK(sv->get_vmem_usage() == 0 && sv->get_pmem_usage() == PAGESIZE);
+    }
+
+    // 跨越多个末级页表的大块映射
+    {
+        const size_t bigSize = (3ull << 20) + 5 * PAGESIZE + 123;
+        vaddr_t bigVaddr = sv->mmap(vmem1, 0x1ff000, bigSize);
+        TEST_CHECK(bigVaddr != 0);
+        std::vector<uint8_t> bigData(bigSize), bigReadOut(bigSize);
+        for (size_t k = 0; k < bigSize; k++) {
+            bigData[k] = static_cast<uint8_t>(k * 131 + 7);
+        }
+        TEST_CHECK(mmu->memcpy(vmem1, bigVaddr, bigData.data(), bigSize));
+        TEST_CHECK(mmu->memcpy(vmem1, bigReadOut.data(), bigVaddr, bigSize));
+        TEST_CHECK(bigData == bigReadOut);
+        // 区间翻译：各段首尾相接地覆盖整个区间，且与逐页翻译的结果一致
+        std::vector<typename SV_basic::TranslatedRun> runs;
+        TEST_CHECK(mmu->translate_range(vmem1, bigVaddr + 5, bigSize - 5, runs) == 0);
+        TEST_CHECK(!runs.empty() && runs.front().vaddr == bigVaddr + 5);
+        size_t covered = 0;
+        for (const auto &run : runs) {
+            TEST_CHECK(run.vaddr == bigVaddr + 5 + covered);
+            TEST_CHECK(mmu->translate(vmem1, run.vaddr) == run.paddr);
+            TEST_CHECK(mmu->translate(vmem1, run.vaddr + run.len - 1) == run.paddr + run.len - 1);
+            covered += run.len;
+        }
+        TEST_CHECK(covered == bigSize - 5);
+        TEST_CHECK(mmu->translate_range(vmem1, bigVaddr, bigSize + 2 * PAGESIZE, runs) != 0);
+        TEST_CHECK(sv->munmap(vmem1, bigVaddr, bigSize) == 0);
+        mmu->sfence_vma(vmem1, bigVaddr, bigSize);
+        TEST_CHECK(sv->get_vmem_usage() == 0);
+        TEST_CHECK(sv->get_pmem_usage() == PAGESIZE);
+    }
+
+    // 大页映射：对齐且足够大的区域使用大页，部分释放时拆分
+    {
+        const size_t hugeSize = (SV_basic::LEVELS == 2) ? (4ull << 20) : (2ull << 20);
+        const size_t pmemBefore = sv->get_pmem_usage();
+        vaddr_t hugeVaddr = sv->mmap(vmem1, 4 * hugeSize, 2 * hugeSize);
+        TEST_CHECK(hugeVaddr == 4 * hugeSize);
+        TEST_CHECK(sv->get_pmem_usage() - pmemBefore < 2 * hugeSize + 2 * PAGESIZE);
+        std::vector<uint8_t> hugeData(2 * hugeSize), hugeReadOut(2 * hugeSize);
+        for (size_t k = 0; k < hugeData.size(); k++) {
+            hugeData[k] = static_cast<uint8_t>(k * 17 + 3);
+        }
+        TEST_CHECK(mmu->memcpy(vmem1, hugeVaddr, hugeData.data(), hugeData.size()));
+        std::vector<typename SV_basic::TranslatedRun> hugeRuns; // 每个大页至多一段
+        TEST_CHECK(mmu->translate_range(vmem1, hugeVaddr, 2 * hugeSize, hugeRuns) == 0);
+        TEST_CHECK(hugeRuns.size() <= 2);
+        // 释放第一个大页中间的一页，其余数据不受影响
+        TEST_CHECK(sv->munmap(vmem1, hugeVaddr + 5 * PAGESIZE, PAGESIZE) == 0);
+        mmu->sfence_vma(vmem1, hugeVaddr + 5 * PAGESIZE, PAGESIZE);
+        TEST_CHECK(mmu->translate(vmem1, hugeVaddr + 5 * PAGESIZE) == 0);
+        TEST_CHECK(mmu->memcpy(vmem1, hugeReadOut.data(), hugeVaddr, 5 * PAGESIZE));
+        TEST_CHECK(mmu->memcpy(
+            vmem1, hugeReadOut.data() + 6 * PAGESIZE, hugeVaddr + 6 * PAGESIZE,
+            hugeData.size() - 6 * PAGESIZE
+        ));
+        TEST_CHECK(
+            std::equal(hugeData.begin(), hugeData.begin() + 5 * PAGESIZE, hugeReadOut.begin())
+        );
+        TEST_CHECK(std::equal(
+            hugeData.begin() + 6 * PAGESIZE, hugeData.end(), hugeReadOut.begin() + 6 * PAGESIZE
+        ));
+        TEST_CHECK(sv->munmap(vmem1, hugeVaddr, 5 * PAGESIZE) == 0);
+        TEST_CHECK(sv->munmap(vmem1, hugeVaddr + 6 * PAGESIZE, 2 * hugeSize - 6 * PAGESIZE) == 0);
+        mmu->sfence_vma(vmem1);
+        TEST_CHECK(sv->get_vmem_usage() == 0);
+        TEST_CHECK(sv->get_pmem_usage() == PAGESIZE); // 拆分出的页表同样被回收
+        if (SV_basic::LEVELS == 3) { // SV39的1GiB大页直接位于根页表中
+            const size_t gigaSize = 1ull << 30;
+            const size_t pmemBefore = sv->get_pmem_usage();
+            TEST_CHECK(sv->mmap(vmem1, gigaSize, gigaSize) == gigaSize);
+            TEST_CHECK(sv->get_pmem_usage() - pmemBefore == gigaSize);
+            TEST_CHECK(mmu->translate(vmem1, 2 * gigaSize - 1) != 0);
+            TEST_CHECK(sv->munmap(vmem1, gigaSize, gigaSize) == 0);
+            mmu->sfence_vma(vmem1);
+        }
+    }
+    // 按需分配：mmap只保留区间，首次访问时才分配物理页
+    {
+        mmu->set_fault_handler(sv->fault_handler());
+        const size_t lazySize = 64ull << 20;
+        vaddr_t lazyVaddr = sv->mmap(vmem1, 0x10000000, lazySize, true);
+        TEST_CHECK(lazyVaddr == 0x10000000);
+        TEST_CHECK(sv->get_pmem_usage() == PAGESIZE);
+        TEST_CHECK(sv->get_vmem_usage() == lazySize);
+        TEST_CHECK(mmu->translate(vmem1, lazyVaddr) == 0);
+        const char msg[] = "touched";
+        const uint64_t touch[] = {lazyVaddr + 12345, lazyVaddr + 5 * PAGESIZE - 3,
+                                  lazyVaddr + lazySize - sizeof(msg)};
+        for (uint64_t v : touch) {
+            TEST_CHECK(mmu->memcpy(vmem1, v, msg, sizeof(msg)) == v);
+        }
+        // 只有被访问的页（及其页表）占用物理内存
+        TEST_CHECK(sv->get_pmem_usage() < 16 * PAGESIZE);
+        char readOut[sizeof(msg)];
+        for (uint64_t v : touch) {
+            TEST_CHECK(mmu->memcpy(vmem1, readOut, v, sizeof(msg)) == readOut);
+            TEST_CHECK(std::string(readOut) == msg);
+        }
+        // 读未访问过的页同样会分配，内容为0
+        TEST_CHECK(mmu->translate(vmem1, lazyVaddr + (32ull << 20), SV_basic::Access::READ) != 0);
+        TEST_CHECK(mmu->memcpy(vmem1, readOut, lazyVaddr + (16ull << 20), sizeof(readOut)));
+        TEST_CHECK(std::all_of(readOut, readOut + sizeof(readOut), [](char c) { return c == 0; }));
+        // 区间外的访问仍然失败
+        TEST_CHECK(mmu->translate(vmem1, lazyVaddr + lazySize, SV_basic::Access::READ) == 0);
+        TEST_CHECK(sv->munmap(vmem1, lazyVaddr + 4 * PAGESIZE, 2 * PAGESIZE) == 0);
+        TEST_CHECK(sv->munmap(vmem1, lazyVaddr, lazySize) != 0); // 中间已释放
+        TEST_CHECK(sv->munmap(vmem1, lazyVaddr, 4 * PAGESIZE) == 0);
+        TEST_CHECK(sv->munmap(vmem1, lazyVaddr + 6 * PAGESIZE, lazySize - 6 * PAGESIZE) == 0);
+        mmu->sfence_vma(vmem1);
+        TEST_CHECK(sv->get_vmem_usage() == 0);
+        TEST_CHECK(sv->get_pmem_usage() == PAGESIZE);
+        mmu->set_fault_handler(nullptr);
+    }
+    // 写时复制：复制后双方共享物理页，写入的一方得到私有副本
+    {
+        mmu->set_fault_handler(sv->fault_handler());
+        const size_t hugeSize = (SV_basic::LEVELS == 2) ? (4ull << 20) : (2ull << 20);
+        const size_t cowSize = 2 * hugeSize + 3 * PAGESIZE; // 两个大页加三个小页
+        TEST_CHECK(sv->mmap(vmem1, hugeSize, cowSize) == hugeSize);
+        std::vector<uint8_t> cowData(cowSize), cowReadOut(cowSize);
+        for (size_t k = 0; k < cowSize; k++) {
+            cowData[k] = static_cast<uint8_t>(k * 31 + 7);
+        }
+        TEST_CHECK(mmu->memcpy(vmem1, hugeSize, cowData.data(), cowSize));
+        const size_t pmemBefore = sv->get_pmem_usage();
+        pagetable_t child = sv->clone_pagetable(vmem1);
+        TEST_CHECK(child != 0);
+        mmu->sfence_vma(vmem1);
+        TEST_CHECK(sv->get_pmem_usage() - pmemBefore <= SV_basic::LEVELS * PAGESIZE);
+        TEST_CHECK(sv->get_vmem_usage() == 2 * cowSize);
+        TEST_CHECK(mmu->translate(child, hugeSize + 123) == mmu->translate(vmem1, hugeSize + 123));
+        // 子空间写入小页与大页中的一个字节，父空间不变
+        const char childMsg[] = "child";
+        const uint64_t smallOff = 2 * hugeSize + PAGESIZE + 10, hugeOff = hugeSize / 2;
+        TEST_CHECK(mmu->memcpy(child, hugeSize + smallOff, childMsg, sizeof(childMsg)));
+        TEST_CHECK(mmu->memcpy(child, hugeSize + hugeOff, childMsg, sizeof(childMsg)));
+        TEST_CHECK(sv->get_pmem_usage() - pmemBefore <= SV_basic::LEVELS * PAGESIZE + hugeSize +
+                                                            PAGESIZE);
+        TEST_CHECK(mmu->memcpy(vmem1, cowReadOut.data(), hugeSize, cowSize));
+        TEST_CHECK(cowReadOut == cowData);
+        std::copy(childMsg, childMsg + sizeof(childMsg), cowData.begin() + smallOff);
+        std::copy(childMsg, childMsg + sizeof(childMsg), cowData.begin() + hugeOff);
+        TEST_CHECK(mmu->memcpy(child, cowReadOut.data(), hugeSize, cowSize));
+        TEST_CHECK(cowReadOut == cowData);
+        // 父空间写入共享的大页，并释放仍被共享的大页中的一页
+        TEST_CHECK(mmu->memcpy(vmem1, hugeSize + hugeOff, "parent", 7));
+        TEST_CHECK(sv->munmap(vmem1, hugeSize + hugeSize + PAGESIZE, PAGESIZE) == 0);
+        mmu->sfence_vma(vmem1);
+        TEST_CHECK(mmu->memcpy(child, cowReadOut.data(), hugeSize, cowSize));
+        TEST_CHECK(cowReadOut == cowData);
+        TEST_CHECK(sv->destroy_pagetable(child) == 0);
+        mmu->sfence_vma(child);
+        TEST_CHECK(sv->munmap(vmem1, hugeSize, hugeSize + PAGESIZE) == 0);
+        TEST_CHECK(sv->munmap(vmem1, 2 * hugeSize + 2 * PAGESIZE, hugeSize + PAGESIZE) == 0);
+        mmu->sfence_vma(vmem1);
+        TEST_CHECK(sv->get_vmem_usage() == 0);
+        TEST_CHECK(sv->get_pmem_usage() == PAGESIZE);
+        mmu->set_fault_handler(nullptr);
+    }
+    // 共享内存段：同一组物理页映射到多个地址空间，物理内存只计一次
+    {
+        const size_t shmSize = 3 * PAGESIZE + 100;
+        const size_t pmemBefore = sv->get_pmem_usage();
+        auto shm = sv->shm_create(shmSize);
+        TEST_CHECK(shm != 0);
+        TEST_CHECK(sv->get_pmem_usage() - pmemBefore == 4 * PAGESIZE);
+        vaddr_t shmVaddr1 = sv->shm_map(vmem1, shm, 0x400000);
+        TEST_CHECK(shmVaddr1 == 0x400000);
+        pagetable_t vmem2 = sv->create_pagetable();
+        TEST_CHECK(vmem2 != 0);
+        const size_t pmemMapped = sv->get_pmem_usage();
+        vaddr_t shmVaddr2 = sv->shm_map(vmem2, shm, 0x800000, true);
+        TEST_CHECK(shmVaddr2 == 0x800000);
+        // 第二次映射只新增页表页
+        TEST_CHECK(sv->get_pmem_usage() - pmemMapped < SV_basic::LEVELS * PAGESIZE);
+        TEST_CHECK(sv->get_vmem_usage() == 8 * PAGESIZE);
+        const char shmMsg[] = "shared";
+        TEST_CHECK(mmu->memcpy(vmem1, shmVaddr1 + 3 * PAGESIZE + 1, shmMsg, sizeof(shmMsg)));
+        char shmReadOut[sizeof(shmMsg)] = {};
+        TEST_CHECK(mmu->memcpy(vmem2, shmReadOut, shmVaddr2 + 3 * PAGESIZE + 1, sizeof(shmMsg)));
+        TEST_CHECK(std::string(shmReadOut) == shmMsg);
+        TEST_CHECK(mmu->memcpy(vmem2, shmVaddr2, shmMsg, sizeof(shmMsg)) == 0); // 只读映射
+        // 复制的地址空间继续共享该段，而不是写时复制
+        pagetable_t vmem3 = sv->clone_pagetable(vmem1);
+        TEST_CHECK(vmem3 != 0);
+        mmu->sfence_vma(vmem1);
+        TEST_CHECK(mmu->memcpy(vmem3, shmVaddr1, shmMsg, sizeof(shmMsg)));
+        TEST_CHECK(mmu->memcpy(vmem2, shmReadOut, shmVaddr2, sizeof(shmMsg)));
+        TEST_CHECK(std::string(shmReadOut) == shmMsg);
+        // 段标识销毁后，已有的映射仍然有效，最后一个映射解除时才释放物理页
+        TEST_CHECK(sv->shm_destroy(shm) == 0);
+        TEST_CHECK(sv->shm_destroy(shm) != 0);
+        TEST_CHECK(sv->shm_map(vmem1, shm, 0x400000) == 0);
+        TEST_CHECK(sv->shm_unmap(vmem1, shm, shmVaddr1) != 0);
+        TEST_CHECK(sv->munmap(vmem1, shmVaddr1, shmSize) == 0);
+        mmu->sfence_vma(vmem1);
+        TEST_CHECK(sv->destroy_pagetable(vmem3) == 0);
+        mmu->sfence_vma(vmem3);
+        TEST_CHECK(mmu->memcpy(vmem2, shmReadOut, shmVaddr2, sizeof(shmMsg)));
+        TEST_CHECK(std::string(shmReadOut) == shmMsg);
+        TEST_CHECK(sv->destroy_pagetable(vmem2) == 0);
+        mmu->sfence_vma(vmem2);
+        TEST_CHECK(sv->get_vmem_usage() == 0);
+        TEST_CHECK(sv->get_pmem_usage() == PAGESIZE);
+        // shm_unmap只接受该段的映射
+        auto shm2 = sv->shm_create(PAGESIZE);
+        vaddr_t plainVaddr = sv->mmap(vmem1, 0x400000, PAGESIZE);
+        vaddr_t shm2Vaddr = sv->shm_map(vmem1, shm2, 0x400000);
+        TEST_CHECK(plainVaddr == 0x400000 && shm2Vaddr == 0x401000);
+        TEST_CHECK(sv->shm_unmap(vmem1, shm2, plainVaddr) != 0);
+        TEST_CHECK(sv->shm_unmap(vmem1, shm2, shm2Vaddr) == 0);
+        TEST_CHECK(sv->munmap(vmem1, plainVaddr, PAGESIZE) == 0);
+        TEST_CHECK(sv->shm_destroy(shm2) == 0);
+        mmu->sfence_vma(vmem1);
+        TEST_CHECK(sv->get_pmem_usage() == PAGESIZE);
+    }
+    // 脏页跟踪：写访问设置PTE.D，收集时返回写过的区间并清除D位
+    {
+        const size_t hugeSize = (SV_basic::LEVELS == 2) ? (4ull << 20) : (2ull << 20);
+        vaddr_t base = sv->mmap(vmem1, hugeSize, hugeSize + 16 * PAGESIZE); // 一个大页加16个小页
+        TEST_CHECK(base == hugeSize);
+        const vaddr_t small = base + hugeSize;
+        std::vector<typename SV_supervisor::VRange> dirty;
+        TEST_CHECK(sv->collect_dirty(vmem1, dirty) == 0 && dirty.empty());
+        std::vector<uint8_t> buf(2 * PAGESIZE);
+        TEST_CHECK(mmu->memcpy(vmem1, buf.data(), base, buf.size())); // 读访问不弄脏页
+        TEST_CHECK(mmu->memcpy(vmem1, small + 2 * PAGESIZE + 100, buf.data(), PAGESIZE));
+        TEST_CHECK(mmu->memcpy(vmem1, small + 7 * PAGESIZE, buf.data(), 1));
+        TEST_CHECK(mmu->memcpy(vmem1, base + 12345, buf.data(), 1));
+        TEST_CHECK(sv->collect_dirty(vmem1, dirty) == 0 && dirty.size() == 3);
+        TEST_CHECK(dirty[0].vaddr == base && dirty[0].size == hugeSize);
+        TEST_CHECK(dirty[1].vaddr == small + 2 * PAGESIZE && dirty[1].size == 2 * PAGESIZE);
+        TEST_CHECK(dirty[2].vaddr == small + 7 * PAGESIZE && dirty[2].size == PAGESIZE);
+        mmu->sfence_vma(vmem1);
+        TEST_CHECK(sv->collect_dirty(vmem1, dirty) == 0 && dirty.empty());
+        // 先读后写：TLB中缓存的只读表项不能用于写，写入时仍会设置D位
+        TEST_CHECK(mmu->memcpy(vmem1, buf.data(), small + 5 * PAGESIZE, 1));
+        TEST_CHECK(mmu->translate(vmem1, small + 5 * PAGESIZE, SV_basic::Access::WRITE) != 0);
+        TEST_CHECK(mmu->memcpy(vmem1, small + 5 * PAGESIZE, buf.data(), 1));
+        TEST_CHECK(sv->collect_dirty(vmem1, dirty) == 0 && dirty.size() == 1);
+        TEST_CHECK(dirty[0].vaddr == small + 5 * PAGESIZE && dirty[0].size == PAGESIZE);
+        mmu->sfence_vma(vmem1);
+        TEST_CHECK(sv->munmap(vmem1, base, hugeSize + 16 * PAGESIZE) == 0);
+        mmu->sfence_vma(vmem1);
+        TEST_CHECK(sv->get_pmem_usage() == PAGESIZE);
+    }
+    // 反向映射与页迁移：由物理页找回映射它的位置，迁移后数据与翻译保持不变
+    {
+        const size_t hugeSize = (SV_basic::LEVELS == 2) ? (4ull << 20) : (2ull << 20);
+        const size_t size = hugeSize + 4 * PAGESIZE; // 一个大页加4个小页
+        vaddr_t base = sv->mmap(vmem1, hugeSize, size);
+        TEST_CHECK(base == hugeSize);
+        std::vector<uint8_t> data(size), readOut(size);
+        for (size_t k = 0; k < size; k++) {
+            data[k] = static_cast<uint8_t>(k * 13 + 5);
+        }
+        TEST_CHECK(mmu->memcpy(vmem1, base, data.data(), size));
+        const vaddr_t smallVaddr = base + hugeSize + 2 * PAGESIZE;
+        const paddr_t small = mmu->translate(vmem1, smallVaddr), huge = mmu->translate(vmem1, base);
+        pagetable_t root = 0;
+        vaddr_t va = 0;
+        TEST_CHECK(sv->migrate_page(small) == 0); // 尚未启用
+        TEST_CHECK(sv->enable_reverse_map() == 0);
+        TEST_CHECK(sv->reverse_map(small, root, va) == 0 && root == vmem1 && va == smallVaddr);
+        TEST_CHECK(sv->reverse_map(huge, root, va) == 1 && root == vmem1 && va == base);
+        TEST_CHECK(sv->reverse_map(huge + PAGESIZE, root, va) == -1);
+        TEST_CHECK(sv->migrate_page(vmem1) == 0); // 根页表不能迁移
+        const paddr_t newSmall = sv->migrate_page(small), newHuge = sv->migrate_page(huge);
+        TEST_CHECK(newSmall != 0 && newSmall != small && newHuge != 0 && newHuge != huge);
+        TEST_CHECK(sv->reverse_map(small, root, va) == -1);
+        TEST_CHECK(sv->reverse_map(newSmall, root, va) == 0 && va == smallVaddr);
+        mmu->sfence_vma(vmem1);
+        TEST_CHECK(mmu->translate(vmem1, smallVaddr + 9) == newSmall + 9);
+        TEST_CHECK(mmu->translate(vmem1, base + hugeSize - 1) == newHuge + hugeSize - 1);
+        // 扫过低地址的物理页，页表页也被迁移
+        const size_t pmemBefore = sv->get_pmem_usage();
+        size_t moved = 0;
+        for (paddr_t p = PAGESIZE; p < 64 * PAGESIZE; p += PAGESIZE) {
+            moved += sv->migrate_page(p) != 0;
+        }
+        TEST_CHECK(moved >= SV_basic::LEVELS - 1);
+        TEST_CHECK(sv->get_pmem_usage() == pmemBefore);
+        mmu->sfence_vma(vmem1);
+        TEST_CHECK(mmu->memcpy(vmem1, readOut.data(), base, size));
+        TEST_CHECK(readOut == data);
+        // 仍被共享的写时复制页不能迁移，另一方销毁后可以
+        pagetable_t child = sv->clone_pagetable(vmem1);
+        TEST_CHECK(child != 0);
+        mmu->sfence_vma(vmem1);
+        const paddr_t shared = mmu->translate(vmem1, smallVaddr); // 扫描时可能已被再次迁移
+        TEST_CHECK(sv->migrate_page(shared) == 0);
+        TEST_CHECK(sv->destroy_pagetable(child) == 0);
+        mmu->sfence_vma(child);
+        TEST_CHECK(sv->migrate_page(shared) != 0);
+        mmu->sfence_vma(vmem1);
+        TEST_CHECK(mmu->memcpy(vmem1, readOut.data(), base, size));
+        TEST_CHECK(readOut == data);
+        // 记录的一方写入而建立私有副本后，原页改记为仍映射它的另一方，可以迁移
+        child = sv->clone_pagetable(vmem1);
+        TEST_CHECK(child != 0);
+        mmu->sfence_vma(vmem1);
+        const paddr_t forked = mmu->translate(vmem1, smallVaddr);
+        const uint8_t byte = 0xa5;
+        TEST_CHECK(sv->memcpy(vmem1, smallVaddr, &byte, 1));
+        mmu->sfence_vma(vmem1);
+        TEST_CHECK(mmu->translate(vmem1, smallVaddr) != forked);
+        TEST_CHECK(sv->reverse_map(forked, root, va) == 0 && root == child && va == smallVaddr);
+        TEST_CHECK(sv->migrate_page(forked) != 0);
+        mmu->sfence_vma(child);
+        TEST_CHECK(mmu->memcpy(child, readOut.data(), base, size));
+        TEST_CHECK(readOut == data);
+        TEST_CHECK(sv->destroy_pagetable(child) == 0);
+        mmu->sfence_vma(child);
+        TEST_CHECK(sv->munmap(vmem1, base, size) == 0);
+        mmu->sfence_vma(vmem1);
+        TEST_CHECK(sv->get_pmem_usage() == PAGESIZE);
+    }
     sv->destroy_pagetable(vmem1);
+    TEST_CHECK(sv->get_pmem_usage() == 0);
+    mmu->sfence_vma(vmem1);
 
     //
     // --- 随机测试 ---
     //
 
-    std::srand(std::time(nullptr));
+    const unsigned seed = test_seed();
+    SPDLOG_LOGGER_INFO(logger, "random test seed: {}", seed);
+    std::srand(seed);
     std::uniform_real_distribution<double> randf64(0, 100);
     std::default_random_engine re;
 
@@ -102,7 +542,7 @@ int test(std::shared_ptr<spdlog::logger> logger) {
     const int testCount = 100000;
     for (int i = 0; i < testCount; i++) {
         double action = randf64(re);
-        if (action < 1.0) { // 新建虚拟地址空间
+        if (action < 0.7) { // 新建虚拟地址空间
             auto new_pagetable = sv->create_pagetable();
             if (new_pagetable != 0) {
                 goldModels[new_pagetable] = {};
@@ -110,12 +550,26 @@ int test(std::shared_ptr<spdlog::logger> logger) {
             } else {
                 SPDLOG_LOGGER_DEBUG(logger, "CrVmem refused");
             }
+        } else if (action < 1.0) { // 写时复制一个虚拟地址空间
+            if (goldModels.empty()) continue;
+            auto vmem_it = goldModels.begin();
+            std::advance(vmem_it, std::rand() % goldModels.size());
+            auto vmem = vmem_it->first;
+            auto child = sv->clone_pagetable(vmem);
+            if (child != 0) {
+                mmu->sfence_vma(vmem);
+                goldModels[child] = goldModels[vmem];
+                SPDLOG_LOGGER_DEBUG(logger, "CloneVmem 0x{:x} -> 0x{:x}", vmem, child);
+            } else {
+                SPDLOG_LOGGER_DEBUG(logger, "CloneVmem refused");
+            }
         } else if (action < 2.0) { // 销毁虚拟地址空间
             if (goldModels.empty()) continue;
             auto vmem_it = goldModels.begin();
             std::advance(vmem_it, std::rand() % goldModels.size());
             auto vmem = vmem_it->first;
             if (sv->destroy_pagetable(vmem) == 0) {
+                mmu->sfence_vma(vmem);
                 SPDLOG_LOGGER_DEBUG(logger, "RmVmem VMEM @ paddr 0x{:x}", vmem);
                 goldModels.erase(vmem);
             } else {
@@ -157,6 +611,7 @@ int test(std::shared_ptr<spdlog::logger> logger) {
                 vaddr_t vaddr = vdata_it->first;
                 size_t dataSize = goldModels[vmem][vaddr].size();
                 if (sv->munmap(vmem, vaddr, dataSize) == 0) {
+                    mmu->sfence_vma(vmem, vaddr, dataSize);
                     SPDLOG_LOGGER_DEBUG(
                         logger, "RmData VMEM @ vaddr 0x{:x}, size {}", vaddr, dataSize
                     );
@@ -211,15 +666,701 @@ int test(std::shared_ptr<spdlog::logger> logger) {
     return 0;
 }
 
+// 多线程压力测试：每个线程独占一个地址空间，共享同一个supervisor，各自对照gold model检查
+template <typename SV_basic, typename SV_supervisor>
+int test_concurrent(std::shared_ptr<spdlog::logger> logger) {
+    auto pmem = std::make_shared<PhysicalMemoryBasicSim>((1ull << 32), logger);
+    auto sv = std::make_shared<SV_supervisor>(pmem, logger);
+
+    constexpr size_t PAGESIZE = SV_basic::PAGESIZE;
+    using pagetable_t = typename SV_basic::pagetable_t;
+    using vaddr_t = typename SV_basic::vaddr_t;
+
+    const int numThreads = 4;
+    const int testCount = 20000;
+    std::atomic<int> failures{0};
+
+    auto worker = [&](unsigned seed) {
+        std::mt19937 rng(seed);
+        SV_basic mmu(pmem, logger); // 每个线程使用自己的MMU（及TLB）
+        mmu.set_tlb(64, 4);
+        pagetable_t vmem = sv->create_pagetable();
+        std::map<vaddr_t, std::vector<uint8_t>> goldModel;
+        int i;
+        for (i = 0; i < testCount && vmem != 0; i++) {
+            unsigned action = rng() % 100;
+            if (action < 1) { // 销毁并重建地址空间
+                if (sv->destroy_pagetable(vmem) != 0) break;
+                mmu.sfence_vma(vmem);
+                goldModel.clear();
+                vmem = sv->create_pagetable();
+            } else if (action < 40) { // 申请内存区域&写操作
+                vaddr_t vaddr = (rng() % 1000) * PAGESIZE;
+                size_t dataSize = 1 + rng() % 8192;
+                vaddr = sv->mmap(vmem, vaddr, dataSize);
+                if (vaddr == 0) continue;
+                std::vector<uint8_t> testData(dataSize);
+                for (auto &byte : testData) {
+                    byte = static_cast<uint8_t>(rng());
+                }
+                if (!mmu.memcpy(vmem, vaddr, testData.data(), dataSize)) break;
+                goldModel[vaddr] = std::move(testData);
+            } else if (action < 70) { // 释放虚拟内存
+                if (goldModel.empty()) continue;
+                auto it = goldModel.begin();
+                std::advance(it, rng() % goldModel.size());
+                if (sv->munmap(vmem, it->first, it->second.size()) != 0) break;
+                mmu.sfence_vma(vmem, it->first, it->second.size());
+                goldModel.erase(it);
+            } else { // 读操作
+                if (goldModel.empty()) continue;
+                auto it = goldModel.begin();
+                std::advance(it, rng() % goldModel.size());
+                std::vector<uint8_t> readData(it->second.size());
+                if (!mmu.memcpy(vmem, readData.data(), it->first, readData.size()) ||
+                    readData != it->second) {
+                    SPDLOG_LOGGER_ERROR(logger, "Concurrent RdData @ vaddr 0x{:x} FAIL", it->first);
+                    break;
+                }
+            }
+        }
+        if (i == testCount && sv->destroy_pagetable(vmem) == 0) {
+            return;
+        }
+        failures++;
+    };
+
+    const unsigned seed = test_seed();
+    SPDLOG_LOGGER_INFO(logger, "concurrent test seed: {}", seed);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; t++) {
+        threads.emplace_back(worker, seed + t);
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    TEST_CHECK(failures == 0);
+    TEST_CHECK(sv->get_vmem_usage() == 0);
+    TEST_CHECK(sv->get_pmem_usage() == 0);
+    // 工作线程退出时已把各自magazine中缓存的页归还buddy，无需drain
+    const std::vector<size_t> counts = sv->get_free_counts();
+    size_t freePages = 0;
+    for (size_t order = 0; order < counts.size(); order++) {
+        freePages += counts[order] << order;
+    }
+    TEST_CHECK(freePages == pmem->m_size / PAGESIZE - 1);
+    SPDLOG_LOGGER_DEBUG(logger, "Concurrent test passed");
+    return 0;
+}
+
+// 主机视图：memfd后端的虚拟地址区间可映射为连续主机内存，与模拟内存保持一致
+template <typename SV_basic, typename SV_supervisor>
+int test_host_view(std::shared_ptr<spdlog::logger> logger) {
+    auto pmem = std::make_shared<PhysicalMemoryMemfd>((1ull << 30), logger);
+    auto sv = std::make_shared<SV_supervisor>(pmem, logger);
+    auto mmu = std::make_shared<SV_basic>(pmem, logger);
+    constexpr size_t PAGESIZE = SV_basic::PAGESIZE;
+    using vaddr_t = typename SV_basic::vaddr_t;
+
+    auto vmem = sv->create_pagetable();
+    TEST_CHECK(vmem != 0);
+    // 先制造碎片，使后续映射的物理页不连续
+    vaddr_t holes = sv->mmap(vmem, 0x10000000, 64 * PAGESIZE);
+    TEST_CHECK(holes != 0);
+    for (size_t k = 0; k < 64; k += 2) {
+        TEST_CHECK(sv->munmap(vmem, holes + k * PAGESIZE, PAGESIZE) == 0);
+    }
+    const size_t size = 700 * PAGESIZE + 77;
+    vaddr_t vaddr = sv->mmap(vmem, 0x20000000, size);
+    TEST_CHECK(vaddr != 0);
+    std::vector<uint8_t> data(size), readOut(size);
+    for (size_t k = 0; k < size; k++) {
+        data[k] = static_cast<uint8_t>(k * 29 + 1);
+    }
+    TEST_CHECK(mmu->memcpy(vmem, vaddr + 13, data.data(), size - 13));
+    auto *view = static_cast<uint8_t *>(
+        mmu->map_host(vmem, vaddr + 13, size - 13, SV_basic::Access::WRITE)
+    );
+    TEST_CHECK(view != nullptr);
+    TEST_CHECK(std::equal(data.begin(), data.end() - 13, view));
+    // 通过视图写入，再经由页表读出
+    for (size_t k = 0; k < size - 13; k += 1000) {
+        view[k] = static_cast<uint8_t>(~view[k]);
+        data[k] = view[k];
+    }
+    TEST_CHECK(mmu->memcpy(vmem, readOut.data(), vaddr + 13, size - 13));
+    TEST_CHECK(std::equal(data.begin(), data.end() - 13, readOut.begin()));
+    TEST_CHECK(mmu->unmap_host(view, size - 13) == 0);
+    // 区间内存在未映射的页时失败
+    TEST_CHECK(mmu->map_host(vmem, holes, 4 * PAGESIZE) == nullptr);
+
+    // 只读视图不破坏写时复制的共享，也不标记脏页；可写视图才复制页
+    mmu->set_fault_handler(sv->fault_handler());
+    std::vector<typename SV_supervisor::VRange> dirty;
+    auto child = sv->clone_pagetable(vmem);
+    TEST_CHECK(child != 0 && sv->collect_dirty(child, dirty) == 0);
+    const auto *roView = static_cast<const uint8_t *>(mmu->map_host(child, vaddr, size));
+    TEST_CHECK(roView != nullptr && std::equal(data.begin(), data.end() - 13, roView + 13));
+    TEST_CHECK(mmu->unmap_host(const_cast<uint8_t *>(roView), size) == 0);
+    TEST_CHECK(mmu->translate(child, vaddr) == mmu->translate(vmem, vaddr));
+    TEST_CHECK(sv->collect_dirty(child, dirty) == 0 && dirty.empty());
+    view = static_cast<uint8_t *>(mmu->map_host(child, vaddr, PAGESIZE, SV_basic::Access::WRITE));
+    TEST_CHECK(view != nullptr && mmu->translate(child, vaddr) != mmu->translate(vmem, vaddr));
+    TEST_CHECK(mmu->unmap_host(view, PAGESIZE) == 0);
+    TEST_CHECK(sv->collect_dirty(child, dirty) == 0 && dirty.size() == 1);
+    // 只读映射的共享内存段只能建立只读视图
+    auto shm = sv->shm_create(2 * PAGESIZE);
+    const vaddr_t shmVaddr = sv->shm_map(child, shm, 0, true);
+    TEST_CHECK(shm != 0 && shmVaddr != 0);
+    roView = static_cast<const uint8_t *>(mmu->map_host(child, shmVaddr, 2 * PAGESIZE));
+    TEST_CHECK(roView != nullptr);
+    TEST_CHECK(mmu->unmap_host(const_cast<uint8_t *>(roView), 2 * PAGESIZE) == 0);
+    TEST_CHECK(mmu->map_host(child, shmVaddr, 2 * PAGESIZE, SV_basic::Access::WRITE) == nullptr);
+    TEST_CHECK(sv->shm_destroy(shm) == 0 && sv->destroy_pagetable(child) == 0);
+
+    TEST_CHECK(sv->destroy_pagetable(vmem) == 0);
+    TEST_CHECK(sv->get_pmem_usage() == 0);
+    return 0;
+}
+
+// 快照：保存后在新的PMEM上恢复，地址空间、共享内存段与数据都与保存时一致
+template <typename SV_basic, typename SV_supervisor, typename PMEM>
+int test_snapshot(std::shared_ptr<spdlog::logger> logger) {
+    constexpr size_t PAGESIZE = SV_basic::PAGESIZE;
+    using vaddr_t = typename SV_basic::vaddr_t;
+    using pagetable_t = typename SV_basic::pagetable_t;
+    const size_t pmemSize = 1ull << 30;
+    const size_t hugeSize = (SV_basic::LEVELS == 2) ? (4ull << 20) : (2ull << 20);
+
+    auto pmem = std::make_shared<PMEM>(pmemSize, logger);
+    auto sv = std::make_shared<SV_supervisor>(pmem, logger);
+    auto mmu = std::make_shared<SV_basic>(pmem, logger);
+    mmu->set_fault_handler(sv->fault_handler());
+    pagetable_t vmem1 = sv->create_pagetable(), vmem2 = sv->create_pagetable();
+    TEST_CHECK(vmem1 != 0 && vmem2 != 0);
+    // 各种映射：小页、大页、按需分配、共享内存段、写时复制
+    std::map<vaddr_t, std::vector<uint8_t>> gold1;
+    const std::pair<vaddr_t, size_t> areas[] = {
+        {0x10000, 5 * PAGESIZE + 7}, {hugeSize, hugeSize}, {0x40000000, 3 * PAGESIZE}
+    };
+    for (const auto &[hint, size] : areas) {
+        vaddr_t vaddr = sv->mmap(vmem1, hint, size, hint == 0x40000000);
+        TEST_CHECK(vaddr == hint);
+        std::vector<uint8_t> data(size);
+        for (size_t k = 0; k < size; k++) {
+            data[k] = static_cast<uint8_t>(k * 7 + hint / PAGESIZE);
+        }
+        TEST_CHECK(mmu->memcpy(vmem1, vaddr, data.data(), size));
+        gold1[vaddr] = std::move(data);
+    }
+    auto shm = sv->shm_create(2 * PAGESIZE);
+    TEST_CHECK(sv->shm_map(vmem1, shm, 0x800000) == 0x800000);
+    TEST_CHECK(sv->shm_map(vmem2, shm, 0x800000) == 0x800000);
+    pagetable_t vmem3 = sv->clone_pagetable(vmem1);
+    TEST_CHECK(vmem3 != 0);
+    const size_t pmemUsage = sv->get_pmem_usage(), vmemUsage = sv->get_vmem_usage();
+
+    std::FILE *file = std::tmpfile();
+    TEST_CHECK(file != nullptr);
+    const int fd = fileno(file);
+    TEST_CHECK(sv->save(fd) == 0);
+    // 快照只包含在用的页，远小于PMEM
+    const off_t fileSize = lseek(fd, 0, SEEK_END);
+    TEST_CHECK(fileSize > 0 && static_cast<size_t>(fileSize) < pmemUsage + 64 * PAGESIZE);
+
+    auto pmem2 = std::make_shared<PMEM>(pmemSize, logger);
+    auto sv2 = std::make_shared<SV_supervisor>(pmem2, logger);
+    auto mmu2 = std::make_shared<SV_basic>(pmem2, logger);
+    mmu2->set_fault_handler(sv2->fault_handler());
+    TEST_CHECK(lseek(fd, 0, SEEK_SET) == 0);
+    TEST_CHECK(sv2->enable_reverse_map() == 0); // 恢复时按页表重建反向映射
+    TEST_CHECK(sv2->load(fd) == 0);
+    TEST_CHECK(lseek(fd, 0, SEEK_CUR) == fileSize);
+    TEST_CHECK(sv2->load(fd) != 0); // 已在使用中
+    TEST_CHECK(sv2->get_pmem_usage() == pmemUsage && sv2->get_vmem_usage() == vmemUsage);
+    TEST_CHECK(pmem2->host_resident(0, pmemSize) > 0);
+    for (pagetable_t root : {vmem1, vmem3}) {
+        for (const auto &[vaddr, data] : gold1) {
+            std::vector<uint8_t> readOut(data.size());
+            TEST_CHECK(mmu2->memcpy(root, readOut.data(), vaddr, data.size()));
+            TEST_CHECK(readOut == data);
+            TEST_CHECK(mmu2->translate(root, vaddr) == mmu->translate(root, vaddr));
+        }
+    }
+    pagetable_t rmapRoot = 0;
+    vaddr_t rmapVaddr = 0;
+    TEST_CHECK(sv2->reverse_map(mmu2->translate(vmem1, hugeSize), rmapRoot, rmapVaddr) >= 0);
+    TEST_CHECK((rmapRoot == vmem1 || rmapRoot == vmem3) && rmapVaddr == hugeSize);
+    TEST_CHECK(sv2->reverse_map(mmu2->translate(vmem2, 0x800000), rmapRoot, rmapVaddr) == -1);
+    // 恢复后的共享内存段、写时复制与按需分配照常工作
+    const char msg[] = "restored";
+    char readOut[sizeof(msg)] = {};
+    TEST_CHECK(mmu2->memcpy(vmem2, 0x800000 + 100, msg, sizeof(msg)));
+    TEST_CHECK(mmu2->memcpy(vmem3, readOut, 0x800000 + 100, sizeof(msg)));
+    TEST_CHECK(std::string(readOut) == msg);
+    TEST_CHECK(mmu2->memcpy(vmem3, 0x10000, msg, sizeof(msg)));
+    TEST_CHECK(mmu2->memcpy(vmem1, readOut, 0x10000, sizeof(msg)));
+    TEST_CHECK(std::equal(readOut, readOut + sizeof(msg), gold1[0x10000].begin()));
+    TEST_CHECK(mmu2->memcpy(vmem1, 0x40000000 + 3 * PAGESIZE - 1, msg, 1));
+    // 原对象不受影响
+    TEST_CHECK(mmu->memcpy(vmem2, readOut, 0x800000 + 100, sizeof(msg)));
+    TEST_CHECK(std::all_of(readOut, readOut + sizeof(msg), [](char c) { return c == 0; }));
+    // 释放恢复出的页后重新分配，读出为0
+    TEST_CHECK(sv2->munmap(vmem1, hugeSize, hugeSize) == 0);
+    mmu2->sfence_vma(vmem1);
+    TEST_CHECK(sv2->shm_destroy(shm) == 0);
+    for (pagetable_t root : {vmem1, vmem2, vmem3}) {
+        TEST_CHECK(sv2->destroy_pagetable(root) == 0);
+    }
+    mmu2->sfence_vma();
+    TEST_CHECK(sv2->get_pmem_usage() == 0 && sv2->get_vmem_usage() == 0);
+    // 释放的页（包括直接映射快照文件的页）不再占用主机内存
+    TEST_CHECK(pmem2->host_resident(0, pmemSize) == 0);
+    pagetable_t vmem4 = sv2->create_pagetable();
+    vaddr_t fresh = sv2->mmap(vmem4, 0x10000, pmemUsage);
+    TEST_CHECK(fresh != 0);
+    std::vector<uint8_t> freshOut(pmemUsage);
+    TEST_CHECK(mmu2->memcpy(vmem4, freshOut.data(), fresh, pmemUsage));
+    TEST_CHECK(std::all_of(freshOut.begin(), freshOut.end(), [](uint8_t c) { return c == 0; }));
+    TEST_CHECK(sv2->destroy_pagetable(vmem4) == 0);
+    // 共享内存段的标识或页地址损坏的快照被拒绝，且不改变对象的状态
+    auto sv3 = std::make_shared<SV_supervisor>(std::make_shared<PMEM>(pmemSize, logger), logger);
+    const uint64_t shmRecord[] = {
+        shm, 2, mmu->translate(vmem2, 0x800000), mmu->translate(vmem2, 0x800000 + PAGESIZE)
+    };
+    std::vector<uint64_t> meta(4 * PAGESIZE / sizeof(uint64_t));
+    TEST_CHECK(pread(fd, meta.data(), 4 * PAGESIZE, 0) == static_cast<ssize_t>(4 * PAGESIZE));
+    const auto rec = std::search(meta.begin(), meta.end(), shmRecord, std::end(shmRecord));
+    TEST_CHECK(rec != meta.end());
+    const off_t recOffset = (rec - meta.begin()) * sizeof(uint64_t);
+    const std::pair<size_t, uint64_t> corruptions[] = {
+        {0, 0}, {0, 1000}, {2, 0}, {2, pmemSize}, {3, shmRecord[3] + 8}
+    };
+    for (const auto &[word, value] : corruptions) {
+        const off_t off = recOffset + word * sizeof(uint64_t);
+        TEST_CHECK(pwrite(fd, &value, sizeof(value), off) == sizeof(value));
+        TEST_CHECK(lseek(fd, 0, SEEK_SET) == 0 && sv3->load(fd) != 0);
+        TEST_CHECK(pwrite(fd, &shmRecord[word], sizeof(value), off) == sizeof(value));
+    }
+    TEST_CHECK(sv3->get_pmem_usage() == 0);
+    // 截断的快照被拒绝
+    TEST_CHECK(ftruncate(fd, fileSize - 1) == 0 && lseek(fd, 0, SEEK_SET) == 0);
+    TEST_CHECK(sv3->load(fd) != 0);
+    std::fclose(file);
+
+    TEST_CHECK(sv->shm_destroy(shm) == 0);
+    for (pagetable_t root : {vmem1, vmem2, vmem3}) {
+        TEST_CHECK(sv->destroy_pagetable(root) == 0);
+    }
+    TEST_CHECK(sv->get_pmem_usage() == 0);
+    return 0;
+}
+
+// PMEM为页表管理器的物理内存类型，PMEMImpl为实际创建的物理内存
+template <typename Trait, typename PMEM, typename PMEMImpl = PMEM>
+int test_trace(std::shared_ptr<spdlog::logger> logger) {
+    using SV_basic = SV_basic<Trait, PMEM>;
+    using SV_supervisor = SV_supervisor<Trait, PMEM>;
+    constexpr size_t PAGESIZE = SV_basic::PAGESIZE;
+    using vaddr_t = typename SV_basic::vaddr_t;
+    using pagetable_t = typename SV_basic::pagetable_t;
+    const size_t pmemSize = 1ull << 30;
+
+    std::FILE *file = std::tmpfile();
+    TEST_CHECK(file != nullptr);
+    const int fd = fileno(file);
+    std::shared_ptr<PMEM> pmem = std::make_shared<PMEMImpl>(pmemSize, logger);
+    auto sv = std::make_shared<SV_supervisor>(pmem, logger);
+    auto mmu = std::make_shared<SV_basic>(pmem, logger);
+    mmu->set_fault_handler(sv->fault_handler());
+    // 以固定种子生成的负载，其中包括一次失败的munmap
+    size_t recorded = 0, mmaps = 0;
+    off_t checkpoint = 0, lastRecord = 0;
+    pagetable_t vmem2;
+    {
+        SV_trace_recorder<Trait, PMEM> rec(*sv, *mmu, fd, logger);
+        std::mt19937 rng(1);
+        pagetable_t vmem1 = rec.create_pagetable();
+        vmem2 = rec.create_pagetable();
+        recorded += 2;
+        std::vector<uint8_t> buf(3 * PAGESIZE);
+        for (int round = 0; round < 20; round++) {
+            const pagetable_t root = (round % 2) ? vmem1 : vmem2;
+            const size_t size = (1 + rng() % 8) * PAGESIZE;
+            vaddr_t vaddr = rec.mmap(root, (1 + rng() % 64) * PAGESIZE, size, round % 3 == 0);
+            TEST_CHECK(vaddr != 0);
+            for (int k = 0; k < 4; k++) {
+                const vaddr_t pos = vaddr + rng() % size;
+                const size_t len = std::min<size_t>(1 + rng() % buf.size(), vaddr + size - pos);
+                TEST_CHECK(rec.memcpy(root, pos, buf.data(), len) != 0);
+                TEST_CHECK(rec.memcpy(root, buf.data(), pos, len) != nullptr);
+            }
+            if (round % 4 == 3) {
+                TEST_CHECK(rec.munmap(root, vaddr, size) == 0);
+                recorded++;
+            }
+            recorded += 9;
+            mmaps++;
+        }
+        TEST_CHECK(rec.munmap(vmem1, 0x7f000000, PAGESIZE) != 0);
+        TEST_CHECK(rec.flush() == 0);
+        checkpoint = lseek(fd, 0, SEEK_CUR);
+        TEST_CHECK(rec.destroy_pagetable(vmem1) == 0);
+        recorded += 2;
+        // DESTROY记录为操作码与根页表页号
+        lastRecord = 1;
+        for (uint64_t ppn = vmem1 / PAGESIZE; ppn > 0; ppn >>= 7) lastRecord++;
+    }
+    // 每条记录只占几个字节
+    const off_t traceSize = lseek(fd, 0, SEEK_END);
+    TEST_CHECK(traceSize > 0 && static_cast<size_t>(traceSize) < 64 + recorded * 12);
+    TEST_CHECK(sv->destroy_pagetable(vmem2) == 0);
+
+    // 在新的对象上重放，得到与记录时相同的结果，且结束时销毁剩余的根页表
+    std::shared_ptr<PMEM> pmem2 = std::make_shared<PMEMImpl>(pmemSize, logger);
+    auto sv2 = std::make_shared<SV_supervisor>(pmem2, logger);
+    auto mmu2 = std::make_shared<SV_basic>(pmem2, logger);
+    mmu2->set_fault_handler(sv2->fault_handler());
+    SV_trace_replayer<Trait, PMEM> replayer(*sv2, *mmu2, logger);
+    TraceStats stats;
+    TEST_CHECK(lseek(fd, 0, SEEK_SET) == 0);
+    TEST_CHECK(replayer.replay(fd, stats) == 0);
+    TEST_CHECK(stats.ops == recorded && stats.mismatches == 0);
+    TEST_CHECK(stats.op_latency[static_cast<size_t>(TraceOp::MMAP)].count() == mmaps);
+    TEST_CHECK(stats.latency.percentile(50) <= stats.latency.percentile(99));
+    TEST_CHECK(stats.latency.percentile(99) <= stats.latency.max() && stats.ops_per_sec() > 0);
+    TEST_CHECK(sv2->get_pmem_usage() == 0 && sv2->get_vmem_usage() == 0);
+    // 截断的轨迹被拒绝，包括恰好在记录边界处截断、缺少结束标记的轨迹
+    TEST_CHECK(ftruncate(fd, traceSize - 1) == 0 && lseek(fd, 0, SEEK_SET) == 0);
+    TEST_CHECK(replayer.replay(fd, stats) != 0);
+    TEST_CHECK(ftruncate(fd, checkpoint + lastRecord) == 0 && lseek(fd, 0, SEEK_SET) == 0);
+    TEST_CHECK(replayer.replay(fd, stats) != 0);
+    // flush()写出的部分是完整的轨迹
+    TEST_CHECK(ftruncate(fd, checkpoint) == 0 && lseek(fd, 0, SEEK_SET) == 0);
+    TEST_CHECK(replayer.replay(fd, stats) == 0 && stats.ops == recorded - 1);
+    TEST_CHECK(sv2->get_pmem_usage() == 0 && sv2->get_vmem_usage() == 0);
+    std::fclose(file);
+    return 0;
+}
+
+template <typename SV_basic, typename SV_supervisor>
+int test_stats(std::shared_ptr<spdlog::logger> logger) {
+    constexpr size_t PAGESIZE = SV_basic::PAGESIZE;
+    auto pmem = std::make_shared<PhysicalMemoryBasicSim>((1ull << 30), logger);
+    auto sv = std::make_shared<SV_supervisor>(pmem, logger);
+    auto mmu = std::make_shared<SV_basic>(pmem, logger);
+    mmu->set_tlb(64);
+    mmu->set_fault_handler(sv->fault_handler());
+
+    Stats::reset();
+    auto vmem = sv->create_pagetable();
+    auto vaddr = sv->mmap(vmem, 0, 16 * PAGESIZE);
+    auto lazy = sv->mmap(vmem, 0, 4 * PAGESIZE, true);
+    TEST_CHECK(vaddr != 0 && lazy != 0);
+    // 同一页翻译两次，第二次命中TLB；写按需分配的页触发一次缺页
+    TEST_CHECK(mmu->translate(vmem, vaddr) != 0 && mmu->translate(vmem, vaddr) != 0);
+    uint8_t buf[64] = {};
+    TEST_CHECK(mmu->memcpy(vmem, lazy, buf, sizeof(buf)) != 0);
+    // 其他线程的计数在线程退出后仍然计入
+    int munmapResult = -1;
+    std::thread([&] { munmapResult = sv->munmap(vmem, lazy, 4 * PAGESIZE); }).join();
+    TEST_CHECK(munmapResult == 0);
+    TEST_CHECK(sv->destroy_pagetable(vmem) == 0);
+
+    StatsSnapshot snap = Stats::snapshot();
+    SPDLOG_LOGGER_DEBUG(logger, "stats:\n{}", snap.to_text());
+    if (Stats::ENABLED) {
+        TEST_CHECK(snap[StatTimer::MMAP].count() == 2 && snap[StatTimer::MUNMAP].count() == 1);
+        TEST_CHECK(snap[StatCounter::TLB_HIT] >= 1 && snap[StatCounter::TLB_MISS] >= 1);
+        TEST_CHECK(snap.tlb_hit_rate() > 0 && snap.tlb_hit_rate() < 1);
+        // 页表遍历与分配页只抽样计时
+        TEST_CHECK(snap[StatTimer::PAGE_WALK].count() <= snap[StatCounter::PAGE_WALK]);
+        TEST_CHECK(snap[StatCounter::PTE_READ] >= snap[StatCounter::PAGE_WALK]);
+        TEST_CHECK(snap[StatCounter::PTE_WRITE] >= 20 && snap[StatCounter::PAGE_FAULT] == 1);
+        TEST_CHECK(snap[StatCounter::PAGE_WALK] >= 2 && snap[StatCounter::PAGE_ALLOC] >= 17);
+        TEST_CHECK(snap[StatCounter::BUDDY_ALLOC] > 0 && snap[StatCounter::PMEM_CAS] > 0);
+        TEST_CHECK(snap[StatCounter::PMEM_READ] > 0 && snap[StatCounter::PMEM_WRITE] > 0);
+        TEST_CHECK(snap[StatCounter::PMEM_WRITE_BYTES] >= sizeof(buf));
+    } else {
+        for (uint64_t count : snap.counters) TEST_CHECK(count == 0);
+        TEST_CHECK(snap[StatTimer::MMAP].count() == 0);
+    }
+    TEST_CHECK(snap.to_json().find("\"tlb_hit\": ") != std::string::npos);
+
+    // 清零后从头计数
+    Stats::reset();
+    snap = Stats::snapshot();
+    for (uint64_t count : snap.counters) TEST_CHECK(count == 0);
+    TEST_CHECK(snap[StatTimer::MMAP].count() == 0 && snap[StatTimer::PAGE_WALK].count() == 0);
+    return 0;
+}
+
+template <typename SV_basic, typename SV_supervisor>
+int test_compact(std::shared_ptr<spdlog::logger> logger) {
+    constexpr size_t PAGESIZE = SV_basic::PAGESIZE;
+    using vaddr_t = typename SV_basic::vaddr_t;
+    using pagetable_t = typename SV_basic::pagetable_t;
+    const size_t hugeSize = (SV_basic::LEVELS == 2) ? (4ull << 20) : (2ull << 20);
+    const uint8_t hugeOrder = std::bit_width(hugeSize / PAGESIZE) - 1;
+    auto pmem = std::make_shared<PhysicalMemoryBasicSim>((32ull << 20), logger);
+    auto sv = std::make_shared<SV_supervisor>(pmem, logger);
+    auto mmu = std::make_shared<SV_basic>(pmem, logger);
+    TEST_CHECK(sv->compact(hugeOrder) != 0); // 尚未启用反向映射
+    TEST_CHECK(sv->enable_reverse_map() == 0);
+    TEST_CHECK(sv->largest_free_order() >= hugeOrder && sv->fragmentation_index(hugeOrder) < 0.2);
+
+    // 逐页映射直到物理内存耗尽，再隔页释放，剩下的空闲页都是零散的单页
+    auto vmem = sv->create_pagetable();
+    std::vector<vaddr_t> pages;
+    for (vaddr_t vaddr; (vaddr = sv->mmap(vmem, 0, PAGESIZE)) != 0;) {
+        pages.push_back(vaddr);
+    }
+    TEST_CHECK(pages.size() > pmem->m_size / PAGESIZE / 2);
+    std::vector<vaddr_t> kept;
+    for (size_t i = 0; i < pages.size(); i++) {
+        if (i % 2) {
+            TEST_CHECK(sv->munmap(vmem, pages[i], PAGESIZE) == 0);
+        } else {
+            kept.push_back(pages[i]);
+            TEST_CHECK(mmu->memcpy(vmem, pages[i], &pages[i], sizeof(vaddr_t)));
+        }
+    }
+    const std::vector<size_t> counts = sv->get_free_counts();
+    size_t freePages = 0;
+    for (size_t order = 0; order < counts.size(); order++) {
+        freePages += counts[order] << order;
+    }
+    TEST_CHECK(counts[0] > 0 && freePages * PAGESIZE + sv->get_pmem_usage() < pmem->m_size);
+    TEST_CHECK(sv->largest_free_order() < 2 && sv->fragmentation_index(hugeOrder) > 0.99);
+
+    // 按需整理出一个大页大小的块，数据与翻译不受影响
+    TEST_CHECK(sv->compact(hugeOrder) == 0);
+    TEST_CHECK(sv->largest_free_order() >= hugeOrder && sv->fragmentation_index(hugeOrder) < 0.99);
+    for (vaddr_t vaddr : kept) {
+        vaddr_t readOut = 0;
+        TEST_CHECK(mmu->memcpy(vmem, &readOut, vaddr, sizeof(vaddr_t)) && readOut == vaddr);
+    }
+    TEST_CHECK(sv->compact(hugeOrder + 30) != 0);
+
+    // 第一个大页用掉整理出的块；开启自动整理后，分配第二个大页时先整理再重试
+    pagetable_t root = 0;
+    vaddr_t rootVaddr = 0;
+    const vaddr_t huge1 = sv->mmap(vmem, 0x40000000, hugeSize);
+    TEST_CHECK(huge1 == 0x40000000);
+    TEST_CHECK(sv->reverse_map(mmu->translate(vmem, huge1), root, rootVaddr) == 1);
+    TEST_CHECK(sv->largest_free_order() < hugeOrder);
+    const size_t usageBefore = sv->get_pmem_usage();
+    sv->set_auto_compact(true);
+    const vaddr_t huge2 = sv->mmap(vmem, 0x40000000 + hugeSize, hugeSize);
+    TEST_CHECK(huge2 == 0x40000000 + hugeSize);
+    TEST_CHECK(sv->reverse_map(mmu->translate(vmem, huge2), root, rootVaddr) == 1);
+    TEST_CHECK(root == vmem && rootVaddr == huge2);
+    TEST_CHECK(sv->get_pmem_usage() == usageBefore + hugeSize);
+    for (vaddr_t vaddr : kept) {
+        vaddr_t readOut = 0;
+        TEST_CHECK(mmu->memcpy(vmem, &readOut, vaddr, sizeof(vaddr_t)) && readOut == vaddr);
+    }
+    TEST_CHECK(sv->destroy_pagetable(vmem) == 0);
+    TEST_CHECK(sv->get_pmem_usage() == 0);
+    return 0;
+}
+
+// 其他线程不断分配与释放（页停留在各自的magazine中）时，按需整理仍能凑出大页大小的块。
+// 整理期间各线程只调用mmap/munmap，不经SV_basic访问数据页，满足migrate_page的前提
+template <typename SV_basic, typename SV_supervisor>
+int test_compact_concurrent(std::shared_ptr<spdlog::logger> logger) {
+    constexpr size_t PAGESIZE = SV_basic::PAGESIZE;
+    using vaddr_t = typename SV_basic::vaddr_t;
+    const size_t hugeSize = (SV_basic::LEVELS == 2) ? (4ull << 20) : (2ull << 20);
+    const uint8_t hugeOrder = std::bit_width(hugeSize / PAGESIZE) - 1;
+    auto pmem = std::make_shared<PhysicalMemoryBasicSim>((32ull << 20), logger);
+    auto sv = std::make_shared<SV_supervisor>(pmem, logger);
+    auto mmu = std::make_shared<SV_basic>(pmem, logger);
+    TEST_CHECK(sv->enable_reverse_map() == 0);
+
+    // 占满物理内存后隔页释放，空闲页都是零散的单页
+    auto vmem = sv->create_pagetable();
+    std::vector<vaddr_t> pages, kept;
+    for (vaddr_t vaddr; (vaddr = sv->mmap(vmem, 0, PAGESIZE)) != 0;) {
+        pages.push_back(vaddr);
+    }
+    for (size_t i = 0; i < pages.size(); i++) {
+        if (i % 2) {
+            TEST_CHECK(sv->munmap(vmem, pages[i], PAGESIZE) == 0);
+        } else {
+            kept.push_back(pages[i]);
+            TEST_CHECK(mmu->memcpy(vmem, pages[i], &pages[i], sizeof(vaddr_t)));
+        }
+    }
+    TEST_CHECK(sv->largest_free_order() < 2);
+
+    std::atomic<bool> stop{false};
+    std::atomic<int> failures{0}, ready{0};
+    std::atomic<size_t> ops{0};
+    auto worker = [&](unsigned seed) {
+        std::mt19937 rng(seed);
+        SV_basic wmmu(pmem, logger);
+        auto root = sv->create_pagetable();
+        // 整理开始前写入的页，结束后检查内容
+        std::vector<vaddr_t> mine, churn;
+        while (root != 0 && mine.size() < 48) {
+            const vaddr_t vaddr = sv->mmap(root, 0, PAGESIZE);
+            if (vaddr == 0 || !wmmu.memcpy(root, vaddr, &vaddr, sizeof(vaddr_t))) {
+                failures++;
+                break;
+            }
+            mine.push_back(vaddr);
+        }
+        ready++;
+        while (root != 0 && !stop) {
+            if (churn.empty() || rng() % 2) {
+                const vaddr_t vaddr = sv->mmap(root, 0, PAGESIZE);
+                if (vaddr == 0) continue;
+                churn.push_back(vaddr);
+            } else {
+                const size_t k = rng() % churn.size();
+                if (sv->munmap(root, churn[k], PAGESIZE) != 0) failures++;
+                churn[k] = churn.back();
+                churn.pop_back();
+            }
+            ops++;
+        }
+        for (vaddr_t vaddr : mine) {
+            vaddr_t readOut = 0;
+            if (!wmmu.memcpy(root, &readOut, vaddr, sizeof(vaddr_t)) || readOut != vaddr) {
+                failures++;
+            }
+        }
+        if (root == 0 || sv->destroy_pagetable(root) != 0) failures++;
+    };
+    const unsigned seed = test_seed();
+    SPDLOG_LOGGER_INFO(logger, "concurrent compaction test seed: {}", seed);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < 3; t++) {
+        threads.emplace_back(worker, seed + t);
+    }
+    while (ready < 3 || ops < 3000) {
+        std::this_thread::yield();
+    }
+    bool compacted = false;
+    for (int attempt = 0; attempt < 10 && !compacted; attempt++) {
+        compacted = sv->compact(hugeOrder) == 0;
+    }
+    stop = true;
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    TEST_CHECK(compacted && failures == 0);
+    for (vaddr_t vaddr : kept) {
+        vaddr_t readOut = 0;
+        TEST_CHECK(mmu->memcpy(vmem, &readOut, vaddr, sizeof(vaddr_t)) && readOut == vaddr);
+    }
+    TEST_CHECK(sv->destroy_pagetable(vmem) == 0);
+    TEST_CHECK(sv->get_pmem_usage() == 0);
+    return 0;
+}
+
+template <typename SV_basic, typename SV_supervisor>
+int test_exact_alloc(std::shared_ptr<spdlog::logger> logger) {
+    constexpr size_t PAGESIZE = SV_basic::PAGESIZE;
+    using FreeBlock = BuddyAllocator<PAGESIZE>::FreeBlock;
+    auto freePages = [](const std::vector<size_t> &counts) {
+        size_t pages = 0;
+        for (size_t order = 0; order < counts.size(); order++) {
+            pages += counts[order] << order;
+        }
+        return pages;
+    };
+    auto sameBlocks = [](const std::vector<FreeBlock> &a, const std::vector<FreeBlock> &b) {
+        return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](auto &x, auto &y) {
+            return x.page_base == y.page_base && x.order == y.order;
+        });
+    };
+
+    // 总页数不是最大块的整数倍，除0号页外都可以分配
+    BuddyAllocator<PAGESIZE> buddy(1000, 10);
+    const auto initial = buddy.get_free_blocks();
+    TEST_CHECK(freePages(buddy.get_free_counts()) == 999 && buddy.get_usage() == 0);
+    TEST_CHECK(buddy.allocate_pages(0) == 0 && buddy.allocate_pages(1025) == 0);
+
+    // 9页只占用9页，尾部的7页仍可分配
+    const uint64_t base = buddy.allocate_pages(9);
+    TEST_CHECK(base != 0 && base % (16 * PAGESIZE) == 0 && buddy.get_usage() == 9 * PAGESIZE);
+    TEST_CHECK(freePages(buddy.get_free_counts()) == 990);
+    std::vector<uint64_t> pages;
+    for (uint64_t page; (page = buddy.allocate(0)) != 0;) {
+        TEST_CHECK(page < base || page >= base + 9 * PAGESIZE);
+        pages.push_back(page);
+    }
+    TEST_CHECK(pages.size() == 990 && buddy.get_usage() == 999 * PAGESIZE);
+    for (uint64_t page : pages) {
+        buddy.free(page, 0);
+    }
+    buddy.free_pages(base, 9);
+    TEST_CHECK(buddy.get_usage() == 0 && sameBlocks(buddy.get_free_blocks(), initial));
+
+    // 以非2的幂的大小占满内存，释放后重新合并为初始的空闲块
+    std::vector<std::pair<uint64_t, uint32_t>> runs;
+    for (uint32_t n : {7u, 3u, 1u}) {
+        for (uint64_t page; (page = buddy.allocate_pages(n)) != 0;) {
+            runs.push_back({page, n});
+        }
+    }
+    TEST_CHECK(buddy.get_usage() == 999 * PAGESIZE && buddy.largest_free_order() == -1);
+    std::shuffle(runs.begin(), runs.end(), std::mt19937_64(runs.size()));
+    for (auto [page, n] : runs) {
+        buddy.free_pages(page, n);
+    }
+    TEST_CHECK(buddy.get_usage() == 0 && sameBlocks(buddy.get_free_blocks(), initial));
+
+    // 物理内存大小不是最大块的整数倍时，页表管理器同样能用上所有的页
+    auto pmem = std::make_shared<PhysicalMemoryBasicSim>((8ull << 20) + 5 * PAGESIZE, logger);
+    auto sv = std::make_shared<SV_supervisor>(pmem, logger);
+    const size_t totalPages = pmem->m_size / PAGESIZE;
+    TEST_CHECK(freePages(sv->get_free_counts()) == totalPages - 1);
+    auto vmem = sv->create_pagetable();
+    while (sv->mmap(vmem, 0, PAGESIZE) != 0) {
+    }
+    TEST_CHECK(sv->get_pmem_usage() == (totalPages - 1) * PAGESIZE);
+    TEST_CHECK(sv->destroy_pagetable(vmem) == 0 && sv->get_pmem_usage() == 0);
+    return 0;
+}
+
 #include "sv32.hpp"
 #include "sv39.hpp"
 
 int main() {
     auto logger = spdlog::stdout_color_mt("main");
+    int result_pmem = test_pmem(logger);
     int result39 = test<SV39_basic, SV39_supervisor>(logger);
     int result32 = test<SV32_basic, SV32_supervisor>(logger);
+    int result39_sim = test<SV39_basic_sim, SV39_supervisor_sim>(logger);
+    int result32_sim = test<SV32_basic_sim, SV32_supervisor_sim>(logger);
+    int result39_mt = test_concurrent<SV39_basic, SV39_supervisor>(logger);
+    int result32_mt = test_concurrent<SV32_basic_sim, SV32_supervisor_sim>(logger);
+    int result39_view = test_host_view<SV39_basic_sim, SV39_supervisor_sim>(logger);
+    int result32_view = test_host_view<SV32_basic, SV32_supervisor>(logger);
+    int result39_snap =
+        test_snapshot<SV39_basic_sim, SV39_supervisor_sim, PhysicalMemoryBasicSim>(logger);
+    int result32_snap = test_snapshot<SV32_basic, SV32_supervisor, PhysicalMemoryMemfd>(logger);
+    int result39_trace = test_trace<SV39_Trait, PhysicalMemoryBasicSim>(logger);
+    int result32_trace =
+        test_trace<SV32_Trait, PhysicalMemoryInterface, PhysicalMemoryMemfd>(logger);
+    int result39_stats = test_stats<SV39_basic_sim, SV39_supervisor_sim>(logger);
+    int result32_stats = test_stats<SV32_basic_sim, SV32_supervisor_sim>(logger);
+    int result39_compact = test_compact<SV39_basic_sim, SV39_supervisor_sim>(logger);
+    int result32_compact = test_compact<SV32_basic_sim, SV32_supervisor_sim>(logger);
+    int result39_compact_mt = test_compact_concurrent<SV39_basic_sim, SV39_supervisor_sim>(logger);
+    int result32_compact_mt = test_compact_concurrent<SV32_basic_sim, SV32_supervisor_sim>(logger);
+    int result39_exact = test_exact_alloc<SV39_basic_sim, SV39_supervisor_sim>(logger);
+    int result32_exact = test_exact_alloc<SV32_basic_sim, SV32_supervisor_sim>(logger);
 
-    if (result39 == 0 && result32 == 0) {
+    if (result_pmem == 0 && result39 == 0 && result32 == 0 && result39_sim == 0 &&
+        result32_sim == 0 && result39_mt == 0 && result32_mt == 0 && result39_view == 0 &&
+        result32_view == 0 && result39_snap == 0 && result32_snap == 0 && result39_trace == 0 &&
+        result32_trace == 0 && result39_stats == 0 && result32_stats == 0 &&
+        result39_compact == 0 && result32_compact == 0 && result39_compact_mt == 0 &&
+        result32_compact_mt == 0 && result39_exact == 0 && result32_exact == 0) {
         SPDLOG_LOGGER_INFO(logger, "All test passed: SV39 and SV32");
         return 0;
     } else {
@@ -0,0 +1,255 @@
+#include "masked_copy.hpp"
+#include <atomic>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define MASKED_COPY_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// 8位掩码展开为8字节的字节掩码（第i位为1时第i字节为0xff）
+struct BitExpandTable {
+    uint64_t bytes[256];
+    constexpr BitExpandTable() : bytes() {
+        for (int m = 0; m < 256; m++) {
+            for (int i = 0; i < 8; i++) {
+                if ((m >> i) & 1) bytes[m] |= 0xffull << (8 * i);
+            }
+        }
+    }
+};
+constexpr BitExpandTable BIT_EXPAND{};
+
+inline uint64_t load64(const void *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+inline void store64(void *p, uint64_t v) { memcpy(p, &v, sizeof(v)); }
+
+// 按8字节一组处理，mask为字节掩码
+inline void blend64(uint8_t *dst, const uint8_t *src, uint64_t mask) {
+    if (mask == 0) return;
+    store64(dst, (load64(dst) & ~mask) | (load64(src) & mask));
+}
+
+void copy_scalar(uint8_t *dst, const uint8_t *src, const bool mask[], size_t size) {
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        // bool的每个字节只能是0或1，乘以0xff不会产生进位
+        blend64(dst + i, src + i, load64(mask + i) * 0xff);
+    }
+    for (; i < size; i++) {
+        if (mask[i]) dst[i] = src[i];
+    }
+}
+
+void copy_bits_scalar(uint8_t *dst, const uint8_t *src, const uint8_t mask[], size_t size) {
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        blend64(dst + i, src + i, BIT_EXPAND.bytes[mask[i / 8]]);
+    }
+    for (; i < size; i++) {
+        if ((mask[i / 8] >> (i % 8)) & 1) dst[i] = src[i];
+    }
+}
+
+#ifdef MASKED_COPY_X86
+
+// 以下各实现处理完整的向量宽度，剩余部分交给标量实现
+// 向量宽度均为8的倍数，因此位掩码的剩余部分总是从整字节开始
+
+__attribute__((target("sse2"))) inline void blend128(uint8_t *dst, const uint8_t *src, __m128i m) {
+    const int bits = _mm_movemask_epi8(m);
+    if (bits == 0) return;
+    __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+    if (bits != 0xffff) {
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst));
+        s = _mm_or_si128(_mm_and_si128(m, s), _mm_andnot_si128(m, d));
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), s);
+}
+
+__attribute__((target("sse2"))) void copy_sse2(
+    uint8_t *dst, const uint8_t *src, const bool mask[], size_t size
+) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i *>(mask + i));
+        blend128(dst + i, src + i, _mm_cmpgt_epi8(m, zero));
+    }
+    copy_scalar(dst + i, src + i, mask + i, size - i);
+}
+
+__attribute__((target("sse2"))) void copy_bits_sse2(
+    uint8_t *dst, const uint8_t *src, const uint8_t mask[], size_t size
+) {
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i m = _mm_set_epi64x(
+            static_cast<long long>(BIT_EXPAND.bytes[mask[i / 8 + 1]]),
+            static_cast<long long>(BIT_EXPAND.bytes[mask[i / 8]])
+        );
+        blend128(dst + i, src + i, m);
+    }
+    copy_bits_scalar(dst + i, src + i, mask + i / 8, size - i);
+}
+
+__attribute__((target("avx2"))) inline void blend256(uint8_t *dst, const uint8_t *src, __m256i m) {
+    const uint32_t bits = static_cast<uint32_t>(_mm256_movemask_epi8(m));
+    if (bits == 0) return;
+    __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src));
+    if (bits != 0xffffffffu) {
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst));
+        s = _mm256_blendv_epi8(d, s, m);
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst), s);
+}
+
+__attribute__((target("avx2"))) void copy_avx2(
+    uint8_t *dst, const uint8_t *src, const bool mask[], size_t size
+) {
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i m = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(mask + i));
+        blend256(dst + i, src + i, _mm256_cmpgt_epi8(m, zero));
+    }
+    copy_scalar(dst + i, src + i, mask + i, size - i);
+}
+
+__attribute__((target("avx2"))) void copy_bits_avx2(
+    uint8_t *dst, const uint8_t *src, const uint8_t mask[], size_t size
+) {
+    // 把32位掩码的第k字节复制到第8k..8k+7字节，再逐字节测试对应的位
+    const __m256i shuffle = _mm256_setr_epi8(
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3,
+        3, 3
+    );
+    const __m256i bitsel = _mm256_set1_epi64x(0x8040201008040201ll);
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        uint32_t bits;
+        memcpy(&bits, mask + i / 8, sizeof(bits));
+        __m256i m = _mm256_shuffle_epi8(_mm256_set1_epi32(static_cast<int>(bits)), shuffle);
+        m = _mm256_cmpeq_epi8(_mm256_and_si256(m, bitsel), bitsel);
+        blend256(dst + i, src + i, m);
+    }
+    copy_bits_scalar(dst + i, src + i, mask + i / 8, size - i);
+}
+
+// AVX-512BW直接以掩码寄存器做带掩码存储，剩余部分同样用掩码处理
+__attribute__((target("avx512f,avx512bw"))) void copy_avx512(
+    uint8_t *dst, const uint8_t *src, const bool mask[], size_t size
+) {
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        __m512i m = _mm512_loadu_si512(mask + i);
+        __mmask64 k = _mm512_test_epi8_mask(m, m);
+        _mm512_mask_storeu_epi8(dst + i, k, _mm512_loadu_si512(src + i));
+    }
+    if (i < size) {
+        const __mmask64 tail = (1ull << (size - i)) - 1;
+        __m512i m = _mm512_maskz_loadu_epi8(tail, mask + i);
+        __mmask64 k = _mm512_test_epi8_mask(m, m);
+        _mm512_mask_storeu_epi8(dst + i, k, _mm512_maskz_loadu_epi8(k, src + i));
+    }
+}
+
+__attribute__((target("avx512f,avx512bw"))) void copy_bits_avx512(
+    uint8_t *dst, const uint8_t *src, const uint8_t mask[], size_t size
+) {
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        _mm512_mask_storeu_epi8(dst + i, load64(mask + i / 8), _mm512_loadu_si512(src + i));
+    }
+    if (i < size) {
+        uint64_t bits = 0;
+        memcpy(&bits, mask + i / 8, (size - i + 7) / 8);
+        const __mmask64 k = bits & ((1ull << (size - i)) - 1);
+        _mm512_mask_storeu_epi8(dst + i, k, _mm512_maskz_loadu_epi8(k, src + i));
+    }
+}
+
+#endif // MASKED_COPY_X86
+
+struct Impl {
+    void (*copy)(uint8_t *, const uint8_t *, const bool[], size_t);
+    void (*copy_bits)(uint8_t *, const uint8_t *, const uint8_t[], size_t);
+};
+
+// 按MaskedCopyISA的顺序排列
+#ifdef MASKED_COPY_X86
+constexpr Impl IMPLS[] = {
+    {copy_scalar, copy_bits_scalar},
+    {copy_sse2, copy_bits_sse2},
+    {copy_avx2, copy_bits_avx2},
+    {copy_avx512, copy_bits_avx512},
+};
+#else
+constexpr Impl IMPLS[] = {{copy_scalar, copy_bits_scalar}};
+#endif
+
+bool cpu_supports(MaskedCopyISA isa) {
+    switch (isa) {
+    case MaskedCopyISA::SCALAR:
+        return true;
+#ifdef MASKED_COPY_X86
+    case MaskedCopyISA::SSE2:
+        return __builtin_cpu_supports("sse2");
+    case MaskedCopyISA::AVX2:
+        return __builtin_cpu_supports("avx2");
+    case MaskedCopyISA::AVX512:
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#endif
+    default:
+        return false;
+    }
+}
+
+MaskedCopyISA detect() {
+    for (auto isa : {MaskedCopyISA::AVX512, MaskedCopyISA::AVX2, MaskedCopyISA::SSE2}) {
+        if (cpu_supports(isa)) return isa;
+    }
+    return MaskedCopyISA::SCALAR;
+}
+
+std::atomic<const Impl *> g_impl{nullptr};
+std::atomic<MaskedCopyISA> g_isa{MaskedCopyISA::SCALAR};
+
+inline const Impl *impl() {
+    const Impl *p = g_impl.load(std::memory_order_relaxed);
+    if (p == nullptr) [[unlikely]] {
+        // 并发首次调用时各线程检测结果相同，重复写入无害
+        MaskedCopyISA isa = detect();
+        p = &IMPLS[static_cast<int>(isa)];
+        g_isa.store(isa, std::memory_order_relaxed);
+        g_impl.store(p, std::memory_order_relaxed);
+    }
+    return p;
+}
+
+} // namespace
+
+void masked_copy(uint8_t *dst, const uint8_t *src, const bool mask[], size_t size) {
+    impl()->copy(dst, src, mask, size);
+}
+
+void masked_copy_bits(uint8_t *dst, const uint8_t *src, const uint8_t mask[], size_t size) {
+    impl()->copy_bits(dst, src, mask, size);
+}
+
+MaskedCopyISA masked_copy_isa() {
+    impl();
+    return g_isa.load(std::memory_order_relaxed);
+}
+
+bool masked_copy_select(MaskedCopyISA isa) {
+    if (!cpu_supports(isa)) return false;
+    g_isa.store(isa, std::memory_order_relaxed);
+    g_impl.store(&IMPLS[static_cast<int>(isa)], std::memory_order_relaxed);
+    return true;
+}
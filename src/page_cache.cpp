@@ -0,0 +1,271 @@
+#include "page_cache.hpp"
+#include <cassert>
+#include <utility>
+
+// 锁顺序：Anchor::lock -> Magazine::lock -> m_lock；持有m_lock时不得再获取任何Magazine::lock
+
+template <size_t elem_size>
+PageCache<elem_size>::PageCache(elem_idx_t total_elems, uint8_t max_order)
+    : m_buddy(total_elems, max_order), m_anchor(std::make_shared<Anchor>()) {
+    m_anchor->cache = this;
+}
+
+template <size_t elem_size> PageCache<elem_size>::~PageCache() {
+    // 之后退出的线程不再访问本实例，其表项在下次查找未命中时清除
+    std::lock_guard<std::mutex> lock(m_anchor->lock);
+    m_anchor->cache = nullptr;
+}
+
+template <size_t elem_size> PageCache<elem_size>::LocalMagazines::~LocalMagazines() {
+    for (Entry &entry : entries) {
+        std::lock_guard<std::mutex> lock(entry.anchor->lock);
+        if (entry.anchor->cache) entry.anchor->cache->release_magazine(*entry.mag);
+    }
+}
+
+template <size_t elem_size> void PageCache<elem_size>::release_magazine(Magazine &mag) {
+    {
+        std::lock_guard<std::mutex> lock(mag.lock);
+        for (uint8_t order = 0; order < CACHED_ORDERS; order++) {
+            spill(mag, order, mag.count[order]);
+        }
+    }
+    // magazine本身不释放：drain()可能正持有它的指针
+    std::lock_guard<std::mutex> lock(m_lock);
+    mag.in_use = false;
+}
+
+template <size_t elem_size>
+typename PageCache<elem_size>::Magazine &PageCache<elem_size>::local_magazine() {
+    thread_local LocalMagazines local;
+    for (const auto &entry : local.entries) {
+        if (entry.anchor == m_anchor) return *entry.mag;
+    }
+    // 未命中时顺带清除已销毁实例的表项，使查找开销只与存活的实例数有关
+    std::erase_if(local.entries, [](const auto &entry) {
+        std::lock_guard<std::mutex> lock(entry.anchor->lock);
+        return entry.anchor->cache == nullptr;
+    });
+    Magazine *mag = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        for (auto &m : m_magazines) {
+            if (!m->in_use) {
+                mag = m.get();
+                break;
+            }
+        }
+        if (mag == nullptr) {
+            m_magazines.push_back(std::make_unique<Magazine>());
+            mag = m_magazines.back().get();
+        }
+        mag->in_use = true;
+    }
+    local.entries.push_back({m_anchor, mag});
+    return *mag;
+}
+
+template <size_t elem_size> void PageCache<elem_size>::refill(Magazine &mag, const uint8_t order) {
+    std::lock_guard<std::mutex> lock(m_lock);
+    size_t &count = mag.count[order];
+    while (count < BATCH) {
+        uint64_t page = m_buddy.allocate(order);
+        if (page == 0) break;
+        mag.pages[order][count++] = page;
+        m_cached_elems += (1u << order);
+    }
+}
+
+template <size_t elem_size>
+void PageCache<elem_size>::spill(Magazine &mag, const uint8_t order, const size_t n) {
+    std::lock_guard<std::mutex> lock(m_lock);
+    size_t &count = mag.count[order];
+    assert(n <= count);
+    for (size_t i = 0; i < n; i++) {
+        m_buddy.free(mag.pages[order][--count], order);
+        m_cached_elems -= (1u << order);
+    }
+}
+
+template <size_t elem_size> uint64_t PageCache<elem_size>::allocate(const uint8_t order) {
+    if (order < CACHED_ORDERS) {
+        Magazine &mag = local_magazine();
+        {
+            std::lock_guard<std::mutex> lock(mag.lock);
+            if (mag.count[order] == 0) refill(mag, order);
+            if (mag.count[order] > 0) {
+                m_cached_elems -= (1u << order);
+                return mag.pages[order][--mag.count[order]];
+            }
+        }
+    }
+    std::unique_lock<std::mutex> lock(m_lock);
+    uint64_t page = m_buddy.allocate(order);
+    if (page == 0 && m_cached_elems > 0) {
+        // 其他线程缓存的页可能足以合并出所需的块
+        lock.unlock();
+        drain();
+        lock.lock();
+        page = m_buddy.allocate(order);
+    }
+    return page;
+}
+
+template <size_t elem_size>
+void PageCache<elem_size>::free(uint64_t page_base, const uint8_t order) {
+    if (order < CACHED_ORDERS) {
+        Magazine &mag = local_magazine();
+        std::lock_guard<std::mutex> lock(mag.lock);
+        if (mag.count[order] == MAGAZINE_SIZE) spill(mag, order, BATCH);
+        mag.pages[order][mag.count[order]++] = page_base;
+        m_cached_elems += (1u << order);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_buddy.free(page_base, order);
+}
+
+template <size_t elem_size>
+size_t PageCache<elem_size>::allocate_batch(uint64_t page_bases[], const size_t count) {
+    size_t got = 0;
+    {
+        Magazine &mag = local_magazine();
+        std::lock_guard<std::mutex> lock(mag.lock);
+        while (got < count && mag.count[0] > 0) {
+            page_bases[got++] = mag.pages[0][--mag.count[0]];
+            m_cached_elems -= 1;
+        }
+    }
+    if (got < count) { // 剩余部分在一次加锁内直接从buddy分配
+        std::lock_guard<std::mutex> lock(m_lock);
+        while (got < count && (page_bases[got] = m_buddy.allocate(0)) != 0) {
+            got++;
+        }
+    }
+    if (got < count && m_cached_elems > 0) {
+        drain();
+        std::lock_guard<std::mutex> lock(m_lock);
+        while (got < count && (page_bases[got] = m_buddy.allocate(0)) != 0) {
+            got++;
+        }
+    }
+    return got;
+}
+
+template <size_t elem_size>
+void PageCache<elem_size>::free_batch(const uint64_t page_bases[], const size_t count) {
+    Magazine &mag = local_magazine();
+    std::lock_guard<std::mutex> lock(mag.lock);
+    size_t i = 0;
+    // 先填满magazine，其余在一次加锁内直接归还buddy
+    while (i < count && mag.count[0] < MAGAZINE_SIZE) {
+        mag.pages[0][mag.count[0]++] = page_bases[i++];
+        m_cached_elems += 1;
+    }
+    if (i < count) {
+        std::lock_guard<std::mutex> buddy_lock(m_lock);
+        for (; i < count; i++) {
+            m_buddy.free(page_bases[i], 0);
+        }
+    }
+}
+
+template <size_t elem_size> uint64_t PageCache<elem_size>::allocate_pages(const elem_idx_t n) {
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_buddy.allocate_pages(n);
+}
+
+template <size_t elem_size>
+void PageCache<elem_size>::free_pages(const uint64_t page_base, const elem_idx_t n) {
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_buddy.free_pages(page_base, n);
+}
+
+template <size_t elem_size>
+int PageCache<elem_size>::allocate_at(const uint64_t page_base, const uint8_t order) {
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_buddy.allocate_at(page_base, order);
+}
+
+template <size_t elem_size>
+void PageCache<elem_size>::free_uncached(const uint64_t page_base, const uint8_t order) {
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_buddy.free(page_base, order);
+}
+
+template <size_t elem_size> int PageCache<elem_size>::take_cached(const uint64_t page_base) {
+    std::vector<Magazine *> magazines;
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        for (auto &mag : m_magazines) {
+            magazines.push_back(mag.get());
+        }
+    }
+    for (Magazine *mag : magazines) {
+        std::lock_guard<std::mutex> lock(mag->lock);
+        for (uint8_t order = 0; order < CACHED_ORDERS; order++) {
+            uint64_t *pages = mag->pages[order];
+            size_t &count = mag->count[order];
+            for (size_t i = 0; i < count; i++) {
+                if (pages[i] != page_base) continue;
+                pages[i] = pages[--count];
+                m_cached_elems -= (1u << order);
+                return order;
+            }
+        }
+    }
+    return -1;
+}
+
+template <size_t elem_size> std::vector<size_t> PageCache<elem_size>::get_free_counts() const {
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_buddy.get_free_counts();
+}
+
+template <size_t elem_size> int PageCache<elem_size>::largest_free_order() const {
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_buddy.largest_free_order();
+}
+
+template <size_t elem_size>
+double PageCache<elem_size>::fragmentation_index(const uint8_t order) const {
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_buddy.fragmentation_index(order);
+}
+
+template <size_t elem_size> size_t PageCache<elem_size>::get_usage() const {
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_buddy.get_usage() - m_cached_elems * elem_size;
+}
+
+template <size_t elem_size> void PageCache<elem_size>::drain() {
+    std::vector<Magazine *> magazines;
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        for (auto &mag : m_magazines) {
+            magazines.push_back(mag.get());
+        }
+    }
+    for (Magazine *mag : magazines) {
+        std::lock_guard<std::mutex> lock(mag->lock);
+        for (uint8_t order = 0; order < CACHED_ORDERS; order++) {
+            spill(*mag, order, mag->count[order]);
+        }
+    }
+}
+
+template <size_t elem_size>
+std::vector<typename PageCache<elem_size>::FreeBlock> PageCache<elem_size>::get_free_blocks() {
+    drain();
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_buddy.get_free_blocks();
+}
+
+template <size_t elem_size>
+void PageCache<elem_size>::set_free_blocks(const std::vector<FreeBlock> &blocks) {
+    drain();
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_buddy.set_free_blocks(blocks);
+}
+
+template class PageCache<>;
@@ -0,0 +1,158 @@
+#include "stats.hpp"
+
+#include <fmt/format.h>
+#include <iterator>
+#include <vector>
+
+#ifdef MEMBOX_STATS
+namespace {
+
+// 全局的线程表与已退出线程的累计值，有意不析构，以便静态对象析构后退出的线程仍能注销
+struct Registry {
+    std::mutex lock;
+    std::vector<Stats::ThreadStats *> threads;
+    uint64_t retired[StatsSnapshot::NUM_COUNTERS] = {};
+    LogHistogram retired_timers[StatsSnapshot::NUM_TIMERS];
+    uint64_t base[StatsSnapshot::NUM_COUNTERS] = {}; // reset()时各计数器的总和
+    // 线程注销后（如其他线程本地对象析构时）仍有记录则计入这里，多个线程同时退出时计数可能略少
+    Stats::ThreadStats exited;
+
+    Registry() { threads.push_back(&exited); }
+};
+
+Registry &registry() {
+    static Registry *reg = new Registry();
+    return *reg;
+}
+
+// 所有线程的计数器总和，调用者持有registry().lock
+void sum_counters(Registry &reg, uint64_t sums[]) {
+    for (size_t i = 0; i < StatsSnapshot::NUM_COUNTERS; i++) {
+        sums[i] = reg.retired[i];
+        for (Stats::ThreadStats *ts : reg.threads) {
+            sums[i] += ts->counters[i].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+} // namespace
+
+Stats::ThreadStats *Stats::attach() {
+    // 线程退出时把计数并入retired，再从线程表中移除
+    struct Guard {
+        ThreadStats stats;
+        Guard() {
+            Registry &reg = registry();
+            std::lock_guard<std::mutex> lock(reg.lock);
+            reg.threads.push_back(&stats);
+        }
+        ~Guard() {
+            Registry &reg = registry();
+            std::lock_guard<std::mutex> lock(reg.lock);
+            for (size_t i = 0; i < StatsSnapshot::NUM_COUNTERS; i++) {
+                reg.retired[i] += stats.counters[i].load(std::memory_order_relaxed);
+            }
+            for (size_t i = 0; i < StatsSnapshot::NUM_TIMERS; i++) {
+                reg.retired_timers[i].merge(stats.timers[i]);
+            }
+            std::erase(reg.threads, &stats);
+            t_local = &reg.exited;
+        }
+    };
+    thread_local Guard guard;
+    return &guard.stats;
+}
+
+StatsSnapshot Stats::snapshot() {
+    StatsSnapshot snap;
+    Registry &reg = registry();
+    std::lock_guard<std::mutex> lock(reg.lock);
+    sum_counters(reg, snap.counters);
+    for (size_t i = 0; i < StatsSnapshot::NUM_COUNTERS; i++) {
+        snap.counters[i] -= reg.base[i];
+    }
+    for (size_t i = 0; i < StatsSnapshot::NUM_TIMERS; i++) {
+        snap.timers[i] = reg.retired_timers[i];
+    }
+    for (ThreadStats *ts : reg.threads) {
+        std::lock_guard<std::mutex> ts_lock(ts->lock);
+        for (size_t i = 0; i < StatsSnapshot::NUM_TIMERS; i++) {
+            snap.timers[i].merge(ts->timers[i]);
+        }
+    }
+    return snap;
+}
+
+void Stats::reset() {
+    Registry &reg = registry();
+    std::lock_guard<std::mutex> lock(reg.lock);
+    sum_counters(reg, reg.base);
+    for (size_t i = 0; i < StatsSnapshot::NUM_TIMERS; i++) {
+        reg.retired_timers[i].reset();
+    }
+    for (ThreadStats *ts : reg.threads) {
+        std::lock_guard<std::mutex> ts_lock(ts->lock);
+        for (size_t i = 0; i < StatsSnapshot::NUM_TIMERS; i++) {
+            ts->timers[i].reset();
+        }
+    }
+}
+#else
+StatsSnapshot Stats::snapshot() { return StatsSnapshot(); }
+
+void Stats::reset() {}
+#endif
+
+double StatsSnapshot::tlb_hit_rate() const {
+    const uint64_t lookups = (*this)[StatCounter::TLB_HIT] + (*this)[StatCounter::TLB_MISS];
+    return lookups ? static_cast<double>((*this)[StatCounter::TLB_HIT]) / lookups : 0;
+}
+
+const char *StatsSnapshot::name(StatCounter c) {
+    static const char *const names[] = {
+        "tlb_hit",    "tlb_miss",   "page_walk",   "pte_read",   "pte_write",   "page_fault",
+        "mmap_probe", "page_alloc", "buddy_alloc", "buddy_free", "buddy_split", "buddy_merge",
+        "pmem_read",  "pmem_read_bytes", "pmem_write", "pmem_write_bytes", "pmem_cas",
+    };
+    static_assert(std::size(names) == NUM_COUNTERS);
+    return names[static_cast<size_t>(c)];
+}
+
+const char *StatsSnapshot::name(StatTimer t) {
+    static const char *const names[] = {"page_walk", "mmap", "munmap", "page_alloc"};
+    static_assert(std::size(names) == NUM_TIMERS);
+    return names[static_cast<size_t>(t)];
+}
+
+std::string StatsSnapshot::to_text() const {
+    std::string text;
+    for (size_t i = 0; i < NUM_COUNTERS; i++) {
+        text += fmt::format("{:<18}{}\n", name(static_cast<StatCounter>(i)), counters[i]);
+    }
+    text += fmt::format("{:<18}{:.4f}\n", "tlb_hit_rate", tlb_hit_rate());
+    for (size_t i = 0; i < NUM_TIMERS; i++) {
+        const LogHistogram &h = timers[i];
+        text += fmt::format(
+            "{:<18}count={} mean={:.1f}ns p50={}ns p90={}ns p99={}ns p999={}ns max={}ns\n",
+            fmt::format("{}_latency", name(static_cast<StatTimer>(i))), h.count(), h.mean(),
+            h.percentile(50), h.percentile(90), h.percentile(99), h.percentile(99.9), h.max()
+        );
+    }
+    return text;
+}
+
+std::string StatsSnapshot::to_json() const {
+    std::string json = fmt::format("{{\"enabled\": {}, \"counters\": {{", Stats::ENABLED);
+    for (size_t i = 0; i < NUM_COUNTERS; i++) {
+        json += fmt::format(
+            "{}\"{}\": {}", i ? ", " : "", name(static_cast<StatCounter>(i)), counters[i]
+        );
+    }
+    json += fmt::format("}}, \"tlb_hit_rate\": {:.4f}, \"latency_ns\": {{", tlb_hit_rate());
+    for (size_t i = 0; i < NUM_TIMERS; i++) {
+        json += fmt::format(
+            "{}\"{}\": {}", i ? ", " : "", name(static_cast<StatTimer>(i)), timers[i].to_json()
+        );
+    }
+    return json + "}}";
+}
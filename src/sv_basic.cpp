@@ -1,19 +1,23 @@
 #include "sv_basic.hpp"
 
 #include "physical_mem.hpp"
+#include "stats.hpp"
+#include <algorithm>
 #include <cassert>
 #include <spdlog/spdlog.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
-template <typename Trait>
-SV_basic<Trait>::SV_basic(
-    std::shared_ptr<PhysicalMemoryInterface> pmem, std::shared_ptr<spdlog::logger> logger_
+template <typename Trait, typename PMEM>
+SV_basic<Trait, PMEM>::SV_basic(
+    std::shared_ptr<PMEM> pmem, std::shared_ptr<spdlog::logger> logger_
 )
     : pmem(pmem) {
     this->logger = logger_ ? logger_ : spdlog::default_logger();
 }
 
-template <typename Trait>
-uint64_t SV_basic<Trait>::bits_extract(uint64_t data, std::pair<uint8_t, uint8_t> range) {
+template <typename Trait, typename PMEM>
+uint64_t SV_basic<Trait, PMEM>::bits_extract(uint64_t data, std::pair<uint8_t, uint8_t> range) {
     assert(range.first >= range.second);
     assert(range.first < 64);
     assert(range.second < 64);
@@ -22,8 +26,8 @@ uint64_t SV_basic<Trait>::bits_extract(uint64_t data, std::pair<uint8_t, uint8_t
     return (data >> range.second) & mask;
 }
 
-template <typename Trait>
-uint64_t SV_basic<Trait>::bits_set(
+template <typename Trait, typename PMEM>
+uint64_t SV_basic<Trait, PMEM>::bits_set(
     uint64_t value, std::pair<uint8_t, uint8_t> range, uint64_t data
 ) {
     assert(range.first >= range.second);
@@ -35,18 +39,98 @@ uint64_t SV_basic<Trait>::bits_set(
     return (data & ~(mask << range.second)) | ((value & mask) << range.second);
 }
 
-template <typename Trait>
-typename SV_basic<Trait>::paddr_t SV_basic<Trait>::translate(
+template <typename Trait, typename PMEM>
+typename SV_basic<Trait, PMEM>::paddr_t SV_basic<Trait, PMEM>::translate(
     const paddr_t ptroot, const vaddr_t vaddr
+) const {
+    return translate_nofault(ptroot, vaddr, Access::READ);
+}
+
+template <typename Trait, typename PMEM>
+typename SV_basic<Trait, PMEM>::paddr_t SV_basic<Trait, PMEM>::translate(
+    const paddr_t ptroot, const vaddr_t vaddr, const Access access
+) const {
+    paddr_t paddr = translate_nofault(ptroot, vaddr, access);
+    if (paddr == 0 && fault_handler) {
+        Stats::add(StatCounter::PAGE_FAULT);
+        if (fault_handler(ptroot, vaddr, access) == 0) {
+            // 缺页处理可能修改了该页的映射或权限
+            tlb.flush(ptroot, vaddr / PAGESIZE);
+            paddr = translate_nofault(ptroot, vaddr, access);
+        }
+    }
+    return paddr;
+}
+
+template <typename Trait, typename PMEM>
+typename SV_basic<Trait, PMEM>::paddr_t SV_basic<Trait, PMEM>::translate_nofault(
+    const paddr_t ptroot, const vaddr_t vaddr, const Access access
 ) const {
     assert(ptroot % PAGESIZE == 0);
+    using PTE = typename BITRANGE::PTE;
+    const bool write = (access == Access::WRITE);
+    SV_TLB::addr_t ppn;
+    if (tlb.lookup(ptroot, vaddr / PAGESIZE, ppn, write)) {
+        return ppn * PAGESIZE + vaddr % PAGESIZE;
+    }
+    int level;
+    paddr_t pte_addr;
+    pte_t pte;
+    paddr_t paddr = walk_access(ptroot, vaddr, access, level, pte_addr, pte);
+    if (paddr == 0) {
+        return 0;
+    }
+    tlb.insert(ptroot, vaddr / PAGESIZE, paddr / PAGESIZE, tlb_writable(pte));
+    return (write && !bits_extract(pte, PTE::W)) ? 0 : paddr;
+}
+
+template <typename Trait, typename PMEM>
+typename SV_basic<Trait, PMEM>::paddr_t SV_basic<Trait, PMEM>::walk_access(
+    const paddr_t ptroot, const vaddr_t vaddr, const Access access, int &level,
+    paddr_t &pte_addr, pte_t &pte
+) const {
+    Stats::Timer timer(StatTimer::PAGE_WALK, 6);
+    while (true) {
+        paddr_t paddr = walk(ptroot, vaddr, level, pte_addr, pte);
+        if (paddr == 0 || update_ad(pte_addr, pte, access) == 0) {
+            return paddr;
+        }
+    }
+}
+
+template <typename Trait, typename PMEM>
+int SV_basic<Trait, PMEM>::update_ad(
+    const paddr_t pte_addr, pte_t &pte, const Access access
+) const {
+    using PTE = typename BITRANGE::PTE;
+    pte_t want = bits_set(1, PTE::A, pte);
+    if (access == Access::WRITE && bits_extract(pte, PTE::W)) {
+        want = bits_set(1, PTE::D, want);
+    }
+    if (want == pte) {
+        return 0; // 常见情况：A/D位已经置位，无需写回
+    }
+    uint64_t expected = pte;
+    Stats::add(StatCounter::PTE_WRITE);
+    if (pmem->compare_exchange(pte_addr, expected, want, sizeof(pte_t))) {
+        return -1;
+    }
+    pte = want;
+    return 0;
+}
+
+template <typename Trait, typename PMEM>
+typename SV_basic<Trait, PMEM>::paddr_t SV_basic<Trait, PMEM>::walk(
+    const paddr_t ptroot, const vaddr_t vaddr, int &level, paddr_t &pte_addr, pte_t &pte
+) const {
     using PTE = typename BITRANGE::PTE;
     using VA = typename BITRANGE::VA;
     using PA = typename BITRANGE::PA;
     paddr_t ptaddr = ptroot; // the selected-level pagetable base addr
-    for (int level = LEVELS - 1; level >= 0; level--) {
-        paddr_t pte_addr = ptaddr + bits_extract(vaddr, VA::VPN[level]) * sizeof(pte_t);
-        pte_t pte;
+    Stats::add(StatCounter::PAGE_WALK);
+    for (level = LEVELS - 1; level >= 0; level--) {
+        pte_addr = ptaddr + bits_extract(vaddr, VA::VPN[level]) * sizeof(pte_t);
+        Stats::add(StatCounter::PTE_READ);
         if (pmem->read(pte_addr, &pte, sizeof(pte_t))) {
             SPDLOG_LOGGER_ERROR(
                 logger, "SV failed to get PTE from PMEM 0x{:x}, ptroot=0x{:x}, vaddr=0x{:x}",
@@ -72,16 +156,16 @@ typename SV_basic<Trait>::paddr_t SV_basic<Trait>::translate(
         if (bits_extract(pte, PTE::R) || bits_extract(pte, PTE::X)) {
             // Leaf PTE found
             // TODO: need to check accessibility (PTE.R/W/X/U bits)
-            // TODO: need to deal with PTE.A/D
+            // PTE.A/D由walk_access按访问类型设置
             paddr_t paddr = bits_set(bits_extract(vaddr, VA::PAGEOFFSET), PA::PAGEOFFSET, 0ull);
             for (int i = 0; i < level; i++) { // for super-page (level != 0)
                 // lower-level PTE.PPN should be 0
-                if (bits_extract(pte, PTE::PPN[level]) != 0ull) {
+                if (bits_extract(pte, PTE::PPN[i]) != 0ull) {
                     SPDLOG_LOGGER_ERROR(
                         logger,
                         "SV PTE error: superpage PTE.PPN[{}]!=0 PAGE-FAULT, "
                         "ptroot=0x{:x}, vaddr=0x{:x}",
-                        level, ptroot, vaddr
+                        i, ptroot, vaddr
                     );
                 }
                 // lower-level PA.PPN[i] = VA.VPN[i]
@@ -109,65 +193,274 @@ typename SV_basic<Trait>::paddr_t SV_basic<Trait>::translate(
     }
     // should always return in the loop
     assert(false);
-    return -1;
+    return 0;
 }
 
-template <typename Trait>
-typename SV_basic<Trait>::vaddr_t SV_basic<Trait>::memcpy(
+template <typename Trait, typename PMEM>
+template <typename F>
+size_t SV_basic<Trait, PMEM>::for_each_run(
+    const pagetable_t ptroot, const vaddr_t vaddr, const size_t size, const Access access,
+    F &&emit
+) const {
+    assert(ptroot % PAGESIZE == 0);
+    const bool write = (access == Access::WRITE);
+    using PTE = typename BITRANGE::PTE;
+    using VA = typename BITRANGE::VA;
+    using PA = typename BITRANGE::PA;
+    constexpr size_t PTES_PER_TABLE = PAGESIZE / sizeof(pte_t);
+    TranslatedRun run{vaddr, 0, 0}; // 尚未交给emit的区间
+    // 追加一段[cur, cur + len) -> paddr，物理上接续时并入run，否则先提交run
+    auto append = [&](vaddr_t cur, paddr_t paddr, size_t len) {
+        if (run.len != 0 && run.paddr + run.len == paddr) {
+            run.len += len;
+            return 0;
+        }
+        if (run.len != 0 && emit(run.vaddr, run.paddr, run.len)) {
+            return -1; // run保持为出错的区间
+        }
+        run = {cur, paddr, len};
+        return 0;
+    };
+    size_t done = 0;
+    while (done < size) {
+        const vaddr_t cur = vaddr + done;
+        const size_t remaining = size - done;
+        const size_t page_offset = cur % PAGESIZE;
+        SV_TLB::addr_t ppn;
+        if (tlb.lookup(ptroot, cur / PAGESIZE, ppn, write)) {
+            const size_t len = std::min(remaining, PAGESIZE - page_offset);
+            if (append(cur, ppn * PAGESIZE + page_offset, len)) return run.vaddr - vaddr;
+            done += len;
+            continue;
+        }
+        int level;
+        paddr_t pte_addr;
+        pte_t leaf;
+        const paddr_t paddr = walk_access(ptroot, cur, access, level, pte_addr, leaf);
+        if (paddr == 0) break;
+        tlb.insert(ptroot, cur / PAGESIZE, paddr / PAGESIZE, tlb_writable(leaf));
+        if (write && bits_extract(leaf, PTE::W) == 0) break; // 只读页（如写时复制）
+        // 叶子PTE覆盖的范围：大页为整个大页，普通页为一页
+        const uint64_t leaf_size = 1ull << VA::VPN[level].second;
+        size_t len = std::min<uint64_t>(remaining, leaf_size - cur % leaf_size);
+        if (append(cur, paddr, len)) return run.vaddr - vaddr;
+        done += len;
+        if (level != 0 || done >= size) continue;
+        // 同一末级页表中后续的PTE一次读出，不再逐页下降
+        const size_t idx = bits_extract(cur, VA::VPN[0]);
+        const size_t more = std::min<size_t>(
+            PTES_PER_TABLE - idx - 1, (size - done + PAGESIZE - 1) / PAGESIZE
+        );
+        if (more == 0) continue;
+        pte_t ptes[PTES_PER_TABLE];
+        if (pmem->read(pte_addr + sizeof(pte_t), ptes, more * sizeof(pte_t))) {
+            continue; // 交由下一轮逐页查找报告错误
+        }
+        Stats::add(StatCounter::PTE_READ, more);
+        for (size_t i = 0; i < more; i++) {
+            pte_t pte = ptes[i];
+            // 只处理合法的叶子PTE，其余情况交由下一轮的walk处理
+            if (bits_extract(pte, PTE::V) == 0 || bits_extract(pte, PTE::R) == 0) break;
+            if (write && bits_extract(pte, PTE::W) == 0) break;
+            if (update_ad(pte_addr + (i + 1) * sizeof(pte_t), pte, access)) break;
+            const paddr_t page = bits_set(bits_extract(pte, PTE::PPNFULL), PA::PPNFULL);
+            len = std::min(size - done, PAGESIZE);
+            if (append(vaddr + done, page, len)) return run.vaddr - vaddr;
+            done += len;
+        }
+    }
+    if (run.len != 0 && emit(run.vaddr, run.paddr, run.len)) {
+        return run.vaddr - vaddr;
+    }
+    return done;
+}
+
+template <typename Trait, typename PMEM>
+template <typename F>
+size_t SV_basic<Trait, PMEM>::access_runs(
+    const pagetable_t ptroot, const vaddr_t vaddr, const size_t size, const Access access,
+    F &&emit
+) const {
+    bool aborted = false;
+    auto checked_emit = [&](vaddr_t v, paddr_t p, size_t len) {
+        int ret = emit(v, p, len);
+        aborted = aborted || ret != 0;
+        return ret;
+    };
+    // 翻译在未映射（或写只读）的页处停下时，交给缺页处理函数处理后从该页继续
+    // 若处理后同一位置仍无法翻译则放弃，避免死循环
+    size_t done = 0, faulted = SIZE_MAX;
+    while (true) {
+        done += for_each_run(ptroot, vaddr + done, size - done, access, checked_emit);
+        if (done == size || aborted || done == faulted || !fault_handler) {
+            break;
+        }
+        Stats::add(StatCounter::PAGE_FAULT);
+        if (fault_handler(ptroot, vaddr + done, access)) {
+            break;
+        }
+        tlb.flush(ptroot, (vaddr + done) / PAGESIZE);
+        faulted = done;
+    }
+    return done;
+}
+
+template <typename Trait, typename PMEM>
+int SV_basic<Trait, PMEM>::translate_range(
+    const pagetable_t ptroot, const vaddr_t vaddr, const size_t size,
+    std::vector<TranslatedRun> &runs
+) const {
+    runs.clear();
+    auto emit = [&](vaddr_t v, paddr_t p, size_t len) {
+        runs.push_back({v, p, len});
+        return 0;
+    };
+    size_t done = for_each_run(ptroot, vaddr, size, Access::READ, emit);
+    return (done == size) ? 0 : -1;
+}
+
+template <typename Trait, typename PMEM>
+typename SV_basic<Trait, PMEM>::vaddr_t SV_basic<Trait, PMEM>::memcpy(
     pagetable_t pagetable_root, vaddr_t dst, const void *src_, size_t size
 ) const {
     const uint8_t *src = static_cast<const uint8_t *>(src_);
-    size_t offset = 0;
-    while (offset < size) {
-        vaddr_t cur_vaddr = dst + offset;
-        size_t page_offset = cur_vaddr % PAGESIZE;
-        size_t chunk = std::min(size - offset, static_cast<size_t>(PAGESIZE - page_offset));
-        paddr_t cur_paddr = translate(pagetable_root, cur_vaddr);
-        if (cur_paddr == 0) {
+    // 翻译得到的各段攒够一批后一次交给PMEM
+    typename PhysicalMemoryInterface::IOVec segs[IOV_BATCH];
+    size_t nsegs = 0;
+    bool pmem_failed = false;
+    auto flush = [&]() {
+        if (nsegs != 0 && pmem->writev(segs, nsegs)) {
             SPDLOG_LOGGER_ERROR(
-                logger, "SV memcpy(write): failed to translate vaddr=0x{:x}, ptroot=0x{:x}",
-                cur_vaddr, pagetable_root
+                logger, "SV memcpy(write): failed to write physical memory at 0x{:x}",
+                segs[0].addr
             );
-            return 0;
+            pmem_failed = true;
+            return -1;
         }
-        if (pmem->write(cur_paddr, src + offset, chunk)) {
+        nsegs = 0;
+        return 0;
+    };
+    auto emit = [&](vaddr_t v, paddr_t p, size_t len) {
+        segs[nsegs++] = {p, const_cast<uint8_t *>(src + (v - dst)), len};
+        return (nsegs == IOV_BATCH) ? flush() : 0;
+    };
+    size_t done = access_runs(pagetable_root, dst, size, Access::WRITE, emit);
+    if (!pmem_failed) flush();
+    if (done != size || pmem_failed) {
+        if (!pmem_failed) {
             SPDLOG_LOGGER_ERROR(
-                logger, "SV memcpy(write): failed to write physical memory at 0x{:x}", cur_paddr
+                logger, "SV memcpy(write): failed to translate vaddr=0x{:x}, ptroot=0x{:x}",
+                dst + done, pagetable_root
             );
-            return 0;
         }
-        offset += chunk;
+        return 0;
     }
     return dst;
 }
 
-template <typename Trait>
-void *SV_basic<Trait>::memcpy(pagetable_t ptroot, void *dst_, vaddr_t src, size_t size) const {
+template <typename Trait, typename PMEM>
+void *SV_basic<Trait, PMEM>::memcpy(
+    pagetable_t ptroot, void *dst_, vaddr_t src, size_t size
+) const {
     uint8_t *dst = static_cast<uint8_t *>(dst_);
-    size_t offset = 0;
-    while (offset < size) {
-        vaddr_t cur_vaddr = src + offset;
-        size_t page_offset = cur_vaddr % PAGESIZE;
-        size_t chunk = std::min(size - offset, static_cast<size_t>(PAGESIZE - page_offset));
-        paddr_t cur_paddr = translate(ptroot, cur_vaddr);
-        if (cur_paddr == 0) {
+    typename PhysicalMemoryInterface::IOVec segs[IOV_BATCH];
+    size_t nsegs = 0;
+    bool pmem_failed = false;
+    auto flush = [&]() {
+        if (nsegs != 0 && pmem->readv(segs, nsegs)) {
             SPDLOG_LOGGER_ERROR(
-                logger, "SV memcpy(read): failed to translate vaddr=0x{:x}, ptroot=0x{:x}",
-                cur_vaddr, ptroot
+                logger, "SV memcpy(read): failed to read PMEM 0x{:x}", segs[0].addr
             );
-            return nullptr;
+            pmem_failed = true;
+            return -1;
         }
-        if (pmem->read(cur_paddr, dst + offset, chunk)) {
-            SPDLOG_LOGGER_ERROR(logger, "SV memcpy(read): failed to read PMEM 0x{:x}", cur_paddr);
-            return nullptr;
+        nsegs = 0;
+        return 0;
+    };
+    auto emit = [&](vaddr_t v, paddr_t p, size_t len) {
+        segs[nsegs++] = {p, dst + (v - src), len};
+        return (nsegs == IOV_BATCH) ? flush() : 0;
+    };
+    size_t done = access_runs(ptroot, src, size, Access::READ, emit);
+    if (!pmem_failed) flush();
+    if (done != size || pmem_failed) {
+        if (!pmem_failed) {
+            SPDLOG_LOGGER_ERROR(
+                logger, "SV memcpy(read): failed to translate vaddr=0x{:x}, ptroot=0x{:x}",
+                src + done, ptroot
+            );
         }
-        offset += chunk;
+        return nullptr;
     }
     return dst_;
 }
 
+template <typename Trait, typename PMEM>
+void *SV_basic<Trait, PMEM>::map_host(
+    const pagetable_t ptroot, const vaddr_t vaddr, const size_t size, const Access access
+) const {
+    const int fd = pmem->host_fd();
+    if (fd < 0 || size == 0 || sysconf(_SC_PAGESIZE) != PAGESIZE) {
+        SPDLOG_LOGGER_ERROR(logger, "SV map_host: PMEM cannot be mapped to host");
+        return nullptr;
+    }
+    const size_t offset = vaddr % PAGESIZE;
+    const size_t npages = (offset + size + PAGESIZE - 1) / PAGESIZE;
+    // 先保留一段连续的主机地址空间，再把每段物理连续的页用MAP_FIXED覆盖上去
+    void *region = ::mmap(
+        nullptr, npages * PAGESIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0
+    );
+    if (region == MAP_FAILED) {
+        SPDLOG_LOGGER_ERROR(logger, "SV map_host: failed to reserve {} host pages", npages);
+        return nullptr;
+    }
+    uint8_t *base = static_cast<uint8_t *>(region);
+    const vaddr_t vbase = vaddr - offset;
+    const int prot = (access == Access::WRITE) ? (PROT_READ | PROT_WRITE) : PROT_READ;
+    auto map_run = [&](vaddr_t v, paddr_t p, size_t len) {
+        // 除首尾外各段都在页边界上断开，首尾向外扩展到整页
+        const size_t skip = v % PAGESIZE;
+        const size_t bytes = (skip + len + PAGESIZE - 1) / PAGESIZE * PAGESIZE;
+        void *mapped = ::mmap(
+            base + (v - skip - vbase), bytes, prot, MAP_SHARED | MAP_FIXED, fd,
+            static_cast<off_t>(p - skip)
+        );
+        if (mapped == MAP_FAILED) {
+            SPDLOG_LOGGER_ERROR(
+                logger, "SV map_host: failed to map PMEM 0x{:x} +: {} to host", p - skip, bytes
+            );
+            return -1;
+        }
+        return 0;
+    };
+    // 按视图的访问方式翻译：可写视图中写时复制的页会先被复制，只读视图则保持共享
+    size_t done = access_runs(ptroot, vaddr, size, access, map_run);
+    if (done != size) {
+        SPDLOG_LOGGER_ERROR(
+            logger, "SV map_host: failed to map vaddr=0x{:x}, ptroot=0x{:x}", vaddr + done, ptroot
+        );
+        ::munmap(region, npages * PAGESIZE);
+        return nullptr;
+    }
+    return base + offset;
+}
+
+template <typename Trait, typename PMEM>
+int SV_basic<Trait, PMEM>::unmap_host(void *view, const size_t size) const {
+    const uintptr_t addr = reinterpret_cast<uintptr_t>(view);
+    const size_t offset = addr % PAGESIZE;
+    const size_t npages = (offset + size + PAGESIZE - 1) / PAGESIZE;
+    if (view == nullptr || ::munmap(reinterpret_cast<void *>(addr - offset), npages * PAGESIZE)) {
+        SPDLOG_LOGGER_ERROR(logger, "SV unmap_host: failed to unmap host view {}", view);
+        return -1;
+    }
+    return 0;
+}
+
 #include "sv32.hpp"
 template class SV_basic<SV32_Trait>;
+template class SV_basic<SV32_Trait, PhysicalMemoryBasicSim>;
 
 #include "sv39.hpp"
 template class SV_basic<SV39_Trait>;
+template class SV_basic<SV39_Trait, PhysicalMemoryBasicSim>;
@@ -1,45 +1,155 @@
 #include "sv_supervisor.hpp"
 #include "physical_mem.hpp"
+#include "stats.hpp"
 #include <algorithm>
+#include <bit>
 #include <cassert>
+#include <cstring>
+#include <iterator>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <utility>
 #include <vector>
 
-template <typename Trait>
-SV_supervisor<Trait>::SV_supervisor(
-    std::shared_ptr<PhysicalMemoryInterface> pmem_, std::shared_ptr<spdlog::logger> logger_
+namespace {
+
+// 快照格式：SnapshotHeader之后依次是各个数组（均为主机字节序的uint64_t），
+// 然后以0补齐到data_offset（相对快照起点按页对齐），其后是所有在用的物理页，按物理地址递增排列
+constexpr char SNAPSHOT_MAGIC[8] = {'M', 'B', 'O', 'X', 'S', 'N', 'A', 'P'};
+constexpr uint32_t SNAPSHOT_VERSION = 1;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t levels;
+    uint64_t pagesize;
+    uint64_t pmem_size;
+    uint64_t vpage_usage;
+    uint64_t next_shm;
+    uint64_t data_offset; // 物理页数据相对快照起点的偏移
+    uint64_t n_free;      // 空闲块：(页号 << 8) | 阶
+    uint64_t n_refs;      // 共享计数非0的页：(页号 << 32) | 计数
+    uint64_t n_pt_valid;  // 有效PTE数非0的页表页：(页号 << 32) | 数量
+    uint64_t n_roots;     // 每个地址空间：根页表地址、VMA数，随后每个VMA为(start, end, lazy)
+    uint64_t n_shms;      // 每个共享内存段：标识、页数，随后为各页的物理地址
+    uint64_t n_runs;      // 在用物理页的连续区间：(起始页号, 页数)
+};
+
+// 带缓冲的顺序写入，出错后忽略之后的写入
+class SnapshotWriter {
+public:
+    explicit SnapshotWriter(int fd) : m_fd(fd) {}
+    void put(const void *data, size_t size) {
+        const uint8_t *p = static_cast<const uint8_t *>(data);
+        m_buf.insert(m_buf.end(), p, p + size);
+        if (m_buf.size() >= BUF_SIZE) flush();
+    }
+    void put_u64(uint64_t value) { put(&value, sizeof(value)); }
+    void put_vec(const std::vector<uint64_t> &values) {
+        put(values.data(), values.size() * sizeof(uint64_t));
+    }
+    void pad_to(uint64_t offset) { m_buf.resize(m_buf.size() + (offset - pos()), 0); }
+    bool flush() {
+        if (m_ok && !m_buf.empty()) {
+            m_ok = PhysicalMemoryInterface::write_fd(m_fd, m_buf.data(), m_buf.size()) == 0;
+        }
+        m_flushed += m_buf.size();
+        m_buf.clear();
+        return m_ok;
+    }
+    uint64_t pos() const { return m_flushed + m_buf.size(); }
+
+private:
+    static constexpr size_t BUF_SIZE = 1 << 20;
+    int m_fd;
+    bool m_ok = true;
+    uint64_t m_flushed = 0;
+    std::vector<uint8_t> m_buf;
+};
+
+// 从文件的指定位置起顺序读取
+class SnapshotReader {
+public:
+    SnapshotReader(int fd, uint64_t pos) : m_fd(fd), m_pos(pos) {}
+    bool get(void *data, size_t size) {
+        uint8_t *p = static_cast<uint8_t *>(data);
+        while (size > 0) {
+            const ssize_t n = pread(m_fd, p, size, static_cast<off_t>(m_pos));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+            size -= n;
+            m_pos += n;
+        }
+        return true;
+    }
+    bool get_u64(uint64_t &value) { return get(&value, sizeof(value)); }
+    bool get_vec(std::vector<uint64_t> &values, uint64_t count) {
+        values.resize(count);
+        return get(values.data(), count * sizeof(uint64_t));
+    }
+
+private:
+    int m_fd;
+    uint64_t m_pos;
+};
+
+} // namespace
+
+template <typename Trait, typename PMEM>
+SV_supervisor<Trait, PMEM>::SV_supervisor(
+    std::shared_ptr<PMEM> pmem_, std::shared_ptr<spdlog::logger> logger_
 )
-    : SV_basic<Trait>(pmem_, logger_), buddy(pmem_->m_size / PAGESIZE, 11) {}
+    : SV_basic<Trait, PMEM>(pmem_, logger_),
+      buddy(pmem_->m_size / PAGESIZE, buddy_max_order(pmem_->m_size / PAGESIZE)),
+      m_page_refs(std::make_unique<std::atomic<uint32_t>[]>(pmem_->m_size / PAGESIZE)),
+      m_pt_valid(pmem_->m_size / PAGESIZE, 0) {
+    this->set_fault_handler(fault_handler());
+}
 
-template <typename Trait>
-typename SV_supervisor<Trait>::pagetable_t SV_supervisor<Trait>::create_pagetable() {
-    paddr_t ptroot = buddy.allocate(0);
+template <typename Trait, typename PMEM>
+uint8_t SV_supervisor<Trait, PMEM>::buddy_max_order(uint64_t total_pages) {
+    // 至少要能分配出最大的大页；总页数不必是最大块的整数倍，但最大块不超过总页数
+    uint8_t max_order = std::max<uint8_t>(11, level_order(LEVELS - 1));
+    while (max_order > 0 && (1ull << max_order) > total_pages) {
+        max_order--;
+    }
+    return max_order;
+}
+
+template <typename Trait, typename PMEM>
+typename SV_supervisor<Trait, PMEM>::pagetable_t SV_supervisor<Trait, PMEM>::create_pagetable() {
+    // 根页表登记到m_ptroots之前已经分配，期间不能保存快照
+    std::shared_lock<std::shared_mutex> op_lock(m_op_lock);
+    paddr_t ptroot = palloc(0);
     if (ptroot == 0) {
         SPDLOG_LOGGER_ERROR(logger, "SV failed to allocate memory for new pagetable root");
         return 0;
     }
     assert(ptroot % PAGESIZE == 0);
-    assert(std::all_of(m_ptroots.begin(), m_ptroots.end(), [ptroot](auto &existing_ptroot) {
-        return existing_ptroot != ptroot;
-    }));
-    m_ptroots.push_back(ptroot);
     if (pmem->fill(ptroot, 0, PAGESIZE)) {
         SPDLOG_LOGGER_ERROR(
             logger, "SV failed to reset newly allocated pagetable to 0 at PMEM 0x{:x}", ptroot
         );
         assert(0);
-        buddy.free(ptroot, 0);
+        pfree(ptroot, 0);
         return 0;
     }
+    pt_valid(ptroot) = 0;
+    rmap_set(ptroot, RMAP_TABLE, ptroot, 0, LEVELS - 1);
+    std::unique_lock<std::shared_mutex> lock(m_ptroots_lock);
+    assert(m_ptroots.count(ptroot) == 0);
+    m_ptroots.try_emplace(ptroot);
     return ptroot;
 }
 
-template <typename Trait>
-int SV_supervisor<Trait>::destroy_pagetable_one_level(const pagetable_t ptaddr, int level) {
+template <typename Trait, typename PMEM>
+int SV_supervisor<Trait, PMEM>::destroy_pagetable_one_level(const pagetable_t ptaddr, int level) {
     assert(ptaddr % PAGESIZE == 0);
     using PTE = typename BITRANGE::PTE;
     // using VA = typename BITRANGE::VA;
     using PA = typename BITRANGE::PA;
+    [[maybe_unused]] size_t valid = 0;
     for (paddr_t pte_addr = ptaddr; pte_addr < ptaddr + PAGESIZE; pte_addr += sizeof(pte_t)) {
         pte_t pte;
         if (pmem->read(pte_addr, &pte, sizeof(pte_t))) {
@@ -50,18 +160,11 @@ int SV_supervisor<Trait>::destroy_pagetable_one_level(const pagetable_t ptaddr,
         if (bits_extract(pte, PTE::V) == 0) {
             continue; // non-valid pte, no need to free
         }
+        valid++;
         if (bits_extract(pte, PTE::XWR)) { // leaf PTE
-            if (level != 0) {
-                SPDLOG_LOGGER_ERROR(
-                    logger, "SV internal page-free error: large page not supported yet"
-                );
-                assert(0);
-                return -1;
-            }
+            // level != 0 时为大页，释放整个大页对应的物理块（仍被共享时只减少引用）
             paddr_t paddr = bits_set(bits_extract(pte, PTE::PPNFULL), PA::PPNFULL);
-            buddy.free(paddr, 0);
-            assert(m_vpage_usage > 0);
-            m_vpage_usage--;
+            put_page(paddr, level_order(level));
         } else { // pointer to next level pagetable
             if (level == 0) {
                 SPDLOG_LOGGER_ERROR(
@@ -79,239 +182,553 @@ int SV_supervisor<Trait>::destroy_pagetable_one_level(const pagetable_t ptaddr,
             }
         }
     }
+    assert(valid == pt_valid(ptaddr));
+    pt_valid(ptaddr) = 0;
     // 释放本级页表占用的物理页
-    buddy.free(ptaddr, 0);
+    pfree(ptaddr, 0);
     return 0;
 }
 
-template <typename Trait> int SV_supervisor<Trait>::destroy_pagetable(pagetable_t ptroot) {
+template <typename Trait, typename PMEM>
+int SV_supervisor<Trait, PMEM>::destroy_pagetable(pagetable_t ptroot) {
+    std::shared_lock<std::shared_mutex> op_lock(m_op_lock);
+    // 独占锁保证没有其他线程正在访问该地址空间，摘下后即可在锁外销毁
+    std::unique_lock<std::shared_mutex> lock(m_ptroots_lock);
     assert_ptroot(ptroot);
+    auto node = m_ptroots.extract(ptroot);
+    lock.unlock();
     int result = destroy_pagetable_one_level(ptroot, LEVELS - 1);
-    if (result == 0) {
-        m_ptroots.erase(std::remove(m_ptroots.begin(), m_ptroots.end(), ptroot), m_ptroots.end());
+    this->sfence_vma(ptroot);
+    if (result != 0) {
+        lock.lock();
+        m_ptroots.insert(std::move(node));
+        return result;
+    }
+    for (const auto &[start, vma] : node.mapped().vmas) {
+        m_vpage_usage -= (vma.end - start) / PAGESIZE;
     }
     return result;
 }
 
-template <typename Trait>
-typename SV_supervisor<Trait>::vaddr_t SV_supervisor<Trait>::mmap(
-    const pagetable_t ptroot, vaddr_t vaddr, const size_t size
+template <typename Trait, typename PMEM>
+typename SV_supervisor<Trait, PMEM>::vaddr_t SV_supervisor<Trait, PMEM>::mmap(
+    const pagetable_t ptroot, vaddr_t vaddr, const size_t size, const bool lazy
 ) {
+    Stats::Timer timer(StatTimer::MMAP);
     if (size == 0) {
         SPDLOG_LOGGER_WARN(logger, "SV mmap called with size 0");
         return 0;
     }
+    std::shared_lock<std::shared_mutex> ptroots_lock(m_ptroots_lock);
     assert_ptroot(ptroot);
+    AddressSpace &as = m_ptroots.at(ptroot);
+    std::lock_guard<std::mutex> as_lock(as.lock);
     vaddr = vaddr - vaddr % PAGESIZE;
     vaddr = (vaddr == 0) ? 0x91000000 : vaddr;
     const size_t num_page = (size + PAGESIZE - 1) / PAGESIZE;
-    // todo: how to determine we cannot find idle vaddr?
-    //       currently only search idle vaddr for 4096 times, if not found, alloc failed
-    for (int i = 0; i < 4096; i++) {
-        bool idle_vaddr_found = true; // default
-        for (size_t pgcnt = 0; pgcnt < num_page; pgcnt++) {
-            if (translate(ptroot, vaddr + pgcnt * PAGESIZE) != 0) {
-                idle_vaddr_found = false;
-                break;
-            }
-        }
-        if (idle_vaddr_found) {
-            break;
-        }
-        if (i == 4095) {
-            SPDLOG_LOGGER_WARN(
-                logger, "SV mmap failed to find idle vaddr=0x{:x} + 0x{:x}, ptroot=0x{:x}", vaddr,
-                size, ptroot
-            );
-            return 0;
-        }
-        vaddr += PAGESIZE;
+    const uint64_t len = num_page * PAGESIZE;
+    uint64_t start = (len < VA_TOP) ? vma_find_free(as, vaddr, len) : 0;
+    if (start == 0) {
+        SPDLOG_LOGGER_WARN(
+            logger, "SV mmap failed to find idle vaddr=0x{:x} + 0x{:x}, ptroot=0x{:x}", vaddr,
+            size, ptroot
+        );
+        return 0;
     }
-    // idle vaddr found
-    for (size_t pgcnt = 0; pgcnt < num_page; pgcnt++) {
-        if (alloc_one_page(ptroot, vaddr + pgcnt * PAGESIZE)) {
-            SPDLOG_LOGGER_DEBUG(
-                logger, "SV mmap failed to allocate page at vaddr=0x{:x}, rolling back",
-                vaddr + pgcnt * PAGESIZE
-            );
-            // failed to alloc page. rollback needed: free all previous allocated pages
-            for (size_t pgcnt_free = 0; pgcnt_free < pgcnt; pgcnt_free++) {
-                assert(free_one_page(ptroot, vaddr + pgcnt_free * PAGESIZE) == 0);
-            }
-            return 0;
-        }
+    vaddr = start;
+    // idle vaddr found, 按需分配时只登记VMA，物理页在首次访问时由handle_fault分配
+    if (!lazy && map_range(ptroot, vaddr, num_page)) {
+        SPDLOG_LOGGER_DEBUG(
+            logger, "SV mmap failed to allocate vaddr=0x{:x} + 0x{:x}, ptroot=0x{:x}", vaddr, size,
+            ptroot
+        );
+        return 0;
     }
+    vma_insert(as, vaddr, VMA{vaddr + len, lazy});
+    m_vpage_usage += num_page;
     return vaddr;
 }
 
-template <typename Trait>
-int SV_supervisor<Trait>::munmap(const pagetable_t ptroot, vaddr_t vaddr, size_t size) {
-    assert_ptroot(ptroot);
+template <typename Trait, typename PMEM>
+int SV_supervisor<Trait, PMEM>::munmap(const pagetable_t ptroot, vaddr_t vaddr, size_t size) {
     assert(vaddr % PAGESIZE == 0);
+    Stats::Timer timer(StatTimer::MUNMAP);
     if (size == 0) {
         SPDLOG_LOGGER_WARN(logger, "SV munmap called with size 0");
         return -1;
     }
+    std::shared_lock<std::shared_mutex> ptroots_lock(m_ptroots_lock);
+    assert_ptroot(ptroot);
+    AddressSpace &as = m_ptroots.at(ptroot);
+    std::lock_guard<std::mutex> as_lock(as.lock);
     size_t num_page = (size + PAGESIZE - 1) / PAGESIZE;
+    if (!vma_covered(as, vaddr, vaddr + num_page * PAGESIZE)) {
+        SPDLOG_LOGGER_ERROR(
+            logger, "SV munmap range not mapped: vaddr=0x{:x} + 0x{:x}, ptroot=0x{:x}", vaddr, size,
+            ptroot
+        );
+        return -1;
+    }
 
-    for (size_t pgcnt = 0; pgcnt < num_page; pgcnt++) {
-        if (free_one_page(ptroot, vaddr + pgcnt * PAGESIZE)) {
+    // 逐个VMA释放，按需分配的VMA中允许存在尚未分配的页
+    const uint64_t end = vaddr + num_page * PAGESIZE;
+    int result = 0;
+    for (uint64_t pos = vaddr; pos < end;) {
+        auto it = std::prev(as.vmas.upper_bound(pos));
+        const uint64_t seg_end = std::min(it->second.end, end);
+        const size_t seg_pages = (seg_end - pos) / PAGESIZE;
+        result = unmap_range(ptroot, pos, seg_pages, it->second.lazy);
+        if (result) {
             SPDLOG_LOGGER_ERROR(
-                logger, "SV munmap failed to free page at vaddr=0x{:x}, ptroot=0x{:x}",
-                vaddr + pgcnt * PAGESIZE, ptroot
+                logger, "SV munmap failed to free vaddr=0x{:x} + 0x{:x}, ptroot=0x{:x}", pos,
+                seg_end - pos, ptroot
             );
+            break;
+        }
+        vma_remove(as, pos, seg_end);
+        m_vpage_usage -= seg_pages;
+        pos = seg_end;
+    }
+    this->sfence_vma(ptroot, vaddr, size);
+    return result;
+}
+
+template <typename Trait, typename PMEM>
+int SV_supervisor<Trait, PMEM>::handle_fault(
+    const pagetable_t ptroot, const vaddr_t vaddr, const Access access
+) {
+    std::shared_lock<std::shared_mutex> ptroots_lock(m_ptroots_lock);
+    auto as_it = m_ptroots.find(ptroot);
+    if (as_it == m_ptroots.end()) {
+        return -1;
+    }
+    AddressSpace &as = as_it->second;
+    std::lock_guard<std::mutex> as_lock(as.lock);
+    auto it = as.vmas.upper_bound(vaddr);
+    if (it == as.vmas.begin() || std::prev(it)->second.end <= vaddr) {
+        SPDLOG_LOGGER_DEBUG(
+            logger, "SV {} fault outside any VMA: vaddr=0x{:x}, ptroot=0x{:x}",
+            access == Access::WRITE ? "write" : "read", vaddr, ptroot
+        );
+        return -1;
+    }
+    const vaddr_t page = vaddr - vaddr % PAGESIZE;
+    paddr_t pte_addr;
+    pte_t pte;
+    const int level = find_leaf(ptroot, page, pte_addr, pte);
+    if (level >= 0) {
+        if (access == Access::READ || bits_extract(pte, BITRANGE::PTE::W)) {
+            return 0; // 已被其他访问者补上
+        }
+        return is_cow(pte) ? break_cow(ptroot, page, pte_addr, pte, level) : -1;
+    }
+    if (!std::prev(it)->second.lazy) {
+        return -1;
+    }
+    return map_range(ptroot, page, 1);
+}
+
+template <typename Trait, typename PMEM>
+typename SV_supervisor<Trait, PMEM>::pagetable_t SV_supervisor<Trait, PMEM>::clone_pagetable(
+    const pagetable_t src_root
+) {
+    std::shared_lock<std::shared_mutex> op_lock(m_op_lock);
+    paddr_t dst_root = palloc(0);
+    if (dst_root == 0) {
+        SPDLOG_LOGGER_ERROR(logger, "SV failed to allocate memory for cloned pagetable root");
+        return 0;
+    }
+    std::map<vaddr_t, VMA> vmas;
+    int result;
+    {
+        std::shared_lock<std::shared_mutex> ptroots_lock(m_ptroots_lock);
+        assert_ptroot(src_root);
+        AddressSpace &as = m_ptroots.at(src_root);
+        std::lock_guard<std::mutex> as_lock(as.lock);
+        rmap_set(dst_root, RMAP_TABLE, dst_root, 0, LEVELS - 1);
+        result = clone_one_level(src_root, dst_root, LEVELS - 1, dst_root, 0);
+        vmas = as.vmas;
+    }
+    // 原地址空间中可写的叶子已变为只读
+    this->sfence_vma(src_root);
+    if (result) {
+        SPDLOG_LOGGER_ERROR(logger, "SV failed to clone pagetable 0x{:x}", src_root);
+        destroy_pagetable_one_level(dst_root, LEVELS - 1);
+        return 0;
+    }
+    for (const auto &[start, vma] : vmas) {
+        m_vpage_usage += (vma.end - start) / PAGESIZE;
+    }
+    std::unique_lock<std::shared_mutex> lock(m_ptroots_lock);
+    assert(m_ptroots.count(dst_root) == 0);
+    m_ptroots.try_emplace(dst_root).first->second.vmas = std::move(vmas);
+    return dst_root;
+}
+
+template <typename Trait, typename PMEM>
+int SV_supervisor<Trait, PMEM>::collect_dirty(
+    const pagetable_t ptroot, std::vector<VRange> &ranges
+) {
+    ranges.clear();
+    std::shared_lock<std::shared_mutex> ptroots_lock(m_ptroots_lock);
+    assert_ptroot(ptroot);
+    AddressSpace &as = m_ptroots.at(ptroot);
+    std::lock_guard<std::mutex> as_lock(as.lock);
+    int result = collect_dirty_one_level(ptroot, LEVELS - 1, 0, ranges);
+    if (!ranges.empty()) {
+        // 本对象TLB中的写权限随D位一起收回
+        this->sfence_vma(ptroot);
+    }
+    return result;
+}
+
+template <typename Trait, typename PMEM>
+int SV_supervisor<Trait, PMEM>::collect_dirty_one_level(
+    const paddr_t ptaddr, const int level, const vaddr_t base, std::vector<VRange> &ranges
+) {
+    using PTE = typename BITRANGE::PTE;
+    using VA = typename BITRANGE::VA;
+    pte_t ptes[PTES_PER_TABLE];
+    if (pmem->read(ptaddr, ptes, PAGESIZE)) {
+        SPDLOG_LOGGER_ERROR(logger, "SV failed to get pagetable from PMEM 0x{:x}", ptaddr);
+        assert(0);
+        return -1;
+    }
+    const uint64_t span = 1ull << VA::VPN[level].second; // 本级每个PTE覆盖的字节数
+    for (size_t i = 0; i < PTES_PER_TABLE; i++) {
+        if (bits_extract(ptes[i], PTE::V) == 0) continue;
+        const vaddr_t vaddr = base + i * span;
+        if (bits_extract(ptes[i], PTE::XWR) == 0) {
+            if (collect_dirty_one_level(pte_paddr(ptes[i]), level - 1, vaddr, ranges)) {
+                return -1;
+            }
+            continue;
+        }
+        if (bits_extract(ptes[i], PTE::D) == 0) continue;
+        pte_t old = ptes[i];
+        if (cas_pte(ptaddr + i * sizeof(pte_t), old, [](pte_t pte) {
+                return bits_set(0, PTE::D, pte);
+            })) {
             return -1;
         }
+        if (bits_extract(old, PTE::D) == 0) continue; // 已被并发的收集清除
+        if (!ranges.empty() && ranges.back().vaddr + ranges.back().size == vaddr) {
+            ranges.back().size += span;
+        } else {
+            ranges.push_back({vaddr, span});
+        }
     }
     return 0;
 }
 
-template <typename Trait>
-int SV_supervisor<Trait>::alloc_one_page(const pagetable_t ptroot, const vaddr_t vaddr) {
+template <typename Trait, typename PMEM>
+typename SV_supervisor<Trait, PMEM>::shm_t SV_supervisor<Trait, PMEM>::shm_create(
+    const size_t size
+) {
+    if (size == 0) {
+        SPDLOG_LOGGER_WARN(logger, "SV shm_create called with size 0");
+        return 0;
+    }
+    const size_t num_page = (size + PAGESIZE - 1) / PAGESIZE;
+    std::shared_lock<std::shared_mutex> op_lock(m_op_lock);
+    ShmSegment seg;
+    seg.pages.resize(num_page);
+    if (palloc_batch(seg.pages.data(), num_page)) {
+        SPDLOG_LOGGER_DEBUG(logger, "SV failed to allocate shared segment of 0x{:x} bytes", size);
+        return 0;
+    }
+    for (paddr_t page : seg.pages) {
+        rmap_set(page, RMAP_SHM, 0, 0, 0);
+    }
+    std::lock_guard<std::mutex> lock(m_shm_lock);
+    const shm_t shm = m_next_shm++;
+    m_shms.emplace(shm, std::move(seg));
+    return shm;
+}
+
+template <typename Trait, typename PMEM>
+typename SV_supervisor<Trait, PMEM>::vaddr_t SV_supervisor<Trait, PMEM>::shm_map(
+    const pagetable_t ptroot, const shm_t shm, vaddr_t vaddr, const bool readonly
+) {
+    std::lock_guard<std::mutex> shm_lock(m_shm_lock);
+    auto seg_it = m_shms.find(shm);
+    if (seg_it == m_shms.end()) {
+        SPDLOG_LOGGER_ERROR(logger, "SV shm_map: unknown shared segment {}", shm);
+        return 0;
+    }
+    const std::vector<paddr_t> &pages = seg_it->second.pages;
+    std::shared_lock<std::shared_mutex> ptroots_lock(m_ptroots_lock);
     assert_ptroot(ptroot);
-    assert(vaddr % PAGESIZE == 0);
-    assert(!translate(ptroot, vaddr));
+    AddressSpace &as = m_ptroots.at(ptroot);
+    std::lock_guard<std::mutex> as_lock(as.lock);
+    vaddr = vaddr - vaddr % PAGESIZE;
+    vaddr = (vaddr == 0) ? 0x91000000 : vaddr;
+    const uint64_t len = pages.size() * PAGESIZE;
+    const uint64_t start = (len < VA_TOP) ? vma_find_free(as, vaddr, len) : 0;
+    if (start == 0) {
+        SPDLOG_LOGGER_WARN(
+            logger, "SV shm_map failed to find idle vaddr=0x{:x} + 0x{:x}, ptroot=0x{:x}", vaddr,
+            len, ptroot
+        );
+        return 0;
+    }
+    if (map_shared_pages(ptroot, start, pages.data(), pages.size(), readonly)) {
+        return 0;
+    }
+    vma_insert(as, start, VMA{start + len});
+    m_vpage_usage += pages.size();
+    return start;
+}
+
+template <typename Trait, typename PMEM>
+int SV_supervisor<Trait, PMEM>::shm_unmap(
+    const pagetable_t ptroot, const shm_t shm, const vaddr_t vaddr
+) {
+    size_t size;
+    {
+        std::lock_guard<std::mutex> shm_lock(m_shm_lock);
+        auto seg_it = m_shms.find(shm);
+        if (seg_it == m_shms.end()) {
+            SPDLOG_LOGGER_ERROR(logger, "SV shm_unmap: unknown shared segment {}", shm);
+            return -1;
+        }
+        size = seg_it->second.pages.size() * PAGESIZE;
+        // 只检查首页，munmap会保证整个范围都已映射
+        paddr_t pte_addr;
+        pte_t pte;
+        std::shared_lock<std::shared_mutex> ptroots_lock(m_ptroots_lock);
+        assert_ptroot(ptroot);
+        AddressSpace &as = m_ptroots.at(ptroot);
+        std::lock_guard<std::mutex> as_lock(as.lock);
+        if (find_leaf(ptroot, vaddr, pte_addr, pte) != 0 || !is_shared(pte) ||
+            pte_paddr(pte) != seg_it->second.pages[0]) {
+            SPDLOG_LOGGER_ERROR(
+                logger, "SV shm_unmap: segment {} is not mapped at vaddr=0x{:x}, ptroot=0x{:x}",
+                shm, vaddr, ptroot
+            );
+            return -1;
+        }
+    }
+    return munmap(ptroot, vaddr, size);
+}
+
+template <typename Trait, typename PMEM>
+int SV_supervisor<Trait, PMEM>::shm_destroy(const shm_t shm) {
+    std::lock_guard<std::mutex> lock(m_shm_lock);
+    auto node = m_shms.extract(shm);
+    if (node.empty()) {
+        SPDLOG_LOGGER_ERROR(logger, "SV shm_destroy: unknown shared segment {}", shm);
+        return -1;
+    }
+    std::vector<paddr_t> &pages = node.mapped().pages;
+    put_pages(pages.data(), pages.size());
+    return 0;
+}
+
+template <typename Trait, typename PMEM>
+int SV_supervisor<Trait, PMEM>::clone_one_level(
+    const paddr_t src, const paddr_t dst, const int level, const pagetable_t dst_root,
+    const vaddr_t base
+) {
     using PTE = typename BITRANGE::PTE;
     using VA = typename BITRANGE::VA;
+    pte_t ptes[PTES_PER_TABLE], child[PTES_PER_TABLE] = {};
+    int result = 0;
+    if (pmem->read(src, ptes, PAGESIZE)) {
+        SPDLOG_LOGGER_ERROR(logger, "SV failed to get pagetable from PMEM 0x{:x}", src);
+        assert(0);
+        std::fill(std::begin(ptes), std::end(ptes), 0);
+        result = -1;
+    }
+    uint16_t valid = 0;
+    for (size_t i = 0; i < PTES_PER_TABLE && result == 0; i++) {
+        const pte_t pte = ptes[i];
+        if (bits_extract(pte, PTE::V) == 0) continue;
+        if (bits_extract(pte, PTE::XWR)) { // 叶子：双方共享同一物理页
+            // 共享内存段的页保持原有权限，双方继续共享写入
+            if (bits_extract(pte, PTE::W) && !is_shared(pte)) {
+                // 只改写这一项，不覆盖其他访问者并发设置的A/D位
+                if (cas_pte(src + i * sizeof(pte_t), ptes[i], cow_pte)) {
+                    result = -1;
+                    break;
+                }
+                ptes[i] = cow_pte(ptes[i]);
+            }
+            page_refs(pte_paddr(pte))++;
+            child[i] = ptes[i];
+            valid++;
+            continue;
+        }
+        assert(level > 0);
+        paddr_t next = palloc(0);
+        if (next == 0) {
+            result = -1;
+            break;
+        }
+        // 即使下级复制失败，也要挂上已复制的部分，以便统一回收
+        child[i] = table_pte(next);
+        valid++;
+        const vaddr_t vaddr = base + (i << VA::VPN[level].second);
+        rmap_set(next, RMAP_TABLE, dst_root, vaddr, level - 1);
+        result = clone_one_level(pte_paddr(pte), next, level - 1, dst_root, vaddr);
+    }
+    if (pmem->write(dst, child, PAGESIZE)) {
+        SPDLOG_LOGGER_ERROR(logger, "SV failed to write cloned pagetable to PMEM at 0x{:x}", dst);
+        assert(0);
+        result = -1;
+    }
+    pt_valid(dst) = valid;
+    return result;
+}
+
+template <typename Trait, typename PMEM>
+int SV_supervisor<Trait, PMEM>::break_cow(
+    const pagetable_t ptroot, const vaddr_t vaddr, const paddr_t pte_addr, const pte_t pte,
+    const int level
+) {
+    using PTE = typename BITRANGE::PTE;
     using PA = typename BITRANGE::PA;
-    paddr_t paddr = 0;
+    const paddr_t old_paddr = pte_paddr(pte);
+    const uint8_t order = level_order(level);
+    const uint64_t leaf_size = (1ull << order) * PAGESIZE;
+    // 共享计数只在持有某个共享者的地址空间锁时增加，已无其他共享者时直接恢复写权限即可
+    const bool shared = page_refs(old_paddr).load(std::memory_order_acquire) > 0;
+    paddr_t new_paddr = 0;
+    if (shared) {
+        new_paddr = palloc(order);
+        if (new_paddr == 0) {
+            SPDLOG_LOGGER_DEBUG(
+                logger, "SV failed to allocate copy-on-write page: vaddr=0x{:x}, ptroot=0x{:x}",
+                vaddr, ptroot
+            );
+            return -1;
+        }
+        if (copy_pages(new_paddr, old_paddr, 1ull << order)) {
+            pfree(new_paddr, order);
+            return -1;
+        }
+    }
+    pte_t expected = pte;
+    if (cas_pte(pte_addr, expected, [&](pte_t cur) {
+            const uint64_t new_pte = bits_set(0, PTE::RSW, bits_set(1, PTE::W, cur));
+            return shared ? bits_set(bits_extract(new_paddr, PA::PPNFULL), PTE::PPNFULL, new_pte)
+                          : new_pte;
+        })) {
+        if (new_paddr) pfree(new_paddr, order);
+        return -1;
+    }
+    // 私有副本或不再被共享的原页此后只由本地址空间映射
+    rmap_set(shared ? new_paddr : old_paddr, RMAP_LEAF, ptroot, vaddr, level);
+    if (shared) {
+        put_page(old_paddr, order);
+    }
+    this->sfence_vma(ptroot, vaddr - vaddr % leaf_size, leaf_size);
+    return 0;
+}
+
+template <typename Trait, typename PMEM>
+int SV_supervisor<Trait, PMEM>::copy_pages(
+    const paddr_t dst, const paddr_t src, const size_t num_page
+) {
+    uint8_t buf[PAGESIZE];
+    for (uint64_t off = 0; off < num_page * PAGESIZE; off += PAGESIZE) {
+        if (pmem->read(src + off, buf, PAGESIZE) || pmem->write(dst + off, buf, PAGESIZE)) {
+            SPDLOG_LOGGER_ERROR(logger, "SV failed to copy page at PMEM 0x{:x}", src + off);
+            assert(0);
+            return -1;
+        }
+    }
+    return 0;
+}
 
-    std::vector<paddr_t> allocated_pages;
-    std::vector<std::pair<paddr_t, pte_t>> commit_ptes;
+template <typename Trait, typename PMEM>
+template <typename F>
+int SV_supervisor<Trait, PMEM>::cas_pte(const paddr_t pte_addr, pte_t &expected, F &&make_new) {
+    uint64_t cur = expected;
+    for (;;) {
+        const uint64_t want = static_cast<pte_t>(make_new(static_cast<pte_t>(cur)));
+        if (want == cur) break;
+        const int ret = pmem->compare_exchange(pte_addr, cur, want, sizeof(pte_t));
+        if (ret == 0) break;
+        if (ret < 0) {
+            SPDLOG_LOGGER_ERROR(logger, "SV failed to write PTE to PMEM at 0x{:x}", pte_addr);
+            assert(0);
+            return -1;
+        }
+    }
+    expected = static_cast<pte_t>(cur);
+    return 0;
+}
 
+template <typename Trait, typename PMEM>
+typename SV_supervisor<Trait, PMEM>::paddr_t SV_supervisor<Trait, PMEM>::walk_to_table(
+    const pagetable_t ptroot, const vaddr_t vaddr, const int target_level, const bool create
+) {
+    using PTE = typename BITRANGE::PTE;
+    using VA = typename BITRANGE::VA;
     paddr_t ptaddr = ptroot;
-    int level;
-    pte_t pte = 0;
-    paddr_t pte_addr = 0;
-    for (level = LEVELS - 1; level >= 0; level--) {
-        pte_addr = ptaddr + bits_extract(vaddr, VA::VPN[level]) * sizeof(pte_t);
+    for (int level = LEVELS - 1; level > target_level; level--) {
+        paddr_t pte_addr = ptaddr + bits_extract(vaddr, VA::VPN[level]) * sizeof(pte_t);
+        pte_t pte;
         if (pmem->read(pte_addr, &pte, sizeof(pte_t))) {
             SPDLOG_LOGGER_ERROR(
                 logger, "SV failed to get PTE from PMEM at 0x{:x}, ptroot=0x{:x}, vaddr=0x{:x}",
                 pte_addr, ptroot, vaddr
             );
             assert(0); // it's a incorrect pagetable, please check where destroy it
-            return -1;
-        }
-        if (bits_extract(pte, PTE::V) == 0) {
-            break;
-        }
-        if (bits_extract(pte, PTE::R) == 0 && bits_extract(pte, PTE::W) == 1) {
-            SPDLOG_LOGGER_ERROR(
-                logger, "SV PTE error: R=0 && W=1 PAGE-FAULT, ptroot=0x{:x}, vaddr=0x{:x}", ptroot,
-                vaddr
-            );
-            assert(0); // todo: how to deal with pagefault exception?
             return 0;
         }
-        // Already known pte.v == 1
-        if (bits_extract(pte, PTE::R) || bits_extract(pte, PTE::X)) {
-            // Leaf PTE found
-            SPDLOG_LOGGER_ERROR(
-                logger,
-                "SV internal alloc error: alloc at existing vaddr 0x{:x}, "
-                "this problem should have already been resolved by caller(mmap)",
-                vaddr
-            );
-            assert(0);
-        } else {              // Next level PTE found
-            if (level == 0) { // already reach final level, next level does not exist
+        if (bits_extract(pte, PTE::V) == 0) {
+            if (!create) return 0;
+            // need to create new 4kB pagetable
+            paddr_t new_ptaddr = palloc(0);
+            if (new_ptaddr == 0) {
+                return 0;
+            }
+            assert(new_ptaddr % PAGESIZE == 0);
+            pte = table_pte(new_ptaddr);
+            if (pmem->fill(new_ptaddr, 0, PAGESIZE) ||
+                pmem->write(pte_addr, &pte, sizeof(pte_t))) {
                 SPDLOG_LOGGER_ERROR(
                     logger,
-                    "SV PTE error: point to non-exist next level pagetable PAGE-FAULT, "
+                    "SV failed to commit newly allocated pagetable at PMEM 0x{:x}, "
                     "ptroot=0x{:x}, vaddr=0x{:x}",
-                    ptroot, vaddr
+                    new_ptaddr, ptroot, vaddr
                 );
                 assert(0);
+                pfree(new_ptaddr, 0);
                 return 0;
             }
-            ptaddr = bits_set(bits_extract(pte, PTE::PPNFULL), PA::PPNFULL);
+            pt_valid(ptaddr)++;
+            pt_valid(new_ptaddr) = 0;
+            rmap_set(new_ptaddr, RMAP_TABLE, ptroot, vaddr, level - 1);
+            ptaddr = new_ptaddr;
             continue;
         }
-    }
-    while (level > 0) { // need to create new 4kB pagetable
-        ptaddr = buddy.allocate(0);
-        if (ptaddr == 0) {
-            goto RET_ERR;
-        }
-        assert(ptaddr % PAGESIZE == 0);
-        allocated_pages.push_back(ptaddr);
-        pte = bits_set(bits_extract(ptaddr, PA::PPNFULL), PTE::PPNFULL, 0);
-        pte = bits_set(1, PTE::V, pte);
-        // pte.X/W/R = 0, pointer to next level pagetable
-        commit_ptes.push_back({pte_addr, pte});
-        // loop step
-        level--;
-        pte_addr = ptaddr + bits_extract(vaddr, VA::VPN[level]) * sizeof(pte_t);
-    }
-    assert(level == 0);
-
-    paddr = buddy.allocate(0);
-    if (paddr == 0) {
-        SPDLOG_LOGGER_DEBUG(
-            logger, "SV failed to allocate physical memory for page at vaddr=0x{:x}, ptroot=0x{:x}",
-            vaddr, ptroot
-        );
-        goto RET_ERR;
-    }
-    assert(paddr % PAGESIZE == 0);
-    // no need to allocated_pages.push_back(paddr), we are already success
-    pte = bits_set(bits_extract(paddr, PA::PPNFULL), PTE::PPNFULL, 0);
-    pte = bits_set(1, PTE::V, pte);
-    // todo: currently, accessibility is not checked strictly
-    pte = bits_set(1, PTE::R, pte);
-    pte = bits_set(1, PTE::X, pte);
-    pte = bits_set(1, PTE::W, pte);
-    commit_ptes.push_back({pte_addr, pte});
-
-    // success to alloc one page, commit all changes now
-    for (auto &page : allocated_pages) {
-        if (pmem->fill(page, 0, PAGESIZE)) {
+        if (bits_extract(pte, PTE::XWR)) {
             SPDLOG_LOGGER_ERROR(
                 logger,
-                "SV failed to reset newly allocated pagetable to 0 at PMEM 0x{:x}, "
-                "ptroot=0x{:x}, vaddr=0x{:x}",
-                page, ptroot, vaddr
+                "SV internal error: unexpected leaf PTE at level {}, ptroot=0x{:x}, vaddr=0x{:x}",
+                level, ptroot, vaddr
             );
             assert(0);
-            goto RET_ERR;
-        }
-    }
-    for (auto &p : commit_ptes) {
-        if (pmem->write(p.first, &p.second, sizeof(pte_t))) {
-            SPDLOG_LOGGER_ERROR(
-                logger, "SV failed to write PTE to PMEM at 0x{:x}, ptroot=0x{:x}, vaddr=0x{:x}",
-                p.first, ptroot, vaddr
-            );
-            assert(0);
-            goto RET_ERR;
+            return 0;
         }
+        ptaddr = pte_paddr(pte);
     }
-    m_vpage_usage++;
-    return 0;
-
-RET_ERR:
-    for (auto &p : allocated_pages) {
-        buddy.free(p, 0);
-    }
-    return -1;
+    return ptaddr;
 }
 
-template <typename Trait>
-int SV_supervisor<Trait>::free_one_page(pagetable_t ptroot, vaddr_t vaddr) {
-    assert_ptroot(ptroot);
-    assert(vaddr % PAGESIZE == 0);
-    assert(translate(ptroot, vaddr));
+template <typename Trait, typename PMEM>
+int SV_supervisor<Trait, PMEM>::find_leaf(
+    const pagetable_t ptroot, const vaddr_t vaddr, paddr_t &pte_addr, pte_t &pte, paddr_t *tables
+) {
     using PTE = typename BITRANGE::PTE;
     using VA = typename BITRANGE::VA;
-    using PA = typename BITRANGE::PA;
-
-    std::vector<paddr_t> pagetables;
-    std::vector<paddr_t> pte_addrs;
-    paddr_t ptaddr = ptroot; // the selected-level pagetable base addr
+    paddr_t ptaddr = ptroot;
     for (int level = LEVELS - 1; level >= 0; level--) {
-        paddr_t pte_addr = ptaddr + bits_extract(vaddr, VA::VPN[level]) * sizeof(pte_t);
-        pte_t pte;
+        if (tables) tables[level] = ptaddr;
+        pte_addr = ptaddr + bits_extract(vaddr, VA::VPN[level]) * sizeof(pte_t);
         if (pmem->read(pte_addr, &pte, sizeof(pte_t))) {
             SPDLOG_LOGGER_ERROR(
                 logger, "SV failed to get PTE from PMEM at 0x{:x}, ptroot=0x{:x}, vaddr=0x{:x}",
@@ -321,77 +738,1216 @@ int SV_supervisor<Trait>::free_one_page(pagetable_t ptroot, vaddr_t vaddr) {
             return -1;
         }
         if (bits_extract(pte, PTE::V) == 0) {
-            SPDLOG_LOGGER_ERROR(
-                logger,
-                "SV PTE.V==0 PAGE-FAULT during internal page-free, PTE at PMEM 0x{:x}, "
-                "ptroot=0x{:x}, vaddr=0x{:x}",
-                pte_addr, ptroot, vaddr
-            );
-            assert(0);
             return -1;
         }
-        if (bits_extract(pte, PTE::R) == 0 && bits_extract(pte, PTE::W) == 1) {
+        if (bits_extract(pte, PTE::XWR)) {
+            return level;
+        }
+        if (level == 0) {
             SPDLOG_LOGGER_ERROR(
-                logger, "SV PTE error: R=0 && W=1 PAGE-FAULT, ptroot=0x{:x}, vaddr=0x{:x}", ptroot,
-                vaddr
+                logger,
+                "SV PTE error: point to non-exist next level pagetable PAGE-FAULT, "
+                "ptroot=0x{:x}, vaddr=0x{:x}",
+                ptroot, vaddr
             );
             assert(0);
             return -1;
         }
-        // Already known pte.v == 1
-        if (bits_extract(pte, PTE::R) || bits_extract(pte, PTE::X)) {
-            // Leaf PTE found
-            if (level != 0) { // for super-page (level != 0)
-                SPDLOG_LOGGER_ERROR(
-                    logger,
-                    "SV page free do not support superpage yet, ptroot=0x{:x}, vaddr=0x{:x}",
-                    ptroot, vaddr
-                );
+        ptaddr = pte_paddr(pte);
+    }
+    return -1;
+}
+
+template <typename Trait, typename PMEM>
+int SV_supervisor<Trait, PMEM>::split_superpage(
+    const pagetable_t ptroot, const vaddr_t vaddr, const paddr_t pte_addr, const pte_t pte,
+    const int level
+) {
+    assert(level > 0);
+    using PTE = typename BITRANGE::PTE;
+    using PA = typename BITRANGE::PA;
+    paddr_t ptaddr = palloc(0);
+    if (ptaddr == 0) {
+        return -1;
+    }
+    // 新页表中的每个PTE都是下一级的叶子，沿用原PTE的权限位与A/D位，物理页依次落在原大页内。
+    // 新页表须在挂上之前写好；原PTE的A/D位被并发设置时，以最新值重新生成
+    const paddr_t base = pte_paddr(pte);
+    const uint64_t step = (1ull << level_order(level - 1)) * PAGESIZE;
+    bool written = true;
+    pte_t expected = pte;
+    if (cas_pte(pte_addr, expected, [&](pte_t leaf) {
+            pte_t ptes[PTES_PER_TABLE];
+            for (size_t i = 0; i < PTES_PER_TABLE; i++) {
+                const paddr_t page = base + i * step;
+                ptes[i] = bits_set(bits_extract(page, PA::PPNFULL), PTE::PPNFULL, leaf);
             }
-            paddr_t paddr = bits_set(bits_extract(pte, PTE::PPNFULL), PA::PPNFULL);
-            assert(paddr != 0);
-            buddy.free(paddr, 0);
-            pte = 0;
-            if (pmem->write(pte_addr, &pte, sizeof(pte_t))) {
-                SPDLOG_LOGGER_ERROR(
-                    logger, "SV failed to write PTE to PMEM at 0x{:x}, ptroot=0x{:x}, vaddr=0x{:x}",
-                    pte_addr, ptroot, vaddr
-                );
-                assert(0);
+            written = pmem->write(ptaddr, ptes, PAGESIZE) == 0;
+            return written ? table_pte(ptaddr) : leaf;
+        }) ||
+        !written) {
+        SPDLOG_LOGGER_ERROR(
+            logger, "SV failed to split superpage PTE at PMEM 0x{:x}, level={}", pte_addr, level
+        );
+        assert(0);
+        pfree(ptaddr, 0);
+        return -1;
+    }
+    pt_valid(ptaddr) = PTES_PER_TABLE;
+    // 共享的大页在拆分前已建立私有副本，拆出的叶子都只由本地址空间映射
+    rmap_set(ptaddr, RMAP_TABLE, ptroot, vaddr, level - 1);
+    if (m_rmap) {
+        const vaddr_t vbase = vaddr - vaddr % (step * PTES_PER_TABLE);
+        for (size_t i = 0; i < PTES_PER_TABLE; i++) {
+            rmap_set(base + i * step, RMAP_LEAF, ptroot, vbase + i * step, level - 1);
+        }
+    }
+    return 0;
+}
+
+template <typename Trait, typename PMEM>
+int SV_supervisor<Trait, PMEM>::split_at(const pagetable_t ptroot, const uint64_t vaddr) {
+    if (vaddr >= VA_TOP) return 0;
+    paddr_t pte_addr;
+    pte_t pte;
+    int level;
+    // 覆盖vaddr的大页若不以vaddr为起点，则逐级拆分，直至vaddr成为某个叶子的起点
+    while ((level = find_leaf(ptroot, vaddr, pte_addr, pte)) > 0 &&
+           vaddr % ((1ull << level_order(level)) * PAGESIZE) != 0) {
+        if (is_cow(pte) && page_refs(pte_paddr(pte)) > 0) {
+            // 仍被共享的大页拆分后无法部分释放，先建立私有副本
+            if (break_cow(ptroot, vaddr, pte_addr, pte, level)) {
                 return -1;
             }
-            // TODO: maybe we need to check if the pagetables need to be freed
-            //       but currently, we do not free pagetables until destroy_pagetable
-            assert(m_vpage_usage > 0);
-            m_vpage_usage--;
-            return 0;
-        } else { // Next level PTE found
-            if (level == 0) {
+            continue;
+        }
+        if (split_superpage(ptroot, vaddr, pte_addr, pte, level)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+template <typename Trait, typename PMEM>
+int SV_supervisor<Trait, PMEM>::map_superpage(
+    const pagetable_t ptroot, const vaddr_t vaddr, const int level
+) {
+    using VA = typename BITRANGE::VA;
+    paddr_t ptaddr = walk_to_table(ptroot, vaddr, level, true);
+    if (ptaddr == 0) {
+        return -1;
+    }
+    paddr_t pte_addr = ptaddr + bits_extract(vaddr, VA::VPN[level]) * sizeof(pte_t);
+    pte_t pte;
+    if (pmem->read(pte_addr, &pte, sizeof(pte_t))) {
+        assert(0);
+        return -1;
+    }
+    if (pte != 0) {
+        return 1; // 该位置已有下级页表（范围内有其他映射），只能使用小页
+    }
+    paddr_t paddr = palloc(level_order(level));
+    if (paddr == 0 && m_auto_compact && compact_locked(level_order(level), ptroot) == 0) {
+        // 整理可能迁移了沿途的页表页，重新查找PTE的位置
+        ptaddr = walk_to_table(ptroot, vaddr, level, false);
+        pte_addr = ptaddr + bits_extract(vaddr, VA::VPN[level]) * sizeof(pte_t);
+        paddr = ptaddr ? palloc(level_order(level)) : 0;
+    }
+    if (paddr == 0) {
+        return 1; // 没有足够大的连续物理内存，退回小页
+    }
+    pte = leaf_pte(paddr);
+    Stats::add(StatCounter::PTE_WRITE);
+    if (pmem->write(pte_addr, &pte, sizeof(pte_t))) {
+        SPDLOG_LOGGER_ERROR(
+            logger, "SV failed to write PTE to PMEM at 0x{:x}, ptroot=0x{:x}, vaddr=0x{:x}",
+            pte_addr, ptroot, vaddr
+        );
+        assert(0);
+        pfree(paddr, level_order(level));
+        return -1;
+    }
+    pt_valid(ptaddr)++;
+    rmap_set(paddr, RMAP_LEAF, ptroot, vaddr, level);
+    return 0;
+}
+
+template <typename Trait, typename PMEM>
+int SV_supervisor<Trait, PMEM>::map_range(
+    const pagetable_t ptroot, const vaddr_t vaddr, const size_t num_page
+) {
+    assert_ptroot(ptroot);
+    assert(vaddr % PAGESIZE == 0);
+    using VA = typename BITRANGE::VA;
+    pte_t ptes[PTES_PER_TABLE];
+    size_t done = 0;
+    while (done < num_page) {
+        const vaddr_t cur_vaddr = vaddr + done * PAGESIZE;
+        const size_t remaining = num_page - done;
+        // 对齐与剩余大小允许时，优先使用最大的大页
+        int level;
+        for (level = LEVELS - 1; level > 0; level--) {
+            const uint64_t pages = 1ull << level_order(level);
+            if (remaining < pages || (cur_vaddr / PAGESIZE) % pages != 0) continue;
+            int result = map_superpage(ptroot, cur_vaddr, level);
+            if (result < 0) goto RET_ERR;
+            if (result == 0) break;
+        }
+        if (level > 0) {
+            done += 1ull << level_order(level);
+            continue;
+        }
+
+        // 小页：填满当前末级页表中的一段PTE
+        const size_t idx = bits_extract(cur_vaddr, VA::VPN[0]);
+        const size_t count = std::min(remaining, PTES_PER_TABLE - idx);
+        paddr_t ptaddr = walk_to_table(ptroot, cur_vaddr, 0, true);
+        if (ptaddr == 0) {
+            SPDLOG_LOGGER_DEBUG(
+                logger, "SV failed to get pagetable for vaddr=0x{:x}, ptroot=0x{:x}", cur_vaddr,
+                ptroot
+            );
+            goto RET_ERR;
+        }
+        paddr_t paddrs[PTES_PER_TABLE];
+        if (palloc_batch(paddrs, count)) {
+            SPDLOG_LOGGER_DEBUG(
+                logger,
+                "SV failed to allocate physical memory for {} pages at vaddr=0x{:x}, "
+                "ptroot=0x{:x}",
+                count, cur_vaddr, ptroot
+            );
+            goto RET_ERR;
+        }
+        for (size_t i = 0; i < count; i++) {
+            assert(paddrs[i] % PAGESIZE == 0);
+            ptes[i] = leaf_pte(paddrs[i]);
+        }
+        // 同一末级页表中的PTE一次写入
+        Stats::add(StatCounter::PTE_WRITE, count);
+        if (pmem->write(ptaddr + idx * sizeof(pte_t), ptes, count * sizeof(pte_t))) {
+            SPDLOG_LOGGER_ERROR(
+                logger, "SV failed to write PTE to PMEM at 0x{:x}, ptroot=0x{:x}, vaddr=0x{:x}",
+                ptaddr + idx * sizeof(pte_t), ptroot, cur_vaddr
+            );
+            assert(0);
+            pfree_batch(paddrs, count);
+            goto RET_ERR;
+        }
+        pt_valid(ptaddr) += count;
+        for (size_t i = 0; i < count; i++) {
+            rmap_set(paddrs[i], RMAP_LEAF, ptroot, cur_vaddr + i * PAGESIZE, 0);
+        }
+        done += count;
+    }
+    return 0;
+
+RET_ERR:
+    // failed to alloc page. rollback needed: free all previous allocated pages
+    if (done > 0 && unmap_range(ptroot, vaddr, done)) {
+        assert(0);
+    }
+    return -1;
+}
+
+template <typename Trait, typename PMEM>
+int SV_supervisor<Trait, PMEM>::map_shared_pages(
+    const pagetable_t ptroot, const vaddr_t vaddr, const paddr_t pages[], const size_t num_page,
+    const bool readonly
+) {
+    assert_ptroot(ptroot);
+    assert(vaddr % PAGESIZE == 0);
+    using PTE = typename BITRANGE::PTE;
+    using VA = typename BITRANGE::VA;
+    pte_t ptes[PTES_PER_TABLE];
+    size_t done = 0;
+    while (done < num_page) {
+        // 段的物理页不连续，只使用小页，同一末级页表中的PTE一次写入
+        const vaddr_t cur_vaddr = vaddr + done * PAGESIZE;
+        const size_t idx = bits_extract(cur_vaddr, VA::VPN[0]);
+        const size_t count = std::min(num_page - done, PTES_PER_TABLE - idx);
+        paddr_t ptaddr = walk_to_table(ptroot, cur_vaddr, 0, true);
+        if (ptaddr == 0) {
+            SPDLOG_LOGGER_DEBUG(
+                logger, "SV failed to get pagetable for vaddr=0x{:x}, ptroot=0x{:x}", cur_vaddr,
+                ptroot
+            );
+            break;
+        }
+        for (size_t i = 0; i < count; i++) {
+            pte_t pte = bits_set(RSW_SHARED, PTE::RSW, leaf_pte(pages[done + i]));
+            ptes[i] = readonly ? bits_set(0, PTE::W, pte) : pte;
+        }
+        Stats::add(StatCounter::PTE_WRITE, count);
+        if (pmem->write(ptaddr + idx * sizeof(pte_t), ptes, count * sizeof(pte_t))) {
+            SPDLOG_LOGGER_ERROR(
+                logger, "SV failed to write PTE to PMEM at 0x{:x}, ptroot=0x{:x}, vaddr=0x{:x}",
+                ptaddr + idx * sizeof(pte_t), ptroot, cur_vaddr
+            );
+            assert(0);
+            break;
+        }
+        for (size_t i = 0; i < count; i++) {
+            page_refs(pages[done + i])++;
+        }
+        pt_valid(ptaddr) += count;
+        done += count;
+    }
+    if (done == num_page) {
+        return 0;
+    }
+    // 回滚：unmap_range只放弃已映射部分的引用，物理页仍由段持有
+    if (done > 0 && unmap_range(ptroot, vaddr, done)) {
+        assert(0);
+    }
+    return -1;
+}
+
+template <typename Trait, typename PMEM>
+int SV_supervisor<Trait, PMEM>::unmap_range(
+    const pagetable_t ptroot, const vaddr_t vaddr, const size_t num_page, const bool allow_holes
+) {
+    assert_ptroot(ptroot);
+    assert(vaddr % PAGESIZE == 0);
+    using PTE = typename BITRANGE::PTE;
+    using VA = typename BITRANGE::VA;
+    // 只有范围两端可能落在大页中间，先拆分两端的大页，之后范围内的叶子都被完整释放
+    const uint64_t end = vaddr + num_page * PAGESIZE;
+    if (split_at(ptroot, vaddr) || split_at(ptroot, end)) {
+        SPDLOG_LOGGER_ERROR(
+            logger, "SV failed to split superpage for partial unmap, ptroot=0x{:x}, vaddr=0x{:x}",
+            ptroot, vaddr
+        );
+        return -1;
+    }
+    pte_t ptes[PTES_PER_TABLE];
+    std::vector<paddr_t> empty_tables; // 变空的页表页，最后批量释放
+    size_t done = 0;
+    int result = 0;
+    while (done < num_page) {
+        const vaddr_t cur_vaddr = vaddr + done * PAGESIZE;
+        const size_t remaining = num_page - done;
+        paddr_t pte_addr;
+        pte_t pte;
+        paddr_t tables[LEVELS] = {};
+        int level = find_leaf(ptroot, cur_vaddr, pte_addr, pte, tables);
+        if (level < 0 && allow_holes && tables[0] == 0) {
+            // 尚未分配的空洞，且缺少下级页表：跳过该PTE覆盖的整个范围
+            int missing = 1;
+            while (tables[missing] == 0) missing++;
+            const uint64_t pages = 1ull << level_order(missing);
+            done += std::min<uint64_t>(remaining, pages - (cur_vaddr / PAGESIZE) % pages);
+            continue;
+        }
+        if (level < 0 && !allow_holes) {
+            SPDLOG_LOGGER_ERROR(
+                logger,
+                "SV PTE.V==0 PAGE-FAULT during internal page-free, ptroot=0x{:x}, vaddr=0x{:x}",
+                ptroot, cur_vaddr
+            );
+            assert(0);
+            result = -1;
+            break;
+        }
+        if (level > 0) { // 大页，两端已拆分，必然被完整释放
+            const uint64_t pages = 1ull << level_order(level);
+            assert((cur_vaddr / PAGESIZE) % pages == 0 && remaining >= pages);
+            const paddr_t paddr = pte_paddr(pte);
+            pte = 0;
+            Stats::add(StatCounter::PTE_WRITE);
+            if (pmem->write(pte_addr, &pte, sizeof(pte_t))) {
+                assert(0);
+                result = -1;
+                break;
+            }
+            put_page(paddr, level_order(level));
+            pt_valid(tables[level])--;
+            release_empty_tables(tables, level, cur_vaddr, empty_tables);
+            done += pages;
+            continue;
+        }
+
+        // 末级页表中的一段PTE，允许空洞时跳过其中无效的PTE
+        const size_t idx = bits_extract(cur_vaddr, VA::VPN[0]);
+        const size_t count = std::min(remaining, PTES_PER_TABLE - idx);
+        if (pmem->read(pte_addr, ptes, count * sizeof(pte_t))) {
+            SPDLOG_LOGGER_ERROR(
+                logger, "SV failed to get PTE from PMEM at 0x{:x}, ptroot=0x{:x}, vaddr=0x{:x}",
+                pte_addr, ptroot, cur_vaddr
+            );
+            assert(0);
+            result = -1;
+            break;
+        }
+        paddr_t paddrs[PTES_PER_TABLE];
+        size_t valid = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (bits_extract(ptes[i], PTE::V) == 0 && allow_holes) continue;
+            if (bits_extract(ptes[i], PTE::V) == 0 || bits_extract(ptes[i], PTE::XWR) == 0) {
                 SPDLOG_LOGGER_ERROR(
                     logger,
-                    "SV PTE error: point to non-exist next level pagetable PAGE-FAULT, "
+                    "SV invalid leaf PTE during internal page-free, PTE at PMEM 0x{:x}, "
                     "ptroot=0x{:x}, vaddr=0x{:x}",
-                    ptroot, vaddr
+                    pte_addr + i * sizeof(pte_t), ptroot, cur_vaddr + i * PAGESIZE
                 );
                 assert(0);
-                return -1;
+                result = -1;
+                break;
             }
-            ptaddr = bits_set(bits_extract(pte, PTE::PPNFULL), PA::PPNFULL);
-            continue;
+            paddrs[valid++] = pte_paddr(ptes[i]);
+            assert(paddrs[valid - 1] != 0);
+        }
+        if (result) break;
+        Stats::add(StatCounter::PTE_WRITE, count);
+        if (pmem->fill(pte_addr, 0, count * sizeof(pte_t))) {
+            SPDLOG_LOGGER_ERROR(
+                logger, "SV failed to write PTE to PMEM at 0x{:x}, ptroot=0x{:x}, vaddr=0x{:x}",
+                pte_addr, ptroot, cur_vaddr
+            );
+            assert(0);
+            result = -1;
+            break;
+        }
+        put_pages(paddrs, valid);
+        assert(pt_valid(tables[0]) >= valid);
+        pt_valid(tables[0]) -= valid;
+        release_empty_tables(tables, 0, cur_vaddr, empty_tables);
+        done += count;
+    }
+    if (!empty_tables.empty()) {
+        pfree_batch(empty_tables.data(), empty_tables.size());
+    }
+    return result;
+}
+
+template <typename Trait, typename PMEM>
+void SV_supervisor<Trait, PMEM>::release_empty_tables(
+    const paddr_t tables[], int level, const vaddr_t vaddr, std::vector<paddr_t> &empty_tables
+) {
+    using VA = typename BITRANGE::VA;
+    // 自下而上检查，根页表本身不回收
+    for (; level < LEVELS - 1 && pt_valid(tables[level]) == 0; level++) {
+        const paddr_t parent_pte_addr =
+            tables[level + 1] + bits_extract(vaddr, VA::VPN[level + 1]) * sizeof(pte_t);
+        if (pmem->fill(parent_pte_addr, 0, sizeof(pte_t))) {
+            SPDLOG_LOGGER_ERROR(
+                logger, "SV failed to write PTE to PMEM at 0x{:x}", parent_pte_addr
+            );
+            assert(0);
+            return;
         }
+        empty_tables.push_back(tables[level]);
+        assert(pt_valid(tables[level + 1]) > 0);
+        pt_valid(tables[level + 1])--;
     }
-    assert(0); // should already return in the loop
+}
+
+template <typename Trait, typename PMEM>
+typename SV_supervisor<Trait, PMEM>::paddr_t SV_supervisor<Trait, PMEM>::palloc(
+    const uint8_t order
+) {
+    Stats::Timer timer(StatTimer::PAGE_ALLOC, 4);
+    paddr_t paddr = buddy.allocate(order);
+    if (paddr == 0) {
+        return 0;
+    }
+    Stats::add(StatCounter::PAGE_ALLOC);
+    if (pmem->alloc(paddr, 1ull << order)) {
+        SPDLOG_LOGGER_ERROR(logger, "SV PMEM refused to back pages at 0x{:x}", paddr);
+        buddy.free(paddr, order);
+        return 0;
+    }
+    return paddr;
+}
+
+template <typename Trait, typename PMEM>
+int SV_supervisor<Trait, PMEM>::palloc_batch(paddr_t paddrs[], const size_t count) {
+    Stats::Timer timer(StatTimer::PAGE_ALLOC, 4);
+    size_t got = buddy.allocate_batch(paddrs, count);
+    Stats::add(StatCounter::PAGE_ALLOC, got);
+    bool success = (got == count);
+    for (size_t i = 0; success && i < got; i++) {
+        if (pmem->alloc(paddrs[i], 1)) {
+            SPDLOG_LOGGER_ERROR(logger, "SV PMEM refused to back pages at 0x{:x}", paddrs[i]);
+            success = false;
+        }
+    }
+    if (success) {
+        return 0;
+    }
+    pfree_batch(paddrs, got);
     return -1;
 }
 
-template <typename Trait> void SV_supervisor<Trait>::assert_ptroot(pagetable_t ptroot) {
+template <typename Trait, typename PMEM>
+void SV_supervisor<Trait, PMEM>::pfree(
+    const paddr_t paddr, const uint8_t order, const bool cached
+) {
+    // 先归还后备存储再放回分配器，否则可能清掉其他线程刚分配到的页
+    if (pmem->free(paddr, 1ull << order)) {
+        SPDLOG_LOGGER_ERROR(logger, "SV PMEM failed to release pages at 0x{:x}", paddr);
+    }
+    if (m_rmap) {
+        for (uint64_t i = 0; i < (1ull << order); i++) {
+            m_rmap[paddr / PAGESIZE + i].store(0, std::memory_order_relaxed);
+        }
+    }
+    if (cached) {
+        buddy.free(paddr, order);
+    } else {
+        buddy.free_uncached(paddr, order);
+    }
+}
+
+template <typename Trait, typename PMEM>
+void SV_supervisor<Trait, PMEM>::put_page(const paddr_t paddr, const uint8_t order) {
+    std::atomic<uint32_t> &refs = page_refs(paddr);
+    uint32_t n = refs.load(std::memory_order_acquire);
+    while (n > 0 && !refs.compare_exchange_weak(n, n - 1, std::memory_order_acq_rel)) {
+    }
+    if (n == 0) {
+        pfree(paddr, order);
+    }
+}
+
+template <typename Trait, typename PMEM>
+void SV_supervisor<Trait, PMEM>::put_pages(paddr_t paddrs[], const size_t count) {
+    size_t nfree = 0;
+    for (size_t i = 0; i < count; i++) {
+        std::atomic<uint32_t> &refs = page_refs(paddrs[i]);
+        uint32_t n = refs.load(std::memory_order_acquire);
+        while (n > 0 && !refs.compare_exchange_weak(n, n - 1, std::memory_order_acq_rel)) {
+        }
+        if (n == 0) paddrs[nfree++] = paddrs[i];
+    }
+    pfree_batch(paddrs, nfree);
+}
+
+template <typename Trait, typename PMEM>
+void SV_supervisor<Trait, PMEM>::pfree_batch(const paddr_t paddrs[], const size_t count) {
+    // 物理上连续的页合并后一次通知PMEM
+    paddr_t run_start = 0;
+    size_t run_pages = 0;
+    for (size_t i = 0; i <= count; i++) {
+        if (i < count && run_pages > 0 && paddrs[i] == run_start + run_pages * PAGESIZE) {
+            run_pages++;
+            continue;
+        }
+        if (run_pages > 0 && pmem->free(run_start, run_pages)) {
+            SPDLOG_LOGGER_ERROR(logger, "SV PMEM failed to release pages at 0x{:x}", run_start);
+        }
+        if (i < count) {
+            run_start = paddrs[i];
+            run_pages = 1;
+        }
+    }
+    for (size_t i = 0; m_rmap && i < count; i++) {
+        m_rmap[paddrs[i] / PAGESIZE].store(0, std::memory_order_relaxed);
+    }
+    buddy.free_batch(paddrs, count);
+}
+
+template <typename Trait, typename PMEM>
+void SV_supervisor<Trait, PMEM>::assert_ptroot(pagetable_t ptroot) {
     assert(ptroot % PAGESIZE == 0);
-    assert(std::find(m_ptroots.begin(), m_ptroots.end(), ptroot) != m_ptroots.end());
+    assert(m_ptroots.count(ptroot) != 0);
     static_cast<void>(ptroot); // suppress unused variable warning
 }
 
+template <typename Trait, typename PMEM>
+uint64_t SV_supervisor<Trait, PMEM>::vma_find_free(
+    const AddressSpace &as, const uint64_t hint, const uint64_t len
+) {
+    // 先从hint向高地址查找，失败则从最低可用地址重新查找
+    for (uint64_t start : {hint, static_cast<uint64_t>(PAGESIZE)}) {
+        if (start >= VA_TOP) continue;
+        auto it = as.vmas.upper_bound(start);
+        if (it != as.vmas.begin() && std::prev(it)->second.end > start) {
+            start = std::prev(it)->second.end;
+        }
+        // 每次跳过一个VMA，而不是逐页探测
+        while (it != as.vmas.end() && it->first < start + len) {
+            start = it->second.end;
+            ++it;
+            Stats::add(StatCounter::MMAP_PROBE);
+        }
+        if (start + len <= VA_TOP) return start;
+    }
+    return 0;
+}
+
+template <typename Trait, typename PMEM>
+bool SV_supervisor<Trait, PMEM>::vma_covered(
+    const AddressSpace &as, const uint64_t start, const uint64_t end
+) {
+    auto it = as.vmas.upper_bound(start);
+    if (it == as.vmas.begin()) return false;
+    --it;
+    uint64_t pos = start;
+    while (pos < end) {
+        if (it == as.vmas.end() || it->first > pos || it->second.end <= pos) return false;
+        pos = it->second.end;
+        ++it;
+    }
+    return true;
+}
+
+template <typename Trait, typename PMEM>
+void SV_supervisor<Trait, PMEM>::vma_insert(AddressSpace &as, uint64_t start, VMA vma) {
+    assert(start < vma.end && vma.end <= VA_TOP);
+    auto next = as.vmas.lower_bound(start);
+    assert(next == as.vmas.end() || next->first >= vma.end);
+    // 与属性相同的相邻VMA合并，避免碎片化的区间拖慢查找
+    if (next != as.vmas.begin() && std::prev(next)->second.end == start &&
+        std::prev(next)->second.lazy == vma.lazy) {
+        auto prev = std::prev(next);
+        start = prev->first;
+        as.vmas.erase(prev);
+    }
+    if (next != as.vmas.end() && next->first == vma.end && next->second.lazy == vma.lazy) {
+        vma.end = next->second.end;
+        as.vmas.erase(next);
+    }
+    as.vmas.emplace(start, vma);
+}
+
+template <typename Trait, typename PMEM>
+void SV_supervisor<Trait, PMEM>::vma_remove(
+    AddressSpace &as, const uint64_t start, const uint64_t end
+) {
+    auto it = as.vmas.upper_bound(start);
+    if (it != as.vmas.begin()) --it;
+    while (it != as.vmas.end() && it->first < end) {
+        const uint64_t vma_start = it->first;
+        const VMA vma = it->second;
+        if (vma.end <= start) {
+            ++it;
+            continue;
+        }
+        it = as.vmas.erase(it);
+        if (vma_start < start) { // 保留头部
+            VMA head = vma;
+            head.end = start;
+            as.vmas.emplace(vma_start, head);
+        }
+        if (vma.end > end) { // 保留尾部
+            as.vmas.emplace(end, vma);
+        }
+    }
+}
+
+template <typename Trait, typename PMEM> int SV_supervisor<Trait, PMEM>::enable_reverse_map() {
+    std::lock_guard<std::mutex> shm_lock(m_shm_lock);
+    std::unique_lock<std::shared_mutex> lock(m_ptroots_lock);
+    if (m_rmap) {
+        return 0;
+    }
+    // 表项中根页表页号占用的位数有限，物理内存过大时无法表示
+    const uint64_t total_pages = pmem->m_size / PAGESIZE;
+    if (RMAP_VPN_BITS + 4 + std::bit_width(total_pages) > 64) {
+        SPDLOG_LOGGER_ERROR(
+            logger, "SV reverse map: PMEM of 0x{:x} bytes is too large", pmem->m_size
+        );
+        return -1;
+    }
+    m_rmap = std::make_unique<std::atomic<uint64_t>[]>(total_pages);
+    if (rmap_rebuild()) {
+        m_rmap.reset();
+        return -1;
+    }
+    return 0;
+}
+
+template <typename Trait, typename PMEM> int SV_supervisor<Trait, PMEM>::rmap_rebuild() {
+    for (uint64_t i = 0; i < pmem->m_size / PAGESIZE; i++) {
+        m_rmap[i].store(0, std::memory_order_relaxed);
+    }
+    // 先标记共享内存段的页，遍历页表时不再为它们记录映射
+    for (const auto &[shm, seg] : m_shms) {
+        for (paddr_t page : seg.pages) {
+            rmap_set(page, RMAP_SHM, 0, 0, 0);
+        }
+    }
+    for (const auto &[root, as] : m_ptroots) {
+        rmap_set(root, RMAP_TABLE, root, 0, LEVELS - 1);
+        if (rmap_build_one_level(root, root, LEVELS - 1, 0)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+template <typename Trait, typename PMEM>
+int SV_supervisor<Trait, PMEM>::rmap_build_one_level(
+    const pagetable_t root, const paddr_t ptaddr, const int level, const vaddr_t base
+) {
+    using PTE = typename BITRANGE::PTE;
+    using VA = typename BITRANGE::VA;
+    pte_t ptes[PTES_PER_TABLE];
+    if (pmem->read(ptaddr, ptes, PAGESIZE)) {
+        SPDLOG_LOGGER_ERROR(logger, "SV failed to get pagetable from PMEM 0x{:x}", ptaddr);
+        assert(0);
+        return -1;
+    }
+    for (size_t i = 0; i < PTES_PER_TABLE; i++) {
+        if (bits_extract(ptes[i], PTE::V) == 0) continue;
+        const vaddr_t vaddr = base + (i << VA::VPN[level].second);
+        const paddr_t paddr = pte_paddr(ptes[i]);
+        if (bits_extract(ptes[i], PTE::XWR)) {
+            // 写时复制共享的页保留最先遇到的映射
+            if (m_rmap[paddr / PAGESIZE].load(std::memory_order_relaxed) == RMAP_NONE) {
+                rmap_set(paddr, RMAP_LEAF, root, vaddr, level);
+            }
+            continue;
+        }
+        rmap_set(paddr, RMAP_TABLE, root, vaddr, level - 1);
+        if (rmap_build_one_level(root, paddr, level - 1, vaddr)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+template <typename Trait, typename PMEM>
+int SV_supervisor<Trait, PMEM>::reverse_map(
+    const paddr_t paddr, pagetable_t &ptroot, vaddr_t &vaddr
+) {
+    if (!m_rmap || paddr % PAGESIZE != 0 || paddr >= pmem->m_size) {
+        return -1;
+    }
+    const RmapEntry e = rmap_unpack(m_rmap[paddr / PAGESIZE].load(std::memory_order_relaxed));
+    if (e.kind != RMAP_LEAF) {
+        return -1;
+    }
+    std::shared_lock<std::shared_mutex> ptroots_lock(m_ptroots_lock);
+    for (bool retried = false;; retried = true) {
+        const uint64_t packed = m_rmap[paddr / PAGESIZE].load(std::memory_order_relaxed);
+        const RmapEntry e = rmap_unpack(packed);
+        if (e.kind != RMAP_LEAF) {
+            return -1;
+        }
+        auto as_it = m_ptroots.find(e.root);
+        if (as_it != m_ptroots.end()) {
+            std::lock_guard<std::mutex> as_lock(as_it->second.lock);
+            paddr_t pte_addr;
+            pte_t pte;
+            if (find_leaf(e.root, e.vaddr, pte_addr, pte) == e.level && pte_paddr(pte) == paddr) {
+                ptroot = e.root;
+                vaddr = e.vaddr;
+                return e.level;
+            }
+        }
+        if (retried || !rmap_reown(paddr, packed, 0)) {
+            return -1;
+        }
+    }
+}
+
+template <typename Trait, typename PMEM>
+bool SV_supervisor<Trait, PMEM>::rmap_reown(
+    const paddr_t paddr, const uint64_t packed, const pagetable_t locked_root
+) {
+    const RmapEntry e = rmap_unpack(packed);
+    // 写时复制的各共享者在相同的虚拟地址映射该页，逐个检查其他地址空间
+    for (auto &[root, as] : m_ptroots) {
+        if (root == e.root) continue;
+        std::unique_lock<std::mutex> as_lock(as.lock, std::defer_lock);
+        if (root != locked_root) {
+            if (locked_root == 0) {
+                as_lock.lock();
+            } else if (!as_lock.try_lock()) {
+                continue;
+            }
+        }
+        paddr_t pte_addr;
+        pte_t pte;
+        if (find_leaf(root, e.vaddr, pte_addr, pte) == e.level && pte_paddr(pte) == paddr) {
+            uint64_t expected = packed;
+            return m_rmap[paddr / PAGESIZE].compare_exchange_strong(
+                expected, rmap_pack(RMAP_LEAF, root, e.vaddr, e.level), std::memory_order_relaxed
+            );
+        }
+    }
+    return false;
+}
+
+template <typename Trait, typename PMEM>
+typename SV_supervisor<Trait, PMEM>::paddr_t SV_supervisor<Trait, PMEM>::migrate_page(
+    const paddr_t paddr
+) {
+    if (!m_rmap) {
+        SPDLOG_LOGGER_ERROR(logger, "SV migrate_page: reverse map is not enabled");
+        return 0;
+    }
+    if (paddr % PAGESIZE != 0 || paddr >= pmem->m_size) {
+        SPDLOG_LOGGER_ERROR(logger, "SV migrate_page: invalid physical address 0x{:x}", paddr);
+        return 0;
+    }
+    std::shared_lock<std::shared_mutex> ptroots_lock(m_ptroots_lock);
+    return migrate_one(paddr, 0, false);
+}
+
+template <typename Trait, typename PMEM>
+typename SV_supervisor<Trait, PMEM>::paddr_t SV_supervisor<Trait, PMEM>::migrate_one(
+    const paddr_t paddr, const pagetable_t locked_root, const bool keep_old
+) {
+    std::atomic<uint64_t> &entry = m_rmap[paddr / PAGESIZE];
+    for (bool retried = false;; retried = true) {
+        const uint64_t packed = entry.load(std::memory_order_relaxed);
+        const RmapEntry e = rmap_unpack(packed);
+        if (e.kind != RMAP_LEAF && (e.kind != RMAP_TABLE || e.level == LEVELS - 1)) {
+            SPDLOG_LOGGER_DEBUG(logger, "SV migrate_page: page 0x{:x} is not movable", paddr);
+            return 0;
+        }
+        auto as_it = m_ptroots.find(e.root);
+        if (as_it != m_ptroots.end()) {
+            std::unique_lock<std::mutex> as_lock(as_it->second.lock, std::defer_lock);
+            if (locked_root == 0) {
+                as_lock.lock();
+            } else if (e.root != locked_root && !as_lock.try_lock()) {
+                return 0;
+            }
+            // 加锁前该页可能已被释放并重新分配
+            if (entry.load(std::memory_order_relaxed) != packed) {
+                return 0;
+            }
+            if (e.kind == RMAP_TABLE) {
+                return migrate_table(paddr, e, keep_old);
+            }
+            paddr_t pte_addr;
+            pte_t pte;
+            if (find_leaf(e.root, e.vaddr, pte_addr, pte) == e.level && pte_paddr(pte) == paddr) {
+                return migrate_leaf(paddr, e, pte_addr, pte, keep_old);
+            }
+        }
+        // 记录的共享者已解除映射或建立了私有副本，改记仍映射该页的一方后重试
+        if (e.kind != RMAP_LEAF || retried || !rmap_reown(paddr, packed, locked_root)) {
+            return 0;
+        }
+    }
+}
+
+template <typename Trait, typename PMEM>
+typename SV_supervisor<Trait, PMEM>::paddr_t SV_supervisor<Trait, PMEM>::migrate_leaf(
+    const paddr_t paddr, const RmapEntry &e, const paddr_t pte_addr, pte_t pte, const bool keep_old
+) {
+    using PTE = typename BITRANGE::PTE;
+    using PA = typename BITRANGE::PA;
+    if (page_refs(paddr) > 0) {
+        SPDLOG_LOGGER_DEBUG(logger, "SV migrate_page: page 0x{:x} is shared", paddr);
+        return 0;
+    }
+    const uint8_t order = level_order(e.level);
+    const paddr_t new_paddr = palloc(order);
+    if (new_paddr == 0) {
+        return 0;
+    }
+    // 先收回写权限再复制：复制期间的写入进入缺页处理，等待本地址空间的锁释放后写入新页
+    const uint64_t writable = bits_extract(pte, PTE::W);
+    if (cas_pte(pte_addr, pte, [](pte_t cur) { return bits_set(0, PTE::W, cur); })) {
+        pfree(new_paddr, order);
+        return 0;
+    }
+    this->sfence_vma(e.root, e.vaddr, PAGESIZE << order);
+    if (copy_pages(new_paddr, paddr, 1ull << order)) {
+        cas_pte(pte_addr, pte, [&](pte_t cur) { return bits_set(writable, PTE::W, cur); });
+        pfree(new_paddr, order);
+        return 0;
+    }
+    if (cas_pte(pte_addr, pte, [&](pte_t cur) {
+            const uint64_t moved =
+                bits_set(bits_extract(new_paddr, PA::PPNFULL), PTE::PPNFULL, cur);
+            return bits_set(writable, PTE::W, moved);
+        })) {
+        pfree(new_paddr, order);
+        return 0;
+    }
+    rmap_set(new_paddr, RMAP_LEAF, e.root, e.vaddr, e.level);
+    if (!keep_old) pfree(paddr, order);
+    this->sfence_vma(e.root, e.vaddr, PAGESIZE << order);
+    return new_paddr;
+}
+
+template <typename Trait, typename PMEM>
+typename SV_supervisor<Trait, PMEM>::paddr_t SV_supervisor<Trait, PMEM>::migrate_table(
+    const paddr_t paddr, const RmapEntry &e, const bool keep_old
+) {
+    using PTE = typename BITRANGE::PTE;
+    using VA = typename BITRANGE::VA;
+    const paddr_t parent = walk_to_table(e.root, e.vaddr, e.level + 1, false);
+    if (parent == 0) {
+        return 0;
+    }
+    const paddr_t pte_addr = parent + bits_extract(e.vaddr, VA::VPN[e.level + 1]) * sizeof(pte_t);
+    pte_t pte;
+    if (pmem->read(pte_addr, &pte, sizeof(pte_t))) {
+        SPDLOG_LOGGER_ERROR(logger, "SV failed to get PTE from PMEM 0x{:x}", pte_addr);
+        assert(0);
+        return 0;
+    }
+    if (bits_extract(pte, PTE::V) == 0 || bits_extract(pte, PTE::XWR) || pte_paddr(pte) != paddr) {
+        return 0;
+    }
+    const paddr_t new_paddr = palloc(0);
+    if (new_paddr == 0) {
+        return 0;
+    }
+    // TLB只缓存最终的翻译结果，改写上级PTE后无需刷新
+    pte_t ptes[PTES_PER_TABLE];
+    if (pmem->read(paddr, ptes, PAGESIZE) || pmem->write(new_paddr, ptes, PAGESIZE) ||
+        cas_pte(pte_addr, pte, [&](pte_t) { return table_pte(new_paddr); })) {
+        SPDLOG_LOGGER_ERROR(logger, "SV failed to move pagetable at PMEM 0x{:x}", paddr);
+        assert(0);
+        pfree(new_paddr, 0);
+        return 0;
+    }
+    // 复制之后仍可能有访问者经原页表设置叶子的A/D位：清除原页表中叶子的V位，
+    // 使此后迟到的设置比较失败并重新查找，再把被替换值中新置的A/D位并入新页表
+    const uint64_t ad = bits_set(1, PTE::A, bits_set(1, PTE::D));
+    for (size_t i = 0; i < PTES_PER_TABLE; i++) {
+        if (bits_extract(ptes[i], PTE::V) == 0 || bits_extract(ptes[i], PTE::XWR) == 0) continue;
+        pte_t old = ptes[i], cur = ptes[i];
+        const auto invalid = [](pte_t v) { return bits_set(0, PTE::V, v); };
+        if (cas_pte(paddr + i * sizeof(pte_t), old, invalid) || old == ptes[i]) {
+            continue;
+        }
+        cas_pte(new_paddr + i * sizeof(pte_t), cur, [&](pte_t v) { return v | (old & ad); });
+    }
+    pt_valid(new_paddr) = pt_valid(paddr);
+    pt_valid(paddr) = 0;
+    rmap_set(new_paddr, RMAP_TABLE, e.root, e.vaddr, e.level);
+    if (!keep_old) pfree(paddr, 0);
+    return new_paddr;
+}
+
+template <typename Trait, typename PMEM>
+int SV_supervisor<Trait, PMEM>::compact(const uint8_t order) {
+    if (!m_rmap) {
+        SPDLOG_LOGGER_ERROR(logger, "SV compact: reverse map is not enabled");
+        return -1;
+    }
+    std::shared_lock<std::shared_mutex> ptroots_lock(m_ptroots_lock);
+    return compact_locked(order, 0);
+}
+
+template <typename Trait, typename PMEM>
+int SV_supervisor<Trait, PMEM>::compact_locked(const uint8_t order, const pagetable_t locked_root) {
+    if (!m_rmap || order >= buddy.get_free_counts().size()) {
+        return -1;
+    }
+    if (buddy.largest_free_order() >= order) {
+        return 0;
+    }
+    // 按对齐区域汇总空闲块，空闲页最多的区域需要迁出的页最少，优先尝试
+    struct Region {
+        uint64_t free_pages;
+        size_t first, count; // 区域中的空闲块在blocks中的范围
+    };
+    const auto blocks = buddy.get_free_blocks();
+    const uint64_t region_size = PAGESIZE << order;
+    std::vector<Region> regions;
+    for (size_t i = 0; i < blocks.size();) {
+        const uint64_t base = blocks[i].page_base - blocks[i].page_base % region_size;
+        Region r = {0, i, 0};
+        for (; i < blocks.size() && blocks[i].page_base < base + region_size; i++) {
+            r.free_pages += 1ull << blocks[i].order;
+            r.count++;
+        }
+        if (base + region_size <= pmem->m_size) regions.push_back(r);
+    }
+    std::sort(regions.begin(), regions.end(), [](const Region &a, const Region &b) {
+        return a.free_pages > b.free_pages;
+    });
+    for (const Region &r : regions) {
+        const uint64_t base = blocks[r.first].page_base - blocks[r.first].page_base % region_size;
+        if (compact_region(base, order, &blocks[r.first], r.count, locked_root) == 0 &&
+            buddy.largest_free_order() >= order) {
+            return 0;
+        }
+    }
+    SPDLOG_LOGGER_DEBUG(logger, "SV compact: failed to assemble a free block of order {}", order);
+    return -1;
+}
+
+template <typename Trait, typename PMEM>
+int SV_supervisor<Trait, PMEM>::compact_region(
+    const paddr_t base, const uint8_t order, const typename PageCache<PAGESIZE>::FreeBlock blocks[],
+    const size_t count, const pagetable_t locked_root
+) {
+    // 区域中不是空闲块的页都须可以移动，否则放弃该区域。
+    // 其他线程magazine中缓存的块没有反向映射，也不在blocks中，从magazine中取出后视为空闲；
+    // 取得blocks之后才释放回buddy的页同样直接预留
+    std::vector<paddr_t> used;
+    std::vector<typename PageCache<PAGESIZE>::FreeBlock> taken;
+    bool ok = true;
+    size_t b = 0;
+    for (paddr_t page = base; ok && page < base + (PAGESIZE << order);) {
+        if (b < count && blocks[b].page_base == page) {
+            page += PAGESIZE << blocks[b++].order;
+            continue;
+        }
+        const RmapEntry e = rmap_unpack(m_rmap[page / PAGESIZE].load(std::memory_order_relaxed));
+        if (e.kind == RMAP_NONE && page_refs(page) == 0) {
+            const int cached = buddy.take_cached(page);
+            if (cached >= 0 || buddy.allocate_at(page, 0) == 0) {
+                const uint8_t blk_order = cached >= 0 ? cached : 0;
+                taken.push_back({page, blk_order});
+                page += PAGESIZE << blk_order;
+                continue;
+            }
+        }
+        const bool movable = (e.kind == RMAP_LEAF && e.level == 0) ||
+                             (e.kind == RMAP_TABLE && e.level < LEVELS - 1);
+        ok = movable && page_refs(page) == 0;
+        used.push_back(page);
+        page += PAGESIZE;
+    }
+    // 先预留区域中的空闲块，迁移的目标页就不会落在区域内；迁出的原页也先不释放
+    size_t claimed = 0;
+    while (ok && claimed < count &&
+           buddy.allocate_at(blocks[claimed].page_base, blocks[claimed].order) == 0) {
+        claimed++;
+    }
+    ok = ok && claimed == count;
+    size_t moved = 0;
+    while (ok && moved < used.size() && migrate_one(used[moved], locked_root, true)) {
+        moved++;
+    }
+    // 不经过页缓存直接归还，使它们立即合并为整块
+    for (size_t i = 0; i < moved; i++) {
+        pfree(used[i], 0, false);
+    }
+    for (size_t i = 0; i < claimed; i++) {
+        buddy.free_uncached(blocks[i].page_base, blocks[i].order);
+    }
+    for (const auto &blk : taken) {
+        buddy.free_uncached(blk.page_base, blk.order);
+    }
+    return (ok && moved == used.size()) ? 0 : -1;
+}
+
+template <typename Trait, typename PMEM> int SV_supervisor<Trait, PMEM>::save(const int fd) {
+    // 先等待在锁外分配或释放物理页的操作完成；
+    // 锁顺序与shm_map相同，独占m_ptroots_lock使所有地址空间在保存期间保持不变
+    std::unique_lock<std::shared_mutex> op_lock(m_op_lock);
+    std::lock_guard<std::mutex> shm_lock(m_shm_lock);
+    std::unique_lock<std::shared_mutex> lock(m_ptroots_lock);
+    const uint64_t total_pages = pmem->m_size / PAGESIZE;
+
+    // 在用的物理页即空闲块之间的部分（0号页除外）
+    std::vector<uint64_t> frees, refs, pt_valids, runs;
+    uint64_t next = 1;
+    for (const auto &blk : buddy.get_free_blocks()) {
+        const uint64_t idx = blk.page_base / PAGESIZE;
+        frees.push_back((idx << 8) | blk.order);
+        if (idx > next) runs.insert(runs.end(), {next, idx - next});
+        next = idx + (1ull << blk.order);
+    }
+    if (next < total_pages) runs.insert(runs.end(), {next, total_pages - next});
+    for (uint64_t i = 0; i < total_pages; i++) {
+        if (const uint32_t n = m_page_refs[i].load()) refs.push_back((i << 32) | n);
+        if (m_pt_valid[i]) pt_valids.push_back((i << 32) | m_pt_valid[i]);
+    }
+
+    SnapshotHeader hdr = {};
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.levels = LEVELS;
+    hdr.pagesize = PAGESIZE;
+    hdr.pmem_size = pmem->m_size;
+    hdr.vpage_usage = m_vpage_usage;
+    hdr.next_shm = m_next_shm;
+    hdr.n_free = frees.size();
+    hdr.n_refs = refs.size();
+    hdr.n_pt_valid = pt_valids.size();
+    hdr.n_roots = m_ptroots.size();
+    hdr.n_shms = m_shms.size();
+    hdr.n_runs = runs.size() / 2;
+    uint64_t meta = sizeof(hdr) + (frees.size() + refs.size() + pt_valids.size() + runs.size()) *
+                                      sizeof(uint64_t);
+    for (const auto &[root, as] : m_ptroots) {
+        meta += (2 + 3 * as.vmas.size()) * sizeof(uint64_t);
+    }
+    for (const auto &[shm, seg] : m_shms) {
+        meta += (2 + seg.pages.size()) * sizeof(uint64_t);
+    }
+    hdr.data_offset = (meta + PAGESIZE - 1) / PAGESIZE * PAGESIZE;
+
+    SnapshotWriter out(fd);
+    out.put(&hdr, sizeof(hdr));
+    out.put_vec(frees);
+    out.put_vec(refs);
+    out.put_vec(pt_valids);
+    for (const auto &[root, as] : m_ptroots) {
+        out.put_u64(root);
+        out.put_u64(as.vmas.size());
+        for (const auto &[start, vma] : as.vmas) {
+            out.put_u64(start);
+            out.put_u64(vma.end);
+            out.put_u64(vma.lazy);
+        }
+    }
+    for (const auto &[shm, seg] : m_shms) {
+        out.put_u64(shm);
+        out.put_u64(seg.pages.size());
+        out.put_vec(seg.pages);
+    }
+    out.put_vec(runs);
+    assert(out.pos() == meta);
+    out.pad_to(hdr.data_offset);
+    if (!out.flush()) {
+        SPDLOG_LOGGER_ERROR(logger, "SV save: failed to write snapshot metadata");
+        return -1;
+    }
+    for (size_t i = 0; i < runs.size(); i += 2) {
+        if (pmem->save_range(runs[i] * PAGESIZE, runs[i + 1] * PAGESIZE, fd)) {
+            SPDLOG_LOGGER_ERROR(
+                logger, "SV save: failed to write pages at PMEM 0x{:x}", runs[i] * PAGESIZE
+            );
+            return -1;
+        }
+    }
+    return 0;
+}
+
+template <typename Trait, typename PMEM> int SV_supervisor<Trait, PMEM>::load(const int fd) {
+    std::unique_lock<std::shared_mutex> op_lock(m_op_lock);
+    std::lock_guard<std::mutex> shm_lock(m_shm_lock);
+    std::unique_lock<std::shared_mutex> lock(m_ptroots_lock);
+    if (!m_ptroots.empty() || !m_shms.empty() || buddy.get_usage() != 0) {
+        SPDLOG_LOGGER_ERROR(logger, "SV load: supervisor is already in use");
+        return -1;
+    }
+    const off_t start = lseek(fd, 0, SEEK_CUR);
+    if (start < 0) {
+        SPDLOG_LOGGER_ERROR(logger, "SV load: snapshot must be a regular file");
+        return -1;
+    }
+    const uint64_t total_pages = pmem->m_size / PAGESIZE;
+    SnapshotReader in(fd, start);
+    SnapshotHeader hdr;
+    if (!in.get(&hdr, sizeof(hdr)) || memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) ||
+        hdr.version != SNAPSHOT_VERSION || hdr.levels != LEVELS || hdr.pagesize != PAGESIZE ||
+        hdr.pmem_size != pmem->m_size || hdr.data_offset % PAGESIZE != 0) {
+        SPDLOG_LOGGER_ERROR(logger, "SV load: not a compatible snapshot");
+        return -1;
+    }
+    std::vector<uint64_t> frees, refs, pt_valids, runs;
+    // 各数组都位于data_offset之前，据此在分配内存前排除损坏的计数
+    struct stat st;
+    const uint64_t max_count = hdr.data_offset / sizeof(uint64_t);
+    if (fstat(fd, &st) || static_cast<uint64_t>(st.st_size) < start + hdr.data_offset ||
+        hdr.n_free + hdr.n_refs + hdr.n_pt_valid + hdr.n_runs > max_count) {
+        goto RET_TRUNCATED;
+    }
+    if (!in.get_vec(frees, hdr.n_free) || !in.get_vec(refs, hdr.n_refs) ||
+        !in.get_vec(pt_valids, hdr.n_pt_valid)) {
+        goto RET_TRUNCATED;
+    }
+    {
+        // 先完整读入并检查所有元数据，之后才修改本对象
+        std::vector<typename decltype(buddy)::FreeBlock> blocks;
+        for (uint64_t f : frees) {
+            const uint64_t idx = f >> 8;
+            const uint8_t order = f & 0xff;
+            if (idx == 0 || order > buddy_max_order(total_pages) || idx % (1ull << order) != 0 ||
+                idx + (1ull << order) > total_pages) {
+                goto RET_CORRUPT;
+            }
+            blocks.push_back({idx * PAGESIZE, order});
+        }
+        for (uint64_t v : refs) {
+            if ((v >> 32) >= total_pages) goto RET_CORRUPT;
+        }
+        for (uint64_t v : pt_valids) {
+            if ((v >> 32) >= total_pages || (v & 0xffffffff) > PTES_PER_TABLE) goto RET_CORRUPT;
+        }
+        std::map<pagetable_t, std::map<vaddr_t, VMA>> roots;
+        for (uint64_t i = 0; i < hdr.n_roots; i++) {
+            uint64_t root, nvma;
+            std::vector<uint64_t> vmas;
+            if (!in.get_u64(root) || !in.get_u64(nvma) || nvma > max_count ||
+                !in.get_vec(vmas, 3 * nvma)) {
+                goto RET_TRUNCATED;
+            }
+            if (root == 0 || root % PAGESIZE != 0 || root >= pmem->m_size) goto RET_CORRUPT;
+            auto &dst = roots[root];
+            for (size_t k = 0; k < vmas.size(); k += 3) {
+                if (vmas[k] >= vmas[k + 1] || vmas[k + 1] > VA_TOP) goto RET_CORRUPT;
+                dst.emplace_hint(dst.end(), vmas[k], VMA{vmas[k + 1], vmas[k + 2] != 0});
+            }
+        }
+        std::map<shm_t, ShmSegment> shms;
+        for (uint64_t i = 0; i < hdr.n_shms; i++) {
+            uint64_t shm, npages;
+            ShmSegment seg;
+            if (!in.get_u64(shm) || !in.get_u64(npages) || npages > max_count ||
+                !in.get_vec(seg.pages, npages)) {
+                goto RET_TRUNCATED;
+            }
+            if (shm == 0 || shm >= hdr.next_shm) goto RET_CORRUPT;
+            for (paddr_t page : seg.pages) {
+                if (page == 0 || page % PAGESIZE != 0 || page >= pmem->m_size) goto RET_CORRUPT;
+            }
+            if (!shms.emplace(shm, std::move(seg)).second) goto RET_CORRUPT;
+        }
+        if (!in.get_vec(runs, 2 * hdr.n_runs)) {
+            goto RET_TRUNCATED;
+        }
+        uint64_t data_size = 0;
+        for (size_t i = 0; i < runs.size(); i += 2) {
+            if (runs[i] == 0 || runs[i] + runs[i + 1] > total_pages) goto RET_CORRUPT;
+            data_size += runs[i + 1] * PAGESIZE;
+        }
+        // 映射超出文件末尾的部分在访问时会出错，必须事先检查
+        if (static_cast<uint64_t>(st.st_size) < start + hdr.data_offset + data_size) {
+            goto RET_TRUNCATED;
+        }
+
+        buddy.set_free_blocks(blocks);
+        for (uint64_t v : refs) {
+            m_page_refs[v >> 32] = v & 0xffffffff;
+        }
+        for (uint64_t v : pt_valids) {
+            m_pt_valid[v >> 32] = v & 0xffffffff;
+        }
+        for (auto &[root, vmas] : roots) {
+            m_ptroots.try_emplace(root).first->second.vmas = std::move(vmas);
+        }
+        m_shms = std::move(shms);
+        m_next_shm = hdr.next_shm;
+        m_vpage_usage = hdr.vpage_usage;
+    }
+
+    {
+        // 物理页数据：每段在快照中紧接前一段
+        uint64_t offset = start + hdr.data_offset;
+        for (size_t i = 0; i < runs.size(); i += 2) {
+            const paddr_t addr = runs[i] * PAGESIZE;
+            const size_t size = runs[i + 1] * PAGESIZE;
+            if (pmem->alloc(addr, runs[i + 1]) || pmem->load_range(addr, fd, offset, size)) {
+                SPDLOG_LOGGER_ERROR(logger, "SV load: failed to load pages at PMEM 0x{:x}", addr);
+                return -1;
+            }
+            offset += size;
+        }
+        lseek(fd, static_cast<off_t>(offset), SEEK_SET);
+    }
+    this->sfence_vma();
+    return m_rmap ? rmap_rebuild() : 0;
+
+RET_TRUNCATED:
+    SPDLOG_LOGGER_ERROR(logger, "SV load: snapshot is truncated");
+    return -1;
+RET_CORRUPT:
+    SPDLOG_LOGGER_ERROR(logger, "SV load: snapshot is corrupted");
+    return -1;
+}
+
 #include "sv32.hpp"
 template class SV_supervisor<SV32_Trait>;
+template class SV_supervisor<SV32_Trait, PhysicalMemoryBasicSim>;
 
 #include "sv39.hpp"
 template class SV_supervisor<SV39_Trait>;
+template class SV_supervisor<SV39_Trait, PhysicalMemoryBasicSim>;
@@ -0,0 +1,372 @@
+#include "sv_trace.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace {
+
+constexpr char TRACE_MAGIC[8] = {'M', 'B', 'O', 'X', 'T', 'R', 'C', 'E'};
+constexpr uint32_t TRACE_VERSION = 2;
+
+struct TraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t levels;
+    uint64_t pagesize;
+};
+
+// 操作码中操作之外的标志位；结束标记占用操作部分的最大值
+constexpr uint8_t OP_MASK = 0x0f, OP_FAILED = 0x10, OP_LAZY = 0x20, OP_END = OP_MASK;
+// 重放READ/WRITE时每次memcpy的最大字节数，即缓冲区的上限
+constexpr uint64_t MAX_CHUNK = 64ull << 20;
+
+void put_varint(std::vector<uint8_t> &buf, uint64_t value) {
+    while (value >= 0x80) {
+        buf.push_back(static_cast<uint8_t>(value) | 0x80);
+        value >>= 7;
+    }
+    buf.push_back(static_cast<uint8_t>(value));
+}
+
+uint64_t zigzag(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+int64_t unzigzag(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+// 带缓冲的顺序读取，可以读取管道
+class TraceReader {
+public:
+    explicit TraceReader(int fd) : m_fd(fd) {}
+    // 读取size字节，数据不足时返回false
+    bool get(void *data, size_t size) {
+        uint8_t *p = static_cast<uint8_t *>(data);
+        for (size_t i = 0; i < size; i++) {
+            if (!get_byte(p[i])) return false;
+        }
+        return true;
+    }
+    bool get_byte(uint8_t &byte) {
+        if (m_pos == m_len && !fill()) return false;
+        byte = m_buf[m_pos++];
+        return true;
+    }
+    bool get_varint(uint64_t &value) {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            uint8_t byte;
+            if (!get_byte(byte)) return false;
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) return true;
+        }
+        return false; // 超过10字节，格式错误
+    }
+    bool error() const { return m_error; }
+
+private:
+    int m_fd;
+    uint8_t m_buf[1 << 16];
+    size_t m_pos = 0, m_len = 0;
+    bool m_error = false;
+
+    bool fill() {
+        ssize_t n;
+        while ((n = read(m_fd, m_buf, sizeof(m_buf))) < 0 && errno == EINTR) {
+        }
+        if (n < 0) m_error = true;
+        m_pos = 0;
+        m_len = n > 0 ? static_cast<size_t>(n) : 0;
+        return m_len > 0;
+    }
+};
+
+} // namespace
+
+const char *TraceStats::op_name(TraceOp op) {
+    static const char *const names[] = {"create", "destroy", "mmap", "munmap", "read", "write"};
+    return names[static_cast<size_t>(op)];
+}
+
+std::string TraceStats::to_json() const {
+    std::string json = fmt::format(
+        "{{\"ops\": {}, \"seconds\": {:.6f}, \"ops_per_sec\": {:.0f}, \"mismatches\": {}, "
+        "\"latency_ns\": {}, \"by_op\": {{",
+        ops, seconds, ops_per_sec(), mismatches, latency.to_json()
+    );
+    bool first = true;
+    for (size_t i = 0; i < static_cast<size_t>(TraceOp::NUM); i++) {
+        if (op_latency[i].count() == 0) continue;
+        json += fmt::format(
+            "{}\"{}\": {}", first ? "" : ", ", op_name(static_cast<TraceOp>(i)),
+            op_latency[i].to_json()
+        );
+        first = false;
+    }
+    return json + "}}";
+}
+
+template <typename Trait, typename PMEM>
+SV_trace_recorder<Trait, PMEM>::SV_trace_recorder(
+    SV_supervisor<Trait, PMEM> &sv_, SV_basic<Trait, PMEM> &mmu_, int fd,
+    std::shared_ptr<spdlog::logger> logger_
+)
+    : sv(sv_), mmu(mmu_), logger(logger_ ? logger_ : spdlog::default_logger()), m_fd(fd) {
+    TraceHeader hdr = {};
+    std::memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.levels = SV_basic<Trait, PMEM>::LEVELS;
+    hdr.pagesize = SV_basic<Trait, PMEM>::PAGESIZE;
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(&hdr);
+    m_buf.assign(p, p + sizeof(hdr));
+}
+
+template <typename Trait, typename PMEM> int SV_trace_recorder<Trait, PMEM>::flush() {
+    std::lock_guard<std::mutex> lock(m_lock);
+    // 记录数相同时已有结束标记，无需重复
+    if (m_sealed != m_records) {
+        m_buf.push_back(OP_END);
+        put_varint(m_buf, m_records);
+        m_sealed = m_records;
+    }
+    return write_out();
+}
+
+template <typename Trait, typename PMEM> int SV_trace_recorder<Trait, PMEM>::write_out() {
+    if (m_ok && !m_buf.empty() &&
+        PhysicalMemoryInterface::write_fd(m_fd, m_buf.data(), m_buf.size())) {
+        SPDLOG_LOGGER_ERROR(logger, "SV trace: failed to write trace records");
+        m_ok = false;
+    }
+    m_buf.clear();
+    return m_ok ? 0 : -1;
+}
+
+template <typename Trait, typename PMEM>
+void SV_trace_recorder<Trait, PMEM>::record(
+    const TraceOp op, const bool failed, const pagetable_t root, const vaddr_t vaddr,
+    const size_t size, const vaddr_t result, const bool lazy
+) {
+    constexpr size_t PAGESIZE = SV_basic<Trait, PMEM>::PAGESIZE;
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_buf.push_back(
+        static_cast<uint8_t>(op) | (failed ? OP_FAILED : 0) | (lazy ? OP_LAZY : 0)
+    );
+    put_varint(m_buf, root / PAGESIZE);
+    if (op != TraceOp::CREATE && op != TraceOp::DESTROY) {
+        put_varint(m_buf, zigzag(static_cast<int64_t>(uint64_t{vaddr} - m_prev_vaddr)));
+        put_varint(m_buf, size);
+        m_prev_vaddr = vaddr;
+    }
+    if (op == TraceOp::MMAP) {
+        put_varint(m_buf, zigzag(static_cast<int64_t>(uint64_t{result} - vaddr)));
+    }
+    m_records++;
+    // 缓冲区满时只写出记录，不加结束标记，在此截断的轨迹仍会被识别出来
+    if (m_buf.size() >= (1 << 16)) write_out();
+}
+
+template <typename Trait, typename PMEM>
+typename SV_trace_recorder<Trait, PMEM>::pagetable_t
+SV_trace_recorder<Trait, PMEM>::create_pagetable() {
+    pagetable_t root = sv.create_pagetable();
+    record(TraceOp::CREATE, root == 0, root);
+    return root;
+}
+
+template <typename Trait, typename PMEM>
+int SV_trace_recorder<Trait, PMEM>::destroy_pagetable(const pagetable_t root) {
+    int result = sv.destroy_pagetable(root);
+    mmu.sfence_vma(root);
+    record(TraceOp::DESTROY, result != 0, root);
+    return result;
+}
+
+template <typename Trait, typename PMEM>
+typename SV_trace_recorder<Trait, PMEM>::vaddr_t SV_trace_recorder<Trait, PMEM>::mmap(
+    const pagetable_t root, const vaddr_t vaddr, const size_t size, const bool lazy
+) {
+    vaddr_t result = sv.mmap(root, vaddr, size, lazy);
+    record(TraceOp::MMAP, result == 0, root, vaddr, size, result, lazy);
+    return result;
+}
+
+template <typename Trait, typename PMEM>
+int SV_trace_recorder<Trait, PMEM>::munmap(
+    const pagetable_t root, const vaddr_t vaddr, const size_t size
+) {
+    int result = sv.munmap(root, vaddr, size);
+    mmu.sfence_vma(root, vaddr, size);
+    record(TraceOp::MUNMAP, result != 0, root, vaddr, size);
+    return result;
+}
+
+template <typename Trait, typename PMEM>
+typename SV_trace_recorder<Trait, PMEM>::vaddr_t SV_trace_recorder<Trait, PMEM>::memcpy(
+    const pagetable_t root, const vaddr_t dst, const void *src, const size_t size
+) {
+    vaddr_t result = mmu.memcpy(root, dst, src, size);
+    record(TraceOp::WRITE, result == 0, root, dst, size);
+    return result;
+}
+
+template <typename Trait, typename PMEM>
+void *SV_trace_recorder<Trait, PMEM>::memcpy(
+    const pagetable_t root, void *dst, const vaddr_t src, const size_t size
+) {
+    void *result = mmu.memcpy(root, dst, src, size);
+    record(TraceOp::READ, result == nullptr, root, src, size);
+    return result;
+}
+
+template <typename Trait, typename PMEM>
+int SV_trace_replayer<Trait, PMEM>::replay(const int fd, TraceStats &stats) {
+    using Clock = std::chrono::steady_clock;
+    constexpr size_t PAGESIZE = SV_basic<Trait, PMEM>::PAGESIZE;
+    stats = TraceStats();
+    TraceReader in(fd);
+    TraceHeader hdr;
+    if (!in.get(&hdr, sizeof(hdr)) || std::memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) ||
+        hdr.version != TRACE_VERSION) {
+        SPDLOG_LOGGER_ERROR(logger, "SV trace: not a trace file");
+        return -1;
+    }
+    if (hdr.levels != SV_basic<Trait, PMEM>::LEVELS || hdr.pagesize != PAGESIZE) {
+        SPDLOG_LOGGER_ERROR(
+            logger, "SV trace: trace recorded with {} levels cannot be replayed here", hdr.levels
+        );
+        return -1;
+    }
+    std::unordered_map<uint64_t, pagetable_t> roots; // 记录时的根页表页号 -> 重放时的根页表
+    std::vector<uint8_t> data;
+    uint64_t prev_vaddr = 0, records = 0;
+    bool sealed = false; // 读到的最后一项是记录数相符的结束标记
+    int result = 0;
+    uint8_t code;
+    while (in.get_byte(code)) {
+        if (code == OP_END) {
+            uint64_t count;
+            if (!in.get_varint(count) || count != records) {
+                result = -1;
+                break;
+            }
+            sealed = true;
+            continue;
+        }
+        sealed = false;
+        records++;
+        const TraceOp op = static_cast<TraceOp>(code & OP_MASK);
+        const bool failed = code & OP_FAILED;
+        uint64_t root_ppn, delta = 0, size = 0, mapped = 0;
+        if (op >= TraceOp::NUM || !in.get_varint(root_ppn)) {
+            result = -1;
+            break;
+        }
+        if (op != TraceOp::CREATE && op != TraceOp::DESTROY) {
+            if (!in.get_varint(delta) || !in.get_varint(size)) {
+                result = -1;
+                break;
+            }
+            prev_vaddr += unzigzag(delta);
+        }
+        if (op == TraceOp::MMAP && !in.get_varint(mapped)) {
+            result = -1;
+            break;
+        }
+        const auto vaddr = static_cast<typename SV_basic<Trait, PMEM>::vaddr_t>(prev_vaddr);
+        if ((op == TraceOp::READ || op == TraceOp::WRITE) && size > sv.pmem->m_size) {
+            result = -1; // 不可能成功的大小
+            break;
+        }
+        // 缓冲区不超过MAX_CHUNK，更大的访问分段重放，损坏的大小不会导致分配大量内存
+        if (data.size() < std::min(size, MAX_CHUNK)) data.resize(std::min(size, MAX_CHUNK));
+
+        pagetable_t root = 0;
+        if (op != TraceOp::CREATE) {
+            auto it = roots.find(root_ppn);
+            if (it == roots.end()) {
+                // 记录时创建失败的根页表，其后的操作无法重放
+                stats.mismatches++;
+                continue;
+            }
+            root = it->second;
+        }
+        bool ok;
+        const auto start = Clock::now();
+        switch (op) {
+        case TraceOp::CREATE:
+            root = sv.create_pagetable();
+            ok = root != 0;
+            break;
+        case TraceOp::DESTROY:
+            ok = sv.destroy_pagetable(root) == 0;
+            break;
+        case TraceOp::MMAP: {
+            const auto got = sv.mmap(root, vaddr, size, code & OP_LAZY);
+            ok = got != 0;
+            if (ok && !failed && got != static_cast<decltype(got)>(vaddr + unzigzag(mapped))) {
+                stats.mismatches++;
+            }
+            break;
+        }
+        case TraceOp::MUNMAP:
+            ok = sv.munmap(root, vaddr, size) == 0;
+            break;
+        default:
+            ok = true;
+            for (uint64_t off = 0; ok && off < size; off += MAX_CHUNK) {
+                const size_t len = std::min(size - off, MAX_CHUNK);
+                if (op == TraceOp::READ) {
+                    ok = mmu.memcpy(root, data.data(), vaddr + off, len) != nullptr;
+                } else {
+                    ok = mmu.memcpy(root, vaddr + off, data.data(), len) != 0;
+                }
+            }
+            break;
+        }
+        const uint64_t ns = std::chrono::nanoseconds(Clock::now() - start).count();
+        // 页表变化后MMU的TLB需要刷新，不计入操作的延迟
+        if (op == TraceOp::DESTROY || op == TraceOp::MUNMAP) {
+            mmu.sfence_vma(root);
+        }
+        if (op == TraceOp::CREATE && ok) {
+            if (failed) {
+                sv.destroy_pagetable(root);
+            } else {
+                roots[root_ppn] = root;
+            }
+        }
+        if (op == TraceOp::DESTROY && ok) {
+            roots.erase(root_ppn);
+        }
+        if (ok == failed) stats.mismatches++;
+        stats.ops++;
+        stats.seconds += ns * 1e-9;
+        stats.latency.add(ns);
+        stats.op_latency[static_cast<size_t>(op)].add(ns);
+    }
+    if (result || in.error() || !sealed) {
+        SPDLOG_LOGGER_ERROR(logger, "SV trace: trace is corrupted or truncated");
+        result = -1;
+    }
+    for (const auto &[ppn, root] : roots) {
+        sv.destroy_pagetable(root);
+        mmu.sfence_vma(root);
+    }
+    return result;
+}
+
+#include "sv32.hpp"
+template class SV_trace_recorder<SV32_Trait>;
+template class SV_trace_recorder<SV32_Trait, PhysicalMemoryBasicSim>;
+template class SV_trace_replayer<SV32_Trait>;
+template class SV_trace_replayer<SV32_Trait, PhysicalMemoryBasicSim>;
+
+#include "sv39.hpp"
+template class SV_trace_recorder<SV39_Trait>;
+template class SV_trace_replayer<SV39_Trait>;
+template class SV_trace_recorder<SV39_Trait, PhysicalMemoryBasicSim>;
+template class SV_trace_replayer<SV39_Trait, PhysicalMemoryBasicSim>;
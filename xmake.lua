@@ -5,12 +5,22 @@ add_requires("spdlog", "fmt")
 -- set_policy("build.sanitizer.leak", true)
 -- set_policy("build.sanitizer.undefined", true)
 
+option("stats")
+    set_default(false)
+    set_showmenu(true)
+    set_description("Enable hot-path counters and latency histograms")
+    add_defines("MEMBOX_STATS")
+option_end()
+
 target("SV")
     set_kind("static")
     add_languages("c++20")
-    add_files("src/sv_basic.cpp", "src/sv_supervisor.cpp", "src/buddy.cpp")
+    add_files("src/sv_basic.cpp", "src/sv_supervisor.cpp", "src/buddy.cpp", "src/page_cache.cpp",
+              "src/masked_copy.cpp", "src/sv_trace.cpp", "src/stats.cpp")
+    add_options("stats")
     add_packages("spdlog", "fmt")
     add_cxxflags("-fPIC", "-Wall")
+    add_syslinks("pthread", { public = true })
     add_includedirs("include/", { public = true })
 
 target("membox-test")
@@ -18,7 +28,18 @@ target("membox-test")
     add_languages("c++20")
     add_deps("SV")
     add_files("src/main.cpp")
+    add_options("stats")
     add_packages("spdlog", "fmt")
     add_cxxflags("-Wall")
     set_default("false")
 
+
+target("membox-bench")
+    set_kind("binary")
+    add_languages("c++20")
+    add_deps("SV")
+    add_files("src/bench.cpp")
+    add_options("stats")
+    add_packages("spdlog", "fmt")
+    add_cxxflags("-Wall")
+    set_default("false")